@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Runs a benchmark on a fresh fuse4redis mount backed by a private
+# redis-server, so that results do not depend on whatever else the local
+# redis holds. Results are written to stdout and to <tool>-<commit>.<fmt>.
+#
+# usage: ./bench.sh [benchmark options]
+#
+# BENCH (f4r_bench, f4r_mdtest, f4r_memory or f4r_openloop, default
+# f4r_bench), REDIS_PORT (default 6390), MOUNT (default a temporary
+# directory) and FORMAT (json or csv, default json) can be set in the
+# environment.
+#
+# RTT_US emulates a remote redis: fuse4redis then goes through f4r_proxy,
+# which adds that round trip time, plus up to JITTER_US of jitter and a
+# BANDWIDTH limit in bytes per second when set. The label gets "-rtt<N>".
+#
+# MOUNT_OPTS are added to the fuse4redis command line, REDIS_OPTS to the
+# redis-server one, TAG to the label. REDIS_PORT is exported, for tools
+# that also talk to redis directly.
+
+set -e
+
+BENCH=${BENCH:-f4r_bench}
+REDIS_PORT=${REDIS_PORT:-6390}
+export REDIS_PORT
+FORMAT=${FORMAT:-json}
+LABEL=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if ! git diff --quiet HEAD 2>/dev/null; then
+    LABEL="$LABEL-dirty"
+fi
+MOUNT=${MOUNT:-$(mktemp -d /tmp/f4r_bench.XXXXXX)}
+if [ -n "$RTT_US" ]; then
+    LABEL="$LABEL-rtt$RTT_US"
+fi
+if [ -n "$TAG" ]; then
+    LABEL="$LABEL-$TAG"
+fi
+OUT="$BENCH-$LABEL.$FORMAT"
+
+cleanup() {
+    fusermount -u "$MOUNT" 2>/dev/null || true
+    [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null || true
+    [ -n "$REDIS_PID" ] && kill "$REDIS_PID" 2>/dev/null || true
+}
+trap cleanup EXIT INT TERM
+
+# Persistence off: the benchmark measures fuse4redis, not the disk
+redis-server --port "$REDIS_PORT" --bind 127.0.0.1 --save "" --appendonly no \
+             --dir /tmp --logfile "" $REDIS_OPTS >/dev/null &
+REDIS_PID=$!
+until redis-cli -p "$REDIS_PORT" ping >/dev/null 2>&1; do
+    sleep 0.1
+done
+
+PORT=$REDIS_PORT
+if [ -n "$RTT_US" ]; then
+    PORT=$((REDIS_PORT + 1))
+    ./f4r_proxy -l "$PORT" -u 127.0.0.1:"$REDIS_PORT" -d "$RTT_US" \
+                -j "${JITTER_US:-0}" -b "${BANDWIDTH:-0}" &
+    PROXY_PID=$!
+    until redis-cli -p "$PORT" ping >/dev/null 2>&1; do
+        sleep 0.1
+    done
+fi
+
+./fuse4redis -o redis_port="$PORT" $MOUNT_OPTS "$MOUNT"
+until [ -d "$MOUNT/.f4r" ]; do
+    sleep 0.1
+done
+
+./"$BENCH" -f "$FORMAT" -l "$LABEL" "$@" "$MOUNT" | tee "$OUT"
+echo "results in $OUT" >&2
@@ -0,0 +1,298 @@
+/*
+  Cache of an immutable mount ('-o immutable'): file sizes, directory
+  listings and file contents are read from redis once and kept for the
+  life of the mount.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Nothing is ever invalidated: the mount rejects every change, and the
+  data is assumed not to change in redis either. That covers files that
+  do not exist too, so files added to redis later only show after a
+  remount. Contents are kept in blocks of 64 KB. A read that misses any
+  of its blocks fetches all of them in one GETRANGE. Blocks are dropped
+  oldest first once they take more than '-o cache_mb' (default 256) MB;
+  sizes and listings are small and always kept.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "kvs.h"
+#include "log.h"
+#include "stats.h"
+
+#define CACHE_BLOCK     (64 << 10)
+#define CACHE_BUCKETS   65536
+
+struct cache_entry {
+    struct cache_entry *next;       // In its hash bucket
+    struct cache_entry *newer;      // Blocks only, in the order they were added
+    int kind;                       // CACHE_ATTR, CACHE_DIR or CACHE_DATA
+    long long value;                // Size or -errno, or the block number
+    size_t len;                     // Bytes in data
+    char *data;                     // Block contents, or listing as NUL-separated names
+    char name[];
+};
+
+int cache_enabled = 0;
+
+static struct cache_entry *cache_table[CACHE_BUCKETS];
+static struct cache_entry *cache_oldest, *cache_newest;
+static size_t cache_bytes, cache_max;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Listing being collected from kvs_ReadDirectory()
+struct cache_listing {
+    char *names;
+    size_t len, size;
+};
+
+void cache_init(unsigned max_mb)
+{
+    cache_max = (size_t) (max_mb > 0 ? max_mb : 256) << 20;
+    cache_enabled = 1;
+}
+
+static unsigned cache_hash(int kind, const char *name, long long block)
+{
+    uint64_t hash = 14695981039346656037ULL ^ (kind * 31 + (uint64_t) block);
+
+    for (; *name != '\0'; name++)
+        hash = (hash ^ (unsigned char) *name) * 1099511628211ULL;
+    return (hash ^ hash >> 32) % CACHE_BUCKETS;
+}
+
+// Called with cache_lock held. For blocks 'value' is the block number.
+static struct cache_entry *cache_find(int kind, const char *name, long long value)
+{
+    struct cache_entry *e;
+
+    for (e = cache_table[cache_hash(kind, name, kind == CACHE_DATA ? value : 0)]; e != NULL;
+         e = e->next)
+        if (e->kind == kind && (kind != CACHE_DATA || e->value == value) &&
+            strcmp(e->name, name) == 0)
+            return e;
+    return NULL;
+}
+
+static void cache_unlink(struct cache_entry *victim)
+{
+    struct cache_entry **link;
+
+    link = &cache_table[cache_hash(victim->kind, victim->name,
+                                   victim->kind == CACHE_DATA ? victim->value : 0)];
+    while (*link != victim)
+        link = &(*link)->next;
+    *link = victim->next;
+}
+
+// Adds an entry, which takes 'data', unless another thread was first.
+// Called with cache_lock held.
+static void cache_add(int kind, const char *name, long long value, char *data, size_t len)
+{
+    struct cache_entry *e;
+    unsigned b;
+
+    if (cache_find(kind, name, value) != NULL ||
+        (e = malloc(sizeof(struct cache_entry) + strlen(name) + 1)) == NULL) {
+        free(data);
+        return;
+    }
+    strcpy(e->name, name);
+    e->kind = kind;
+    e->value = value;
+    e->data = data;
+    e->len = len;
+    e->newer = NULL;
+    b = cache_hash(kind, name, kind == CACHE_DATA ? value : 0);
+    e->next = cache_table[b];
+    cache_table[b] = e;
+    if (kind != CACHE_DATA)
+        return;
+
+    if (cache_newest != NULL)
+        cache_newest->newer = e;
+    else
+        cache_oldest = e;
+    cache_newest = e;
+    cache_bytes += len;
+    while (cache_bytes > cache_max && cache_oldest != e) {
+        struct cache_entry *victim = cache_oldest;
+
+        cache_oldest = victim->newer;
+        cache_bytes -= victim->len;
+        cache_unlink(victim);
+        free(victim->data);
+        free(victim);
+    }
+}
+
+// Size of a file, or -ENOENT. Asks redis only the first time.
+int cache_length(const char *name, size_t *size)
+{
+    struct cache_entry *e;
+    long long value;
+
+    pthread_mutex_lock(&cache_lock);
+    e = cache_find(CACHE_ATTR, name, 0);
+    value = e != NULL ? e->value : 0;
+    pthread_mutex_unlock(&cache_lock);
+    stats_cache(CACHE_ATTR, e != NULL);
+
+    if (e == NULL) {
+        // Checks the key exists too, a missing one comes back as -ENOENT
+        value = (ssize_t) kvs_GetKeyLength(name);
+        if (value < 0 && value != -ENOENT)
+            return value;       // Errors are not cached, the next call retries
+        pthread_mutex_lock(&cache_lock);
+        cache_add(CACHE_ATTR, name, value, NULL, 0);
+        pthread_mutex_unlock(&cache_lock);
+    }
+    if (value < 0)
+        return value;
+    *size = value;
+    return 0;
+}
+
+static int cache_collect(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    struct cache_listing *l = buf;
+    size_t len = strlen(name) + 1;
+
+    if (l->len + len > l->size) {
+        size_t size = l->size > 0 ? l->size * 2 : 4096;
+        char *names;
+
+        while (size < l->len + len)
+            size *= 2;
+        if ((names = realloc(l->names, size)) == NULL)
+            return 1;
+        l->names = names;
+        l->size = size;
+    }
+    memcpy(l->names + l->len, name, len);
+    l->len += len;
+    return 0;
+}
+
+static int cache_fill(const char *names, size_t len, void *buf, fuse_fill_dir_t filler)
+{
+    const char *name;
+
+    for (name = names; name < names + len; name += strlen(name) + 1)
+        if (filler(buf, name, NULL, 0) != 0)
+            return -ENOMEM;
+    return 0;
+}
+
+// Lists a directory, 'dir' as for kvs_ReadDirectory(). Asks redis only once.
+int cache_readdir(const char *dir, void *buf, fuse_fill_dir_t filler)
+{
+    const char *key = dir != NULL ? dir : "";
+    struct cache_listing l = { NULL, 0, 0 };
+    struct cache_entry *e;
+    int result;
+
+    pthread_mutex_lock(&cache_lock);
+    e = cache_find(CACHE_DIR, key, 0);
+    pthread_mutex_unlock(&cache_lock);
+    stats_cache(CACHE_DIR, e != NULL);
+    if (e != NULL)      // Listings are never dropped, no need to hold the lock
+        return cache_fill(e->data, e->len, buf, filler);
+
+    if ((result = kvs_ReadDirectory(dir, &l, cache_collect)) < 0) {
+        free(l.names);
+        return result;
+    }
+    result = cache_fill(l.names, l.len, buf, filler);
+    pthread_mutex_lock(&cache_lock);
+    cache_add(CACHE_DIR, key, 0, l.names, l.len);
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+// Copies what the cached blocks hold of a read. Returns the bytes copied, or
+// -1 if a block is missing. Called with cache_lock held.
+static int cache_copy(const char *name, char *buf, size_t size, off_t offset)
+{
+    long long block, last = (offset + size - 1) / CACHE_BLOCK;
+    size_t done = 0;
+
+    for (block = offset / CACHE_BLOCK; block <= last; block++) {
+        struct cache_entry *e = cache_find(CACHE_DATA, name, block);
+        size_t in = (offset + done) - block * CACHE_BLOCK, n;
+
+        if (e == NULL)
+            return -1;
+        n = e->len > in ? e->len - in : 0;
+        if (n > size - done)
+            n = size - done;
+        memcpy(buf + done, e->data + in, n);
+        done += n;
+        if (e->len < CACHE_BLOCK)
+            break;      // End of file
+    }
+    return done;
+}
+
+// Reads a file through the block cache
+int cache_read(const char *name, char *buf, size_t size, off_t offset)
+{
+    long long first = offset / CACHE_BLOCK, last, block;
+    size_t span, skip, got, n;
+    char *range;
+    int result;
+
+    if (size == 0)
+        return 0;
+    pthread_mutex_lock(&cache_lock);
+    result = cache_copy(name, buf, size, offset);
+    pthread_mutex_unlock(&cache_lock);
+    stats_cache(CACHE_DATA, result >= 0);
+    if (result >= 0)
+        return result;
+
+    // Fetches every block the read touches, aligned, in one command
+    last = (offset + size - 1) / CACHE_BLOCK;
+    span = (last - first + 1) * CACHE_BLOCK;
+    if ((range = malloc(span)) == NULL)
+        return -ENOMEM;
+    result = kvs_ReadPartialValue(name, range, span, first * CACHE_BLOCK);
+    if (result < 0) {
+        free(range);
+        return result;
+    }
+    got = result;
+    skip = offset - first * CACHE_BLOCK;
+    n = got > skip ? got - skip : 0;
+    if (n > size)
+        n = size;
+    memcpy(buf, range + skip, n);
+
+    // The first short block marks the end of the file, none is kept past it
+    pthread_mutex_lock(&cache_lock);
+    for (block = first; block <= last; block++) {
+        size_t at = (block - first) * CACHE_BLOCK;
+        size_t len = got > at ? got - at : 0;
+        char *data;
+
+        if (len > CACHE_BLOCK)
+            len = CACHE_BLOCK;
+        if ((data = malloc(len > 0 ? len : 1)) == NULL)
+            break;
+        memcpy(data, range + at, len);
+        cache_add(CACHE_DATA, name, block, data, len);
+        if (len < CACHE_BLOCK)
+            break;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(range);
+    return n;
+}
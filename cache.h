@@ -0,0 +1,26 @@
+/*
+  Cache of an immutable mount ('-o immutable'): file sizes, directory
+  listings and file contents are read from redis once and kept for the
+  life of the mount.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <fuse.h>
+#include <sys/types.h>
+
+extern int cache_enabled;
+
+void cache_init(unsigned max_mb);
+
+// These return like their kvs_* counterparts
+int cache_length(const char *name, size_t *size);
+int cache_readdir(const char *dir, void *buf, fuse_fill_dir_t filler);
+int cache_read(const char *name, char *buf, size_t size, off_t offset);
+
+#endif
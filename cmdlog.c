@@ -0,0 +1,99 @@
+/*
+  Command log for tests: with '-o cmdlog' every redis command the KVS
+  layer issues is recorded with the FUSE operation that caused it, and
+  can be read (and cleared) as /.f4r/cmdlog.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Each line is "<seq> <op> <command> <path>". 'seq' numbers FUSE
+  operations, so a test can tell how many commands one getattr cost even
+  when the kernel sent several. Opening the file takes the log and
+  empties it, so a test reads it once before and once after the system
+  call it checks. Meant for tests, so a plain mutex is good enough.
+*/
+
+#include "params.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cmdlog.h"
+#include "ctl.h"
+#include "stats.h"
+
+#define CMDLOG_ENTRIES 4096
+#define CMDLOG_PATH_MAX 128
+
+struct cmdlog_entry {
+    unsigned long long seq;
+    int op;             // -1 outside any FUSE operation
+    int cmd;
+    char path[CMDLOG_PATH_MAX];
+};
+
+int cmdlog_enabled = 0;
+
+static struct cmdlog_entry *cmdlog_ring;
+static unsigned cmdlog_used;
+static unsigned long long cmdlog_dropped, cmdlog_seq;
+static pthread_mutex_t cmdlog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cmdlog_add(int cmd)
+{
+    struct f4r_opctx *op = stats_curop;
+    struct cmdlog_entry *e;
+
+    pthread_mutex_lock(&cmdlog_lock);
+    if (cmdlog_used == CMDLOG_ENTRIES) {
+        cmdlog_dropped++;
+        pthread_mutex_unlock(&cmdlog_lock);
+        return;
+    }
+    e = &cmdlog_ring[cmdlog_used++];
+    e->cmd = cmd;
+    if (op != NULL) {
+        if (op->seq == 0)
+            op->seq = ++cmdlog_seq;
+        e->seq = op->seq;
+        e->op = op->op;
+        strncpy(e->path, op->path != NULL ? op->path : "-", CMDLOG_PATH_MAX - 1);
+        e->path[CMDLOG_PATH_MAX - 1] = '\0';
+    } else {
+        e->seq = 0;
+        e->op = -1;
+        strcpy(e->path, "-");
+    }
+    pthread_mutex_unlock(&cmdlog_lock);
+}
+
+static void cmdlog_render(struct ctl_buf *out)
+{
+    unsigned j;
+
+    pthread_mutex_lock(&cmdlog_lock);
+    if (cmdlog_dropped > 0)
+        ctl_printf(out, "# dropped %llu\n", cmdlog_dropped);
+    for (j = 0; j < cmdlog_used; j++) {
+        struct cmdlog_entry *e = &cmdlog_ring[j];
+
+        ctl_printf(out, "%llu %s %s %s\n", e->seq, e->op >= 0 ? stats_op_names[e->op] : "-",
+                   stats_cmd_names[e->cmd], e->path);
+    }
+    cmdlog_used = 0;
+    cmdlog_dropped = 0;
+    pthread_mutex_unlock(&cmdlog_lock);
+}
+
+void cmdlog_init(int enable)
+{
+    if (!enable)
+        return;
+    cmdlog_ring = calloc(CMDLOG_ENTRIES, sizeof(struct cmdlog_entry));
+    if (cmdlog_ring == NULL)
+        return;
+    cmdlog_enabled = 1;
+    ctl_register("cmdlog", cmdlog_render);
+}
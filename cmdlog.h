@@ -0,0 +1,26 @@
+/*
+  Command log for tests: with '-o cmdlog' every redis command the KVS
+  layer issues is recorded with the FUSE operation that caused it, and
+  can be read (and cleared) as /.f4r/cmdlog.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CMDLOG_H_
+#define _CMDLOG_H_
+
+extern int cmdlog_enabled;
+
+void cmdlog_init(int enable);
+void cmdlog_add(int cmd);
+
+// Called for every redis command. Does nothing unless in test mode.
+static inline void cmdlog_check(int cmd)
+{
+    if (cmdlog_enabled)
+        cmdlog_add(cmd);
+}
+
+#endif
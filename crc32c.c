@@ -0,0 +1,99 @@
+/*
+  CRC-32C (Castagnoli), the checksum of the write-ahead journal and of
+  file blocks.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  On x86-64 CPUs with SSE4.2 the crc32 instruction does the work, eight
+  bytes per instruction. Elsewhere it is table driven, eight bytes per
+  step ("slicing by 8"), with tables built on first use.
+*/
+
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78      // Reflected Castagnoli polynomial
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len);
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len) = crc32c_sw;
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t crc64, word;
+
+    for (; len > 0 && ((uintptr_t) p & 7) != 0; len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    crc64 = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+    for (; len > 0; len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+    uint32_t crc;
+    int j, k;
+
+    for (j = 0; j < 256; j++) {
+        crc = j;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][j] = crc;
+    }
+    for (j = 0; j < 256; j++)
+        for (k = 1; k < 8; k++)
+            crc32c_table[k][j] = (crc32c_table[k - 1][j] >> 8) ^
+                                 crc32c_table[0][crc32c_table[k - 1][j] & 0xff];
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_hw;
+#endif
+}
+
+// Works on the inverted crc, like the crc32 instruction
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    for (; len > 0 && ((uintptr_t) p & 7) != 0; len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+
+        memcpy(&word, p, 8);
+        word ^= crc;    // Little endian: the low byte is the first one
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+    }
+    for (; len > 0; len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, data, len);
+}
@@ -0,0 +1,20 @@
+/*
+  CRC-32C (Castagnoli), the checksum of the write-ahead journal and of
+  file blocks.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Extends 'crc' over 'len' bytes. Start with 0; the result of one call can
+// be passed to the next to checksum data in pieces.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+  Control directory: read-only virtual files under /.f4r that expose
+  fuse4redis internals (statistics and the like) through the mount itself.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The content of a file is rendered once, when it is opened, and kept in
+  the file handle until release. Reading it in several chunks therefore
+  gives a consistent snapshot. Like /proc files, they report size 0 and
+  are opened with direct_io so the kernel does not trust that size.
+*/
+
+#include "ctl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CTL_MAX_FILES 16
+
+struct ctl_file {
+    const char *name;
+    ctl_render_t render;
+};
+
+// Filled at startup before FUSE runs, read-only afterwards
+static struct ctl_file ctl_files[CTL_MAX_FILES];
+static int ctl_nfiles = 0;
+
+void ctl_printf(struct ctl_buf *out, const char *format, ...)
+{
+    va_list ap;
+    int len;
+
+    for (;;) {
+        size_t room = out->size - out->len;
+
+        va_start(ap, format);
+        len = vsnprintf(out->data != NULL ? out->data + out->len : NULL, room, format, ap);
+        va_end(ap);
+        if (len < 0)
+            return;
+        if ((size_t) len < room) {
+            out->len += len;
+            return;
+        }
+
+        room = out->size > 0 ? out->size * 2 : 4096;
+        while (room - out->len <= (size_t) len)
+            room *= 2;
+        char *data = realloc(out->data, room);
+        if (data == NULL)
+            return;     // Output is silently cut short, there is no one to tell
+        out->data = data;
+        out->size = room;
+    }
+}
+
+void ctl_register(const char *name, ctl_render_t render)
+{
+    if (ctl_nfiles < CTL_MAX_FILES) {
+        ctl_files[ctl_nfiles].name = name;
+        ctl_files[ctl_nfiles].render = render;
+        ctl_nfiles++;
+    }
+}
+
+static struct ctl_file *ctl_lookup(const char *path)
+{
+    int j;
+
+    if (strncmp(path, CTL_DIR "/", sizeof(CTL_DIR)) != 0)
+        return NULL;
+    path += sizeof(CTL_DIR);
+    for (j = 0; j < ctl_nfiles; j++)
+        if (strcmp(path, ctl_files[j].name) == 0)
+            return &ctl_files[j];
+    return NULL;
+}
+
+// True for the control directory itself and anything below it
+int ctl_is_path(const char *path)
+{
+    return strncmp(path, CTL_DIR, sizeof(CTL_DIR) - 1) == 0 &&
+           (path[sizeof(CTL_DIR) - 1] == '\0' || path[sizeof(CTL_DIR) - 1] == '/');
+}
+
+int ctl_getattr(const char *path, struct stat *statbuf)
+{
+    memset(statbuf, 0, sizeof(*statbuf));
+    if (strcmp(path, CTL_DIR) == 0)
+        statbuf->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    else if (ctl_lookup(path) != NULL)
+        statbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    else
+        return -ENOENT;
+    statbuf->st_uid = getuid();
+    statbuf->st_gid = getgid();
+    statbuf->st_blksize = 512;
+    return 0;
+}
+
+int ctl_open(const char *path, struct fuse_file_info *fi)
+{
+    struct ctl_file *file = ctl_lookup(path);
+    struct ctl_buf *content;
+
+    if (file == NULL)
+        return strcmp(path, CTL_DIR) == 0 ? -EISDIR : -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+
+    content = calloc(1, sizeof(struct ctl_buf));
+    if (content == NULL)
+        return -ENOMEM;
+    file->render(content);
+
+    fi->fh = (uint64_t) (uintptr_t) content;
+    fi->direct_io = 1;
+    return 0;
+}
+
+int ctl_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct ctl_buf *content = (struct ctl_buf *) (uintptr_t) fi->fh;
+
+    if (content == NULL)
+        return -EBADF;
+    if (offset >= (off_t) content->len)
+        return 0;
+    if (size > content->len - offset)
+        size = content->len - offset;
+    memcpy(buf, content->data + offset, size);
+    return size;
+}
+
+int ctl_release(const char *path, struct fuse_file_info *fi)
+{
+    struct ctl_buf *content = (struct ctl_buf *) (uintptr_t) fi->fh;
+
+    if (content != NULL) {
+        free(content->data);
+        free(content);
+        fi->fh = 0;
+    }
+    return 0;
+}
+
+int ctl_readdir(const char *path, void *buf, fuse_fill_dir_t filler)
+{
+    int j;
+
+    if (strcmp(path, CTL_DIR) != 0)
+        return -ENOTDIR;
+    for (j = 0; j < ctl_nfiles; j++)
+        if (filler(buf, ctl_files[j].name, NULL, 0) != 0)
+            return -ENOMEM;
+    return 0;
+}
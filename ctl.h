@@ -0,0 +1,42 @@
+/*
+  Control directory: read-only virtual files under /.f4r that expose
+  fuse4redis internals (statistics and the like) through the mount itself.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CTL_H_
+#define _CTL_H_
+
+#include "params.h"
+
+#include <fuse.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CTL_DIR         "/.f4r"
+#define CTL_DIR_NAME    ".f4r"
+
+// Growable text buffer the virtual files are rendered into
+struct ctl_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+typedef void (*ctl_render_t)(struct ctl_buf *out);
+
+void ctl_printf(struct ctl_buf *out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void ctl_register(const char *name, ctl_render_t render);
+
+int ctl_is_path(const char *path);
+int ctl_getattr(const char *path, struct stat *statbuf);
+int ctl_open(const char *path, struct fuse_file_info *fi);
+int ctl_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int ctl_release(const char *path, struct fuse_file_info *fi);
+int ctl_readdir(const char *path, void *buf, fuse_fill_dir_t filler);
+
+#endif
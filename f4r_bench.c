@@ -0,0 +1,387 @@
+/*
+  Throughput benchmark: fio-style workloads run in a directory, normally
+  a fuse4redis mount, with machine readable results so that performance
+  can be compared commit by commit. bench.sh sets up redis and the mount.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Workloads:
+    seqwrite, seqread   sequential I/O of a whole file, at every block size
+    randread, randwrite 4 KB I/O at random aligned offsets
+    mixed               4 KB random I/O, 70% reads
+    syncwrite           4 KB random writes, each followed by fsync(), which
+                        costs what the mount's '-o fsync' mode costs
+    smallfiles          create, read and delete many 4 KB files, one
+                        result per phase
+  Every job ('-j') works on a file of its own. Random and mixed workloads
+  run for '-t' seconds. Results go to stdout as one JSON object per line,
+  or as CSV with '-f csv'.
+
+  usage: f4r_bench [-s filesize] [-b bs,bs...] [-j jobs] [-t seconds]
+                   [-n files] [-w workload,...] [-f json|csv] [-l label] dir
+*/
+
+#define _XOPEN_SOURCE 500
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "hist.h"
+
+#define BENCH_MAX_BS    8
+#define BENCH_RANDOM_BS 4096
+
+enum bench_kind { SEQWRITE, SEQREAD, RANDREAD, RANDWRITE, MIXED, SYNCWRITE, SMALLFILES };
+
+static const char *bench_names[] = {
+    "seqwrite", "seqread", "randread", "randwrite", "mixed", "syncwrite", "smallfiles"
+};
+
+struct bench_job {
+    pthread_t thread;
+    int id;
+    enum bench_kind kind;
+    int phase;              // smallfiles: 0 create, 1 read, 2 delete
+    size_t bs;
+    struct hist latency;
+    uint64_t bytes, errors;
+};
+
+static const char *dir;
+static size_t fileSize = 16 << 20;
+static size_t blockSizes[BENCH_MAX_BS] = { 4096, 65536, 1 << 20 };
+static int blockSizeCount = 3;
+static int jobs = 1;
+static int seconds = 5;
+static int smallFiles = 1000;
+static int csv;
+static const char *label = "";
+
+static char *bench_buffer( size_t size)
+{
+    char *buf = malloc( size);
+
+    if ( buf == NULL) {
+        perror( "malloc");
+        exit( -1);
+    }
+    memset( buf, 'b', size);
+    return buf;
+}
+
+// Size suffixes k, m and g are accepted
+static size_t bench_size( const char *s)
+{
+    char *end;
+    size_t size = strtoul( s, &end, 10);
+
+    switch ( *end) {
+    case 'g': case 'G': size <<= 10;    // Fall through
+    case 'm': case 'M': size <<= 10;    // Fall through
+    case 'k': case 'K': size <<= 10;
+    }
+    return size;
+}
+
+static void bench_file( const struct bench_job *job, int n, char *name, size_t size)
+{
+    if ( n < 0)
+        snprintf( name, size, "%s/bench.%d", dir, job->id);
+    else
+        snprintf( name, size, "%s/bench.%d.%d", dir, job->id, n);
+}
+
+// Every operation goes through here, so all workloads time the same way
+static void bench_op( struct bench_job *job, ssize_t result, size_t expected, uint64_t start)
+{
+    hist_record( &job->latency, hist_now() - start);
+    if ( result < 0 || (size_t) result != expected)
+        job->errors++;
+    else
+        job->bytes += expected;
+}
+
+static void bench_sequential( struct bench_job *job, int fd, char *buf)
+{
+    off_t offset;
+
+    for ( offset = 0; offset + job->bs <= fileSize; offset += job->bs) {
+        uint64_t start = hist_now();
+        ssize_t result = job->kind == SEQWRITE ? pwrite( fd, buf, job->bs, offset)
+                                               : pread( fd, buf, job->bs, offset);
+
+        bench_op( job, result, job->bs, start);
+    }
+}
+
+static void bench_random( struct bench_job *job, int fd, char *buf)
+{
+    uint64_t end = hist_now() + (uint64_t) seconds * 1000000000;
+    unsigned seed = job->id + 1;
+    size_t blocks = fileSize / job->bs;
+
+    while ( hist_now() < end) {
+        off_t offset = (off_t) (rand_r( &seed) % blocks) * job->bs;
+        int write = job->kind == RANDWRITE || job->kind == SYNCWRITE ||
+                    ( job->kind == MIXED && rand_r( &seed) % 100 >= 70);
+        uint64_t start = hist_now();
+        ssize_t result = write ? pwrite( fd, buf, job->bs, offset)
+                               : pread( fd, buf, job->bs, offset);
+
+        if ( job->kind == SYNCWRITE && result >= 0 && fsync( fd) != 0)
+            result = -1;
+        bench_op( job, result, job->bs, start);
+    }
+}
+
+static void bench_smallfiles( struct bench_job *job, char *buf)
+{
+    char name[PATH_MAX];
+    int n;
+
+    for ( n = 0; n < smallFiles; n++) {
+        uint64_t start = hist_now();
+        ssize_t result = -1;
+        int fd;
+
+        bench_file( job, n, name, sizeof(name));
+        switch ( job->phase) {
+        case 0:
+            if ( ( fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+                result = write( fd, buf, job->bs);
+                close( fd);
+            }
+            break;
+        case 1:
+            if ( ( fd = open( name, O_RDONLY)) >= 0) {
+                result = read( fd, buf, job->bs);
+                close( fd);
+            }
+            break;
+        case 2:
+            result = unlink( name) == 0 ? (ssize_t) job->bs : -1;
+            break;
+        }
+        bench_op( job, result, job->bs, start);
+    }
+}
+
+static void *bench_thread( void *arg)
+{
+    struct bench_job *job = arg;
+    char name[PATH_MAX], *buf = bench_buffer( job->bs);
+    int fd;
+
+    if ( job->kind == SMALLFILES) {
+        bench_smallfiles( job, buf);
+        free( buf);
+        return NULL;
+    }
+    bench_file( job, -1, name, sizeof(name));
+    fd = open( name, job->kind == SEQWRITE ? O_WRONLY | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if ( fd < 0) {
+        fprintf( stderr, "%s: %s\n", name, strerror(errno));
+        job->errors++;
+    } else {
+        if ( job->kind == SEQWRITE || job->kind == SEQREAD)
+            bench_sequential( job, fd, buf);
+        else
+            bench_random( job, fd, buf);
+        close( fd);
+    }
+    free( buf);
+    return NULL;
+}
+
+static void bench_report( const char *workload, size_t bs, struct bench_job *all, uint64_t nanos)
+{
+    static int header;
+    static struct hist latency;
+    uint64_t bytes = 0, errors = 0;
+    double secs = nanos / 1e9;
+    int j;
+
+    memset( &latency, 0, sizeof(latency));
+    for ( j = 0; j < jobs; j++) {
+        hist_merge( &latency, &all[j].latency);
+        bytes += all[j].bytes;
+        errors += all[j].errors;
+    }
+
+    if ( csv) {
+        if ( !header++)
+            printf( "label,workload,bs,jobs,ops,errors,bytes,seconds,iops,mbps,"
+                    "lat_mean_us,lat_p50_us,lat_p99_us,lat_p999_us,lat_max_us\n");
+        printf( "%s,%s,%zu,%d,%llu,%llu,%llu,%.3f,%.1f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                label, workload, bs, jobs, (unsigned long long) latency.count,
+                (unsigned long long) errors, (unsigned long long) bytes, secs,
+                latency.count / secs, bytes / secs / 1048576,
+                hist_mean( &latency) / 1000.0, hist_percentile( &latency, 50.0) / 1000.0,
+                hist_percentile( &latency, 99.0) / 1000.0,
+                hist_percentile( &latency, 99.9) / 1000.0, latency.max / 1000.0);
+    } else
+        printf( "{\"label\":\"%s\",\"workload\":\"%s\",\"bs\":%zu,\"jobs\":%d,"
+                "\"ops\":%llu,\"errors\":%llu,\"bytes\":%llu,\"seconds\":%.3f,"
+                "\"iops\":%.1f,\"mbps\":%.2f,\"lat_mean_us\":%.1f,\"lat_p50_us\":%.1f,"
+                "\"lat_p99_us\":%.1f,\"lat_p999_us\":%.1f,\"lat_max_us\":%.1f}\n",
+                label, workload, bs, jobs, (unsigned long long) latency.count,
+                (unsigned long long) errors, (unsigned long long) bytes, secs,
+                latency.count / secs, bytes / secs / 1048576,
+                hist_mean( &latency) / 1000.0, hist_percentile( &latency, 50.0) / 1000.0,
+                hist_percentile( &latency, 99.0) / 1000.0,
+                hist_percentile( &latency, 99.9) / 1000.0, latency.max / 1000.0);
+    fflush( stdout);
+}
+
+// Runs one workload with every job in parallel and reports it
+static void bench_run( enum bench_kind kind, int phase, size_t bs, const char *name)
+{
+    struct bench_job *all = calloc( jobs, sizeof(struct bench_job));
+    uint64_t start;
+    int j;
+
+    if ( all == NULL) {
+        perror( "calloc");
+        exit( -1);
+    }
+    start = hist_now();
+    for ( j = 0; j < jobs; j++) {
+        all[j].id = j;
+        all[j].kind = kind;
+        all[j].phase = phase;
+        all[j].bs = bs;
+        if ( pthread_create( &all[j].thread, NULL, bench_thread, &all[j]) != 0) {
+            perror( "pthread_create");
+            exit( -1);
+        }
+    }
+    for ( j = 0; j < jobs; j++)
+        pthread_join( all[j].thread, NULL);
+    bench_report( name, bs, all, hist_now() - start);
+    free( all);
+}
+
+// Random workloads need files to work on, written here and not timed
+static void bench_fill( void)
+{
+    char name[PATH_MAX], *buf = bench_buffer( 1 << 20);
+    size_t done;
+    int j, fd;
+
+    for ( j = 0; j < jobs; j++) {
+        snprintf( name, sizeof(name), "%s/bench.%d", dir, j);
+        if ( ( fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            perror( name);
+            exit( -1);
+        }
+        for ( done = 0; done < fileSize; done += 1 << 20)
+            if ( pwrite( fd, buf, fileSize - done < 1 << 20 ? fileSize - done : 1 << 20, done) < 0) {
+                perror( name);
+                exit( -1);
+            }
+        close( fd);
+    }
+    free( buf);
+}
+
+static void bench_cleanup( void)
+{
+    char name[PATH_MAX];
+    int j;
+
+    for ( j = 0; j < jobs; j++) {
+        snprintf( name, sizeof(name), "%s/bench.%d", dir, j);
+        unlink( name);
+    }
+}
+
+int main( int argc, char *argv[])
+{
+    static const char *phases[] = { "smallfiles-create", "smallfiles-read", "smallfiles-delete" };
+    char all[] = "seqwrite,seqread,randread,randwrite,mixed,syncwrite,smallfiles";
+    char *workloads = all, *w, *save;
+    int opt, k, p;
+
+    while ( ( opt = getopt( argc, argv, "s:b:j:t:n:w:f:l:")) != -1) {
+        switch ( opt) {
+        case 's':
+            fileSize = bench_size( optarg);
+            break;
+        case 'b':
+            for ( blockSizeCount = 0, w = strtok_r( optarg, ",", &save);
+                  w != NULL && blockSizeCount < BENCH_MAX_BS; w = strtok_r( NULL, ",", &save))
+                blockSizes[blockSizeCount++] = bench_size( w);
+            break;
+        case 'j':
+            jobs = atoi( optarg);
+            break;
+        case 't':
+            seconds = atoi( optarg);
+            break;
+        case 'n':
+            smallFiles = atoi( optarg);
+            break;
+        case 'w':
+            workloads = optarg;
+            break;
+        case 'f':
+            csv = strcmp( optarg, "csv") == 0;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if ( optind != argc - 1 || jobs < 1 || fileSize < BENCH_RANDOM_BS || blockSizeCount == 0)
+        goto usage;
+    dir = argv[optind];
+
+    for ( w = strtok_r( workloads, ",", &save); w != NULL; w = strtok_r( NULL, ",", &save)) {
+        for ( k = 0; k <= SMALLFILES && strcmp( w, bench_names[k]) != 0; k++)
+            ;
+        switch ( k) {
+        case SEQWRITE:
+        case SEQREAD:
+            if ( k == SEQREAD)
+                bench_fill();
+            for ( p = 0; p < blockSizeCount; p++)
+                bench_run( k, 0, blockSizes[p], bench_names[k]);
+            break;
+        case RANDREAD:
+        case RANDWRITE:
+        case MIXED:
+        case SYNCWRITE:
+            bench_fill();
+            bench_run( k, 0, BENCH_RANDOM_BS, bench_names[k]);
+            break;
+        case SMALLFILES:
+            for ( p = 0; p < 3; p++)
+                bench_run( SMALLFILES, p, BENCH_RANDOM_BS, phases[p]);
+            break;
+        default:
+            fprintf( stderr, "unknown workload %s\n", w);
+            goto usage;
+        }
+        bench_cleanup();
+    }
+    return 0;
+
+usage:
+    fprintf( stderr, "usage: f4r_bench [-s filesize] [-b bs,bs...] [-j jobs] [-t seconds]\n"
+                     "                 [-n files] [-w workload,...] [-f json|csv] [-l label] dir\n"
+                     "workloads: seqwrite seqread randread randwrite mixed syncwrite smallfiles\n");
+    return 1;
+}
@@ -0,0 +1,251 @@
+/*
+  Microbenchmark of the KVS layer against mock_redis, an in-process
+  stand-in for redis-server, so client side costs can be measured
+  without a server, a mount or the noise either adds.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Every kvs_* call is repeated '-n' times, and reported per call:
+    ns        wall clock time, round trip over loopback included
+    cpu_ns    CPU used by the process, without the mock server thread
+    allocs    malloc/calloc/realloc calls, without the mock server thread
+    cmds      redis commands issued
+    bytes     redis protocol bytes sent and received
+  Results go to stdout as one JSON object per line, or CSV with '-f csv'.
+  Errors are logged to stderr.
+
+  usage: f4r_kvsbench [-n calls] [-f json|csv] [-l label]
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "kvs.h"
+#include "mock_redis.h"
+#include "stats.h"
+
+///////////////////////////////////////////////////////////
+//
+// Allocation counting. These replace the C library's malloc for the whole
+// program, hiredis included, and count calls from every thread but the
+// mock server's.
+//
+extern void *__libc_malloc( size_t size);
+extern void *__libc_calloc( size_t count, size_t size);
+extern void *__libc_realloc( void *ptr, size_t size);
+
+static unsigned long long allocs;
+
+static inline void bench_count_alloc( void)
+{
+    if ( !mock_redis_thread)
+        __atomic_fetch_add( &allocs, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc( size_t size)
+{
+    bench_count_alloc();
+    return __libc_malloc( size);
+}
+
+void *calloc( size_t count, size_t size)
+{
+    bench_count_alloc();
+    return __libc_calloc( count, size);
+}
+
+void *realloc( void *ptr, size_t size)
+{
+    bench_count_alloc();
+    return __libc_realloc( ptr, size);
+}
+
+///////////////////////////////////////////////////////////
+//
+// The calls measured. Each gets the iteration number and a buffer.
+//
+#define BENCH_KEYS  64      // Keys the calls cycle through
+#define BENCH_LARGE 65536
+
+static char keys[BENCH_KEYS][16], renamed[BENCH_KEYS][16];
+static char buffer[BENCH_LARGE];
+
+static int bench_filler( void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    return 0;
+}
+
+static int call_exists( long n)
+{
+    return kvs_KeyExists( keys[n % BENCH_KEYS]);
+}
+
+static int call_strlen( long n)
+{
+    kvs_GetKeyLength( keys[n % BENCH_KEYS]);
+    return 0;
+}
+
+static int call_create( long n)
+{
+    return kvs_CreateEmptyKey( renamed[n % BENCH_KEYS]);
+}
+
+static int call_create_delete( long n)
+{
+    int result = kvs_CreateEmptyKey( renamed[n % BENCH_KEYS]);
+
+    return result < 0 ? result : kvs_DeleteKey( renamed[n % BENCH_KEYS]);
+}
+
+// There and back, so the other calls still find the key
+static int call_rename( long n)
+{
+    int result = kvs_RenameKey( keys[n % BENCH_KEYS], renamed[n % BENCH_KEYS]);
+
+    return result < 0 ? result : kvs_RenameKey( renamed[n % BENCH_KEYS], keys[n % BENCH_KEYS]);
+}
+
+static int call_read4k( long n)
+{
+    return kvs_ReadPartialValue( keys[n % BENCH_KEYS], buffer, 4096, 4096 * (n % 16));
+}
+
+static int call_write4k( long n)
+{
+    return kvs_WritePartialValue( keys[n % BENCH_KEYS], buffer, 4096, 4096 * (n % 16));
+}
+
+static int call_read64k( long n)
+{
+    return kvs_ReadPartialValue( keys[n % BENCH_KEYS], buffer, BENCH_LARGE, 0);
+}
+
+static int call_write64k( long n)
+{
+    return kvs_WritePartialValue( keys[n % BENCH_KEYS], buffer, BENCH_LARGE, 0);
+}
+
+static int call_truncate( long n)
+{
+    return kvs_TruncateKey( keys[n % BENCH_KEYS], BENCH_LARGE - 4096 * (n % 2));
+}
+
+static int call_readdir( long n)
+{
+    return kvs_ReadDirectory( NULL, NULL, bench_filler);
+}
+
+static const struct {
+    const char *name;
+    int (*call)( long n);
+    int scale;          // Divides the number of calls, for the slow ones
+} benches[] = {
+    { "KeyExists", call_exists, 1 },
+    { "GetKeyLength", call_strlen, 1 },
+    { "CreateEmptyKey", call_create, 1 },
+    { "CreateEmptyKey+DeleteKey", call_create_delete, 1 },
+    { "RenameKey*2", call_rename, 1 },
+    { "ReadPartialValue_4k", call_read4k, 1 },
+    { "WritePartialValue_4k", call_write4k, 1 },
+    { "ReadPartialValue_64k", call_read64k, 4 },
+    { "WritePartialValue_64k", call_write64k, 4 },
+    { "TruncateKey", call_truncate, 4 },
+    { "ReadDirectory", call_readdir, 16 },
+};
+
+static uint64_t bench_cpu_ns( void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec - mock_redis_cpu_ns();
+}
+
+int main( int argc, char *argv[])
+{
+    const char *label = "";
+    long calls = 100000, n, count;
+    int csv = 0, opt, port, j, errors;
+
+    while ( ( opt = getopt( argc, argv, "n:f:l:")) != -1) {
+        switch ( opt) {
+        case 'n':
+            calls = atol( optarg);
+            break;
+        case 'f':
+            csv = strcmp( optarg, "csv") == 0;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            fprintf( stderr, "usage: f4r_kvsbench [-n calls] [-f json|csv] [-l label]\n");
+            return 1;
+        }
+    }
+
+    port = mock_redis_start();
+    if ( port < 0) {
+        fprintf( stderr, "cannot start mock redis: %s\n", strerror(-port));
+        exit( -1);
+    }
+    kvs_init( "127.0.0.1", port, 1);
+    if ( kvs_StartIoThread() != 0)
+        exit( -1);
+
+    memset( buffer, 'k', sizeof(buffer));
+    for ( j = 0; j < BENCH_KEYS; j++) {
+        snprintf( keys[j], sizeof(keys[j]), "bench%d", j);
+        snprintf( renamed[j], sizeof(renamed[j]), "other%d", j);
+        kvs_WritePartialValue( keys[j], buffer, BENCH_LARGE, 0);
+    }
+
+    if ( csv)
+        printf( "label,call,calls,errors,ns,cpu_ns,allocs,cmds,bytes_out,bytes_in\n");
+    for ( j = 0; j < sizeof(benches) / sizeof(benches[0]); j++) {
+        struct f4r_opctx ctx;
+        unsigned long long allocated;
+        uint64_t nanos, cpu;
+
+        count = calls / benches[j].scale;
+        if ( count < 1)
+            count = 1;
+        memset( &ctx, 0, sizeof(ctx));
+        stats_curop = &ctx;         // Collects commands and bytes
+        errors = 0;
+        allocated = __atomic_load_n( &allocs, __ATOMIC_RELAXED);
+        cpu = bench_cpu_ns();
+        nanos = hist_now();
+        for ( n = 0; n < count; n++)
+            errors += benches[j].call( n) < 0;
+        nanos = hist_now() - nanos;
+        cpu = bench_cpu_ns() - cpu;
+        allocated = __atomic_load_n( &allocs, __ATOMIC_RELAXED) - allocated;
+        stats_curop = NULL;
+
+        printf( csv ? "%s,%s,%ld,%d,%.0f,%.0f,%.2f,%.2f,%.1f,%.1f\n"
+                    : "{\"label\":\"%s\",\"call\":\"%s\",\"calls\":%ld,\"errors\":%d,"
+                      "\"ns\":%.0f,\"cpu_ns\":%.0f,\"allocs\":%.2f,\"cmds\":%.2f,"
+                      "\"bytes_out\":%.1f,\"bytes_in\":%.1f}\n",
+                label, benches[j].name, count, errors, (double) nanos / count,
+                (double) cpu / count, (double) allocated / count,
+                (double) ctx.cmds / count, (double) ctx.bytes_out / count,
+                (double) ctx.bytes_in / count);
+        fflush( stdout);
+    }
+
+    kvs_Cleanup();
+    mock_redis_stop();
+    return 0;
+}
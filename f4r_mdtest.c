@@ -0,0 +1,261 @@
+/*
+  Metadata benchmark in the style of mdtest: several processes create,
+  stat, list, rename and unlink many files in a directory, normally a
+  fuse4redis mount, at growing file counts to show how each phase scales
+  with the size of the keyspace.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  For every file count in '-n' the files are split among '-p' processes,
+  which run each phase together: create (open O_CREAT|O_EXCL and close),
+  stat, readdir (every process lists the whole directory '-r' times),
+  rename and unlink. Every phase reports ops/s and latency percentiles.
+  When the directory is a fuse4redis mount, the redis commands issued per
+  operation are taken from '.f4r/roundtrips' before and after the phase.
+  Results go to stdout as one JSON object per line, or CSV with '-f csv'.
+
+  usage: f4r_mdtest [-p procs] [-n count,count...] [-r listings]
+                    [-f json|csv] [-l label] dir
+*/
+
+#define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "hist.h"
+
+#define MD_MAX_COUNTS 8
+
+enum md_phase { CREATE, STAT, READDIR, RENAME, UNLINK, PHASES };
+
+static const char *md_phases[] = { "create", "stat", "readdir", "rename", "unlink" };
+
+// One per process, in memory shared with the parent
+struct md_result {
+    struct hist latency;
+    unsigned long long errors, entries;
+};
+
+static const char *dir;
+static long counts[MD_MAX_COUNTS] = { 10000 };
+static int countCount = 1;
+static int procs = 4;
+static int listings = 1;
+static int csv;
+static const char *label = "";
+
+// Redis commands issued so far by the mount, -1 if this is not a mount
+static long long md_redis_cmds( void)
+{
+    char name[PATH_MAX], line[256], op[64];
+    unsigned long long count, cmds, total = 0;
+    FILE *f;
+
+    snprintf( name, sizeof(name), "%s/.f4r/roundtrips", dir);
+    if ( ( f = fopen( name, "r")) == NULL)
+        return -1;
+    while ( fgets( line, sizeof(line), f) != NULL)
+        if ( line[0] != '#' && sscanf( line, "%63s %llu %llu", op, &count, &cmds) == 3)
+            total += cmds;
+    fclose( f);
+    return total;
+}
+
+static void md_name( char *name, size_t size, int renamed, int proc, long n)
+{
+    snprintf( name, size, "%s/%s.%d.%ld", dir, renamed ? "mr" : "md", proc, n);
+}
+
+// Runs one phase on this process' share of the files
+static void md_child( enum md_phase phase, int proc, long files, struct md_result *res)
+{
+    char name[PATH_MAX], newname[PATH_MAX];
+    struct stat statbuf;
+    struct dirent *entry;
+    long n, first = files * proc / procs, last = files * (proc + 1) / procs;
+    int result, fd;
+    DIR *d;
+
+    if ( phase == READDIR) {
+        first = 0;
+        last = listings;
+    }
+    for ( n = first; n < last; n++) {
+        uint64_t start = hist_now();
+
+        switch ( phase) {
+        case CREATE:
+            md_name( name, sizeof(name), 0, proc, n);
+            if ( ( result = fd = open( name, O_WRONLY | O_CREAT | O_EXCL, 0644)) >= 0)
+                result = close( fd);
+            break;
+        case STAT:
+            md_name( name, sizeof(name), 0, proc, n);
+            result = stat( name, &statbuf);
+            break;
+        case READDIR:
+            result = -1;
+            if ( ( d = opendir( dir)) != NULL) {
+                while ( ( entry = readdir( d)) != NULL)
+                    res->entries++;
+                result = closedir( d);
+            }
+            break;
+        case RENAME:
+            md_name( name, sizeof(name), 0, proc, n);
+            md_name( newname, sizeof(newname), 1, proc, n);
+            result = rename( name, newname);
+            break;
+        default:
+            md_name( name, sizeof(name), 1, proc, n);
+            result = unlink( name);
+            break;
+        }
+        hist_record( &res->latency, hist_now() - start);
+        if ( result < 0)
+            res->errors++;
+    }
+}
+
+static void md_report( long files, enum md_phase phase, struct md_result *all,
+                       uint64_t nanos, long long cmds)
+{
+    static int header;
+    static struct hist latency;
+    unsigned long long errors = 0, entries = 0;
+    double secs = nanos / 1e9, perOp;
+    int j;
+
+    memset( &latency, 0, sizeof(latency));
+    for ( j = 0; j < procs; j++) {
+        hist_merge( &latency, &all[j].latency);
+        errors += all[j].errors;
+        entries += all[j].entries;
+    }
+    perOp = cmds >= 0 && latency.count > 0 ? (double) cmds / latency.count : -1;
+
+    if ( csv) {
+        if ( !header++)
+            printf( "label,files,procs,phase,ops,errors,entries,seconds,ops_per_sec,"
+                    "lat_mean_us,lat_p50_us,lat_p99_us,lat_max_us,redis_cmds_per_op\n");
+        printf( "%s,%ld,%d,%s,%llu,%llu,%llu,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f\n",
+                label, files, procs, md_phases[phase], (unsigned long long) latency.count,
+                errors, entries, secs, latency.count / secs,
+                hist_mean( &latency) / 1000.0, hist_percentile( &latency, 50.0) / 1000.0,
+                hist_percentile( &latency, 99.0) / 1000.0, latency.max / 1000.0, perOp);
+    } else
+        printf( "{\"label\":\"%s\",\"files\":%ld,\"procs\":%d,\"phase\":\"%s\",\"ops\":%llu,"
+                "\"errors\":%llu,\"entries\":%llu,\"seconds\":%.3f,\"ops_per_sec\":%.1f,"
+                "\"lat_mean_us\":%.1f,\"lat_p50_us\":%.1f,\"lat_p99_us\":%.1f,"
+                "\"lat_max_us\":%.1f,\"redis_cmds_per_op\":%.2f}\n",
+                label, files, procs, md_phases[phase], (unsigned long long) latency.count,
+                errors, entries, secs, latency.count / secs,
+                hist_mean( &latency) / 1000.0, hist_percentile( &latency, 50.0) / 1000.0,
+                hist_percentile( &latency, 99.0) / 1000.0, latency.max / 1000.0, perOp);
+    fflush( stdout);
+}
+
+// Forks the processes for one phase. They block on a pipe until all of
+// them exist, so the phase is timed from a common start.
+static void md_phase( long files, enum md_phase phase, struct md_result *all)
+{
+    long long cmdsBefore = md_redis_cmds(), cmdsAfter;
+    uint64_t start, nanos;
+    int go[2], j, status;
+    char c;
+
+    memset( all, 0, procs * sizeof(struct md_result));
+    if ( pipe( go) != 0) {
+        perror( "pipe");
+        exit( -1);
+    }
+    for ( j = 0; j < procs; j++) {
+        switch ( fork()) {
+        case -1:
+            perror( "fork");
+            exit( -1);
+        case 0:
+            close( go[1]);
+            if ( read( go[0], &c, 1) < 0)   // Returns 0 when the parent closes it
+                _exit( 1);
+            md_child( phase, j, files, &all[j]);
+            _exit( 0);
+        }
+    }
+    close( go[0]);
+    start = hist_now();
+    close( go[1]);
+    for ( j = 0; j < procs; j++)
+        if ( wait( &status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf( stderr, "a %s process failed\n", md_phases[phase]);
+    nanos = hist_now() - start;
+
+    cmdsAfter = md_redis_cmds();
+    md_report( files, phase, all, nanos,
+               cmdsBefore >= 0 && cmdsAfter >= 0 ? cmdsAfter - cmdsBefore : -1);
+}
+
+int main( int argc, char *argv[])
+{
+    struct md_result *all;
+    char *w, *save;
+    int opt, j, p;
+
+    while ( ( opt = getopt( argc, argv, "p:n:r:f:l:")) != -1) {
+        switch ( opt) {
+        case 'p':
+            procs = atoi( optarg);
+            break;
+        case 'n':
+            for ( countCount = 0, w = strtok_r( optarg, ",", &save);
+                  w != NULL && countCount < MD_MAX_COUNTS; w = strtok_r( NULL, ",", &save))
+                counts[countCount++] = atol( w);
+            break;
+        case 'r':
+            listings = atoi( optarg);
+            break;
+        case 'f':
+            csv = strcmp( optarg, "csv") == 0;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if ( optind != argc - 1 || procs < 1 || countCount == 0 || listings < 1)
+        goto usage;
+    dir = argv[optind];
+
+    all = mmap( NULL, procs * sizeof(struct md_result), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if ( all == MAP_FAILED) {
+        perror( "mmap");
+        exit( -1);
+    }
+    for ( j = 0; j < countCount; j++)
+        for ( p = 0; p < PHASES; p++)
+            md_phase( counts[j], p, all);
+    return 0;
+
+usage:
+    fprintf( stderr, "usage: f4r_mdtest [-p procs] [-n count,count...] [-r listings]\n"
+                     "                  [-f json|csv] [-l label] dir\n");
+    return 1;
+}
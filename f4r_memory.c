@@ -0,0 +1,323 @@
+/*
+  Memory footprint benchmark: what redis spends to store files of each
+  size class written through a fuse4redis mount, and how fragmented its
+  heap gets once those files are overwritten in place.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  For every size in '-s' (10 bytes to 1 GB by default) files are written
+  until '-m' MB are stored, or '-n' files, whichever comes first, but at
+  least one. Redis is asked directly ('-r host:port', by default the
+  REDIS_PORT of bench.sh on localhost) for INFO memory before and after,
+  and for MEMORY USAGE of every file's key. Then every file is overwritten
+  '-w' times with writes of up to 4 KB at random offsets, which reach redis
+  as SETRANGE, and the memory numbers are taken again. Each phase reports:
+    mem_per_file    growth of used_memory per file
+    mem_per_byte    the same per byte stored, 1.0 would be no overhead
+    usage_per_file  MEMORY USAGE of the keys, the value's own cost
+    usage_per_byte  the same per byte stored
+    rss, frag_ratio used_memory_rss and mem_fragmentation_ratio
+  Every file is one redis string, the only layout fuse4redis has. Redis
+  refuses strings over 512 MB unless proto-max-bulk-len is raised, which
+  'make memory' does. The files are deleted after each size class.
+  Results go to stdout as one JSON object per line, or CSV with '-f csv'.
+
+  usage: f4r_memory [-s size,size...] [-n files] [-m mb] [-w passes]
+                    [-r host:port] [-f json|csv] [-l label] dir
+*/
+
+#define _XOPEN_SOURCE 500
+
+#include <errno.h>
+#include <fcntl.h>
+#include <hiredis.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#define MEM_MAX_SIZES 16
+#define MEM_CHUNK (1 << 20)         // Largest write() when creating files
+#define MEM_OVERWRITE 4096          // Largest write() when overwriting
+
+struct mem_info {
+    long long used;                 // used_memory
+    long long rss;                  // used_memory_rss
+    double frag;                    // mem_fragmentation_ratio
+};
+
+static const char *dir;
+static size_t sizes[MEM_MAX_SIZES] = {
+    10, 100, 1 << 10, 10 << 10, 100 << 10, 1 << 20, 10 << 20, 100 << 20, 1 << 30
+};
+static int sizeCount = 9;
+static long maxFiles = 1000;
+static size_t budget = (size_t) 512 << 20;
+static int passes = 1;
+static int csv;
+static const char *label = "";
+static redisContext *redis;
+
+static size_t mem_size( const char *s)
+{
+    char *end;
+    size_t size = strtoull( s, &end, 10);
+
+    switch ( *end) {
+    case 'g': case 'G':
+        size <<= 10;
+        // Falls through
+    case 'm': case 'M':
+        size <<= 10;
+        // Falls through
+    case 'k': case 'K':
+        size <<= 10;
+    }
+    return size;
+}
+
+static int mem_info( struct mem_info *info)
+{
+    redisReply *reply = redisCommand( redis, "INFO memory");
+    char *line;
+
+    if ( reply == NULL || reply->type != REDIS_REPLY_STRING) {
+        fprintf( stderr, "INFO memory failed: %s\n", reply != NULL ? reply->str : redis->errstr);
+        if ( reply != NULL)
+            freeReplyObject( reply);
+        return -1;
+    }
+    memset( info, 0, sizeof(*info));
+    for ( line = reply->str; line != NULL && *line != '\0'; line = strchr( line, '\n')) {
+        if ( *line == '\n')
+            line++;
+        sscanf( line, "used_memory:%lld", &info->used);
+        sscanf( line, "used_memory_rss:%lld", &info->rss);
+        sscanf( line, "mem_fragmentation_ratio:%lf", &info->frag);
+    }
+    freeReplyObject( reply);
+    return 0;
+}
+
+// MEMORY USAGE of a file's key, 0 if redis does not know it
+static long long mem_usage( const char *key)
+{
+    redisReply *reply = redisCommand( redis, "MEMORY USAGE %s", key);
+    long long usage = 0;
+
+    if ( reply != NULL && reply->type == REDIS_REPLY_INTEGER)
+        usage = reply->integer;
+    if ( reply != NULL)
+        freeReplyObject( reply);
+    return usage;
+}
+
+static void mem_name( char *name, size_t namesize, int key, size_t size, long n)
+{
+    snprintf( name, namesize, "%s%smem.%zu.%ld", key ? "" : dir, key ? "" : "/", size, n);
+}
+
+static int mem_write( int fd, const char *buf, size_t len, off_t offset)
+{
+    ssize_t done;
+
+    while ( len > 0) {
+        if ( ( done = pwrite( fd, buf, len, offset)) < 0) {
+            if ( errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += done;
+        len -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+// Creates one file. Returns 0 or -1.
+static int mem_create( const char *name, size_t size, const char *buf)
+{
+    size_t done;
+    int fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if ( fd < 0)
+        return -1;
+    for ( done = 0; done < size; done += MEM_CHUNK)
+        if ( mem_write( fd, buf, size - done < MEM_CHUNK ? size - done : MEM_CHUNK, done) < 0) {
+            close( fd);
+            return -1;
+        }
+    return close( fd);
+}
+
+// Overwrites a file in place, 'passes' times over, at random offsets
+static int mem_overwrite( const char *name, size_t size, const char *buf, unsigned *seed)
+{
+    size_t len = size < MEM_OVERWRITE ? size : MEM_OVERWRITE, writes, j;
+    int fd = open( name, O_WRONLY);
+
+    if ( fd < 0)
+        return -1;
+    writes = (size + len - 1) / len * passes;
+    for ( j = 0; j < writes; j++)
+        if ( mem_write( fd, buf, len, rand_r( seed) % (size - len + 1)) < 0) {
+            close( fd);
+            return -1;
+        }
+    return close( fd);
+}
+
+static void mem_report( const char *phase, size_t size, long files, long errors,
+                        struct mem_info *before, struct mem_info *after, long long usage)
+{
+    static int header;
+    double stored = (double) size * files, grown = after->used - before->used;
+    double perFile = files > 0 ? grown / files : -1, perByte = stored > 0 ? grown / stored : -1;
+    double usagePerFile = files > 0 ? (double) usage / files : -1;
+    double usagePerByte = stored > 0 ? usage / stored : -1;
+
+    if ( csv) {
+        if ( !header++)
+            printf( "label,layout,phase,size,files,errors,bytes,used_memory,mem_per_file,"
+                    "mem_per_byte,usage_per_file,usage_per_byte,rss,frag_ratio\n");
+        printf( "%s,string,%s,%zu,%ld,%ld,%.0f,%lld,%.1f,%.3f,%.1f,%.3f,%lld,%.2f\n",
+                label, phase, size, files, errors, stored, after->used, perFile, perByte,
+                usagePerFile, usagePerByte, after->rss, after->frag);
+    } else
+        printf( "{\"label\":\"%s\",\"layout\":\"string\",\"phase\":\"%s\",\"size\":%zu,"
+                "\"files\":%ld,\"errors\":%ld,\"bytes\":%.0f,\"used_memory\":%lld,"
+                "\"mem_per_file\":%.1f,\"mem_per_byte\":%.3f,\"usage_per_file\":%.1f,"
+                "\"usage_per_byte\":%.3f,\"rss\":%lld,\"frag_ratio\":%.2f}\n",
+                label, phase, size, files, errors, stored, after->used, perFile, perByte,
+                usagePerFile, usagePerByte, after->rss, after->frag);
+    fflush( stdout);
+}
+
+static void mem_run( size_t size)
+{
+    char name[PATH_MAX], key[64], *buf;
+    struct mem_info before, written, overwritten;
+    long files = budget / size, n, errors = 0;
+    long long usage = 0;
+    unsigned seed = size;
+
+    if ( files > maxFiles)
+        files = maxFiles;
+    if ( files < 1)
+        files = 1;
+    if ( ( buf = malloc( MEM_CHUNK)) == NULL) {
+        perror( "malloc");
+        exit( -1);
+    }
+    memset( buf, 'm', MEM_CHUNK);
+
+    if ( mem_info( &before) != 0)
+        exit( -1);
+    for ( n = 0; n < files; n++) {
+        mem_name( name, sizeof(name), 0, size, n);
+        if ( mem_create( name, size, buf) != 0) {
+            fprintf( stderr, "%s: %s\n", name, strerror(errno));
+            errors++;
+        }
+    }
+    for ( n = 0; n < files; n++) {
+        mem_name( key, sizeof(key), 1, size, n);
+        usage += mem_usage( key);
+    }
+    if ( mem_info( &written) != 0)
+        exit( -1);
+    mem_report( "write", size, files, errors, &before, &written, usage);
+
+    errors = 0;
+    usage = 0;
+    for ( n = 0; n < files; n++) {
+        mem_name( name, sizeof(name), 0, size, n);
+        if ( mem_overwrite( name, size, buf, &seed) != 0) {
+            fprintf( stderr, "%s: %s\n", name, strerror(errno));
+            errors++;
+        }
+        mem_name( key, sizeof(key), 1, size, n);
+        usage += mem_usage( key);
+    }
+    // used_memory_rss is sampled by the server's cron, let it catch up
+    sleep( 1);
+    if ( mem_info( &overwritten) != 0)
+        exit( -1);
+    mem_report( "overwrite", size, files, errors, &before, &overwritten, usage);
+
+    for ( n = 0; n < files; n++) {
+        mem_name( name, sizeof(name), 0, size, n);
+        unlink( name);
+    }
+    free( buf);
+}
+
+int main( int argc, char *argv[])
+{
+    const char *host = "127.0.0.1";
+    char *w, *save, *colon;
+    int port = getenv( "REDIS_PORT") != NULL ? atoi( getenv( "REDIS_PORT")) : 6379;
+    int opt, j;
+
+    while ( ( opt = getopt( argc, argv, "s:n:m:w:r:f:l:")) != -1) {
+        switch ( opt) {
+        case 's':
+            for ( sizeCount = 0, w = strtok_r( optarg, ",", &save);
+                  w != NULL && sizeCount < MEM_MAX_SIZES; w = strtok_r( NULL, ",", &save))
+                sizes[sizeCount++] = mem_size( w);
+            break;
+        case 'n':
+            maxFiles = atol( optarg);
+            break;
+        case 'm':
+            budget = strtoull( optarg, NULL, 10) << 20;
+            break;
+        case 'w':
+            passes = atoi( optarg);
+            break;
+        case 'r':
+            host = optarg;
+            if ( ( colon = strrchr( optarg, ':')) != NULL) {
+                *colon = '\0';
+                port = atoi( colon + 1);
+            }
+            break;
+        case 'f':
+            csv = strcmp( optarg, "csv") == 0;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if ( optind != argc - 1 || sizeCount == 0 || maxFiles < 1 || passes < 0)
+        goto usage;
+    for ( j = 0; j < sizeCount; j++)
+        if ( sizes[j] == 0)
+            goto usage;
+    dir = argv[optind];
+
+    redis = redisConnect( host, port);
+    if ( redis == NULL || redis->err) {
+        fprintf( stderr, "cannot connect to redis at %s:%d: %s\n", host, port,
+                 redis != NULL ? redis->errstr : "out of memory");
+        exit( -1);
+    }
+    for ( j = 0; j < sizeCount; j++)
+        mem_run( sizes[j]);
+    redisFree( redis);
+    return 0;
+
+usage:
+    fprintf( stderr, "usage: f4r_memory [-s size,size...] [-n files] [-m mb] [-w passes]\n"
+                     "                  [-r host:port] [-f json|csv] [-l label] dir\n"
+                     "sizes take a k, m or g suffix\n");
+    return 1;
+}
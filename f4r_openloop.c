@@ -0,0 +1,329 @@
+/*
+  Open-loop latency benchmark: operations are issued on a fuse4redis
+  mount at a fixed arrival rate, whether or not earlier ones have
+  finished, and their latency is measured from when they were due.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A closed-loop client, like f4r_bench or f4r_test, waits for each
+  operation before issuing the next, so when the file system stalls it
+  stops asking and the stall is counted once instead of for every request
+  that would have queued behind it (coordinated omission). Here operation
+  n is due at n / rate seconds from the start, and is run by the first of
+  '-c' threads to be free. Its latency counts from that due time, so time
+  spent waiting for a thread is included. Latency from when it actually
+  started is reported as well: the gap between both is queueing.
+
+  For every rate in '-R' (operations per second) the workload runs for
+  '-t' seconds, on '-F' files of '-s' MB. Workloads: read, write, stat
+  and mix (70% reads, 30% writes), all with 4 KB I/O at random offsets.
+  The sweep stops at the first rate the mount cannot sustain (it completes
+  less than 95% of the operations due), so the last line is the
+  saturation point; '-a' runs every rate regardless.
+  Results go to stdout as one JSON object per line, or CSV with '-f csv'.
+
+  usage: f4r_openloop [-R rate,rate...] [-t seconds] [-c threads] [-F files]
+                      [-s filesize_mb] [-w workload] [-a] [-f json|csv]
+                      [-l label] dir
+*/
+
+#define _XOPEN_SOURCE 500
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "hist.h"
+
+#define OL_MAX_RATES 32
+#define OL_MAX_THREADS 1024
+#define OL_MAX_FILES 1024
+#define OL_BS 4096
+
+enum ol_kind { READ, WRITE, STAT, MIX, KINDS };
+
+static const char *ol_names[] = { "read", "write", "stat", "mix" };
+
+struct ol_thread {
+    pthread_t thread;
+    struct hist latency;        // From when the operation was due
+    struct hist service;        // From when it was started
+    uint64_t errors;
+    uint64_t lag;               // Largest delay between due and started
+    uint64_t last;              // When its last operation finished
+};
+
+static const char *dir;
+static long rates[OL_MAX_RATES] = { 500, 1000, 2000, 4000, 8000, 16000, 32000, 64000 };
+static int rateCount = 8;
+static int seconds = 10;
+static int threads = 64;
+static int fileCount = 16;
+static size_t fileSize = 4 << 20;
+static enum ol_kind kind = READ;
+static int all;
+static int csv;
+static const char *label = "";
+
+static int fds[OL_MAX_FILES];
+
+// State of the running point, shared by its threads
+static uint64_t start, interval, due;   // Nanoseconds
+static uint64_t next;                   // Next operation to issue
+
+static void ol_file( int n, char *name, size_t size)
+{
+    snprintf( name, size, "%s/openloop.%d", dir, n);
+}
+
+static void ol_sleep_until( uint64_t when)
+{
+    uint64_t now;
+
+    while ( ( now = hist_now()) < when) {
+        struct timespec ts = { (when - now) / 1000000000, (when - now) % 1000000000 };
+
+        nanosleep( &ts, NULL);
+    }
+}
+
+static int ol_op( uint64_t n, char *buf)
+{
+    int file = n % fileCount;
+    off_t offset = (off_t) (n * 2654435761U % (fileSize / OL_BS)) * OL_BS;
+    char name[PATH_MAX];
+    struct stat statbuf;
+
+    switch ( kind) {
+    case STAT:
+        ol_file( file, name, sizeof(name));
+        return stat( name, &statbuf) == 0 ? 0 : -1;
+    case WRITE:
+        return pwrite( fds[file], buf, OL_BS, offset) == OL_BS ? 0 : -1;
+    case MIX:
+        if ( n % 10 < 3)
+            return pwrite( fds[file], buf, OL_BS, offset) == OL_BS ? 0 : -1;
+        // Falls through
+    default:
+        return pread( fds[file], buf, OL_BS, offset) == OL_BS ? 0 : -1;
+    }
+}
+
+static void *ol_thread( void *arg)
+{
+    struct ol_thread *t = arg;
+    char buf[OL_BS];
+
+    memset( buf, 'o', sizeof(buf));
+    for ( ;;) {
+        uint64_t n = __atomic_fetch_add( &next, 1, __ATOMIC_RELAXED);
+        uint64_t scheduled = start + n * interval, started, done;
+
+        if ( scheduled >= due)
+            break;
+        ol_sleep_until( scheduled);
+        started = hist_now();
+        if ( ol_op( n, buf) != 0)
+            t->errors++;
+        done = hist_now();
+        hist_record( &t->latency, done - scheduled);
+        hist_record( &t->service, done - started);
+        if ( started - scheduled > t->lag)
+            t->lag = started - scheduled;
+        t->last = done;
+    }
+    return NULL;
+}
+
+static void ol_prepare( void)
+{
+    char name[PATH_MAX], *buf = calloc( 1, 1 << 20);
+    size_t done;
+    int j;
+
+    for ( j = 0; j < fileCount; j++) {
+        ol_file( j, name, sizeof(name));
+        if ( buf == NULL || ( fds[j] = open( name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+            perror( name);
+            exit( -1);
+        }
+        for ( done = 0; done < fileSize; done += 1 << 20)
+            if ( pwrite( fds[j], buf, fileSize - done < 1 << 20 ? fileSize - done : 1 << 20,
+                         done) < 0) {
+                perror( name);
+                exit( -1);
+            }
+    }
+    free( buf);
+}
+
+static void ol_cleanup( void)
+{
+    char name[PATH_MAX];
+    int j;
+
+    for ( j = 0; j < fileCount; j++) {
+        close( fds[j]);
+        ol_file( j, name, sizeof(name));
+        unlink( name);
+    }
+}
+
+// Runs one rate. Returns 1 if the mount could not keep up with it.
+static int ol_run( long rate, struct ol_thread *pool)
+{
+    static int header;
+    static struct hist latency, service;
+    unsigned long long errors = 0;
+    uint64_t lag = 0, last = 0;
+    double secs, achieved;
+    int j, saturated;
+
+    memset( pool, 0, threads * sizeof(struct ol_thread));
+    memset( &latency, 0, sizeof(latency));
+    memset( &service, 0, sizeof(service));
+    interval = 1000000000ULL / rate;
+    next = 0;
+    start = hist_now() + 10000000;      // Every thread is ready by then
+    due = start + seconds * 1000000000ULL;
+    for ( j = 0; j < threads; j++)
+        if ( pthread_create( &pool[j].thread, NULL, ol_thread, &pool[j]) != 0) {
+            perror( "pthread_create");
+            exit( -1);
+        }
+    for ( j = 0; j < threads; j++) {
+        pthread_join( pool[j].thread, NULL);
+        hist_merge( &latency, &pool[j].latency);
+        hist_merge( &service, &pool[j].service);
+        errors += pool[j].errors;
+        if ( pool[j].lag > lag)
+            lag = pool[j].lag;
+        if ( pool[j].last > last)
+            last = pool[j].last;
+    }
+
+    // Operations still running at the end stretch the time it took
+    secs = (last > due ? last - start : due - start) / 1e9;
+    achieved = latency.count / secs;
+    saturated = achieved < 0.95 * rate;
+
+    if ( csv) {
+        if ( !header++)
+            printf( "label,workload,threads,rate,achieved,ops,errors,lat_p50_us,lat_p90_us,"
+                    "lat_p99_us,lat_p999_us,lat_max_us,svc_p50_us,svc_p99_us,max_lag_us,"
+                    "saturated\n");
+        printf( "%s,%s,%d,%ld,%.1f,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%d\n",
+                label, ol_names[kind], threads, rate, achieved,
+                (unsigned long long) latency.count, errors,
+                hist_percentile( &latency, 50.0) / 1000.0,
+                hist_percentile( &latency, 90.0) / 1000.0,
+                hist_percentile( &latency, 99.0) / 1000.0,
+                hist_percentile( &latency, 99.9) / 1000.0, latency.max / 1000.0,
+                hist_percentile( &service, 50.0) / 1000.0,
+                hist_percentile( &service, 99.0) / 1000.0, lag / 1000.0, saturated);
+    } else
+        printf( "{\"label\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"rate\":%ld,"
+                "\"achieved\":%.1f,\"ops\":%llu,\"errors\":%llu,\"lat_p50_us\":%.1f,"
+                "\"lat_p90_us\":%.1f,\"lat_p99_us\":%.1f,\"lat_p999_us\":%.1f,"
+                "\"lat_max_us\":%.1f,\"svc_p50_us\":%.1f,\"svc_p99_us\":%.1f,"
+                "\"max_lag_us\":%.1f,\"saturated\":%s}\n",
+                label, ol_names[kind], threads, rate, achieved,
+                (unsigned long long) latency.count, errors,
+                hist_percentile( &latency, 50.0) / 1000.0,
+                hist_percentile( &latency, 90.0) / 1000.0,
+                hist_percentile( &latency, 99.0) / 1000.0,
+                hist_percentile( &latency, 99.9) / 1000.0, latency.max / 1000.0,
+                hist_percentile( &service, 50.0) / 1000.0,
+                hist_percentile( &service, 99.0) / 1000.0, lag / 1000.0,
+                saturated ? "true" : "false");
+    fflush( stdout);
+    return saturated;
+}
+
+int main( int argc, char *argv[])
+{
+    struct ol_thread *pool;
+    char *w, *save;
+    int opt, k, r;
+
+    while ( ( opt = getopt( argc, argv, "R:t:c:F:s:w:af:l:")) != -1) {
+        switch ( opt) {
+        case 'R':
+            for ( rateCount = 0, w = strtok_r( optarg, ",", &save);
+                  w != NULL && rateCount < OL_MAX_RATES; w = strtok_r( NULL, ",", &save))
+                rates[rateCount++] = atol( w);
+            break;
+        case 't':
+            seconds = atoi( optarg);
+            break;
+        case 'c':
+            threads = atoi( optarg);
+            break;
+        case 'F':
+            fileCount = atoi( optarg);
+            break;
+        case 's':
+            fileSize = strtoul( optarg, NULL, 10) << 20;
+            break;
+        case 'w':
+            for ( k = 0; k < KINDS && strcmp( optarg, ol_names[k]) != 0; k++)
+                ;
+            if ( k == KINDS)
+                goto usage;
+            kind = k;
+            break;
+        case 'a':
+            all = 1;
+            break;
+        case 'f':
+            csv = strcmp( optarg, "csv") == 0;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if ( optind != argc - 1 || rateCount == 0 || seconds < 1 || fileSize < OL_BS ||
+         threads < 1 || threads > OL_MAX_THREADS || fileCount < 1 || fileCount > OL_MAX_FILES)
+        goto usage;
+    for ( r = 0; r < rateCount; r++)
+        if ( rates[r] < 1 || rates[r] > 1000000000)
+            goto usage;
+    dir = argv[optind];
+
+    if ( ( pool = calloc( threads, sizeof(struct ol_thread))) == NULL) {
+        perror( "calloc");
+        exit( -1);
+    }
+    // Default timer slack would wake threads up to 50us after an operation
+    // is due, and that would be counted as latency. Threads inherit this.
+    prctl( PR_SET_TIMERSLACK, 1);
+    ol_prepare();
+    for ( r = 0; r < rateCount; r++)
+        if ( ol_run( rates[r], pool) && !all)
+            break;
+    ol_cleanup();
+    free( pool);
+    return 0;
+
+usage:
+    fprintf( stderr, "usage: f4r_openloop [-R rate,rate...] [-t seconds] [-c threads] [-F files]\n"
+                     "                    [-s filesize_mb] [-w workload] [-a] [-f json|csv]\n"
+                     "                    [-l label] dir\n"
+                     "workloads: read write stat mix\n");
+    return 1;
+}
@@ -0,0 +1,325 @@
+/*
+  TCP proxy that adds network latency, jitter and a bandwidth limit
+  between fuse4redis and redis-server, so that a remote redis can be
+  emulated on one machine.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Every accepted connection gets one to the upstream server and four
+  threads: for each direction, one reads and stamps every chunk with the
+  time it is due, and one delivers chunks when due. Pipelined requests
+  thus overlap in flight just like on a real link, instead of each one
+  waiting for the previous to be delayed. The round trip time is split
+  evenly between both directions; jitter is added per chunk but never
+  reorders data. The bandwidth limit applies to each direction.
+
+  usage: f4r_proxy [-l port] [-u host:port] [-d rtt_us] [-j jitter_us]
+                   [-b bytes_per_sec]
+*/
+
+#define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE     // getaddrinfo() and friends
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "hist.h"
+
+#define PROXY_CHUNK 16384
+
+struct proxy_chunk {
+    struct proxy_chunk *next;
+    uint64_t due;
+    size_t len;
+    char data[PROXY_CHUNK];
+};
+
+// One direction of a connection
+struct proxy_pipe {
+    int from, to;
+    unsigned seed;
+    struct proxy_chunk *head, *tail;
+    int eof;
+    uint64_t lastDue;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_t reader, writer;
+};
+
+struct proxy_conn {
+    struct proxy_pipe up, down;
+};
+
+static const char *upstreamHost = "127.0.0.1";
+static const char *upstreamPort = "6379";
+static uint64_t delay;          // One way, nanoseconds
+static uint64_t jitter;         // Nanoseconds
+static uint64_t bandwidth;      // Bytes per second, 0 for unlimited
+
+static void proxy_sleep_until( uint64_t due)
+{
+    uint64_t now;
+
+    while ( ( now = hist_now()) < due) {
+        struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+
+        nanosleep( &ts, NULL);
+    }
+}
+
+static void *proxy_reader( void *arg)
+{
+    struct proxy_pipe *p = arg;
+
+    for ( ;;) {
+        struct proxy_chunk *chunk = malloc( sizeof(struct proxy_chunk));
+        ssize_t len;
+        uint64_t due;
+
+        if ( chunk == NULL)
+            break;
+        len = read( p->from, chunk->data, PROXY_CHUNK);
+        if ( len < 0 && errno == EINTR) {
+            free( chunk);
+            continue;
+        }
+        if ( len <= 0) {
+            free( chunk);
+            break;
+        }
+        due = hist_now() + delay;
+        if ( jitter > 0)
+            due += (uint64_t) rand_r( &p->seed) % jitter;
+        if ( due < p->lastDue)      // Jitter must not reorder the stream
+            due = p->lastDue;
+        p->lastDue = due;
+
+        chunk->next = NULL;
+        chunk->due = due;
+        chunk->len = len;
+        pthread_mutex_lock( &p->lock);
+        if ( p->tail != NULL)
+            p->tail->next = chunk;
+        else
+            p->head = chunk;
+        p->tail = chunk;
+        pthread_cond_signal( &p->ready);
+        pthread_mutex_unlock( &p->lock);
+    }
+
+    pthread_mutex_lock( &p->lock);
+    p->eof = 1;
+    pthread_cond_signal( &p->ready);
+    pthread_mutex_unlock( &p->lock);
+    return NULL;
+}
+
+static void *proxy_writer( void *arg)
+{
+    struct proxy_pipe *p = arg;
+    uint64_t linkFree = 0;      // When the emulated link is idle again
+
+    for ( ;;) {
+        struct proxy_chunk *chunk;
+        size_t done;
+
+        pthread_mutex_lock( &p->lock);
+        while ( p->head == NULL && !p->eof)
+            pthread_cond_wait( &p->ready, &p->lock);
+        chunk = p->head;
+        if ( chunk != NULL && ( p->head = chunk->next) == NULL)
+            p->tail = NULL;
+        pthread_mutex_unlock( &p->lock);
+        if ( chunk == NULL)
+            break;
+
+        if ( bandwidth > 0) {
+            uint64_t start = chunk->due > linkFree ? chunk->due : linkFree;
+
+            linkFree = start + chunk->len * 1000000000ULL / bandwidth;
+            proxy_sleep_until( linkFree);
+        } else
+            proxy_sleep_until( chunk->due);
+
+        for ( done = 0; done < chunk->len; ) {
+            ssize_t len = write( p->to, chunk->data + done, chunk->len - done);
+
+            if ( len < 0 && errno == EINTR)
+                continue;
+            if ( len <= 0)
+                break;
+            done += len;
+        }
+        if ( done < chunk->len) {
+            free( chunk);
+            shutdown( p->from, SHUT_RD);    // Stops the reader as well
+            break;
+        }
+        free( chunk);
+    }
+    shutdown( p->to, SHUT_WR);
+    return NULL;
+}
+
+static int proxy_pipe_start( struct proxy_pipe *p, int from, int to)
+{
+    p->from = from;
+    p->to = to;
+    p->seed = from * 7919 + to;
+    pthread_mutex_init( &p->lock, NULL);
+    pthread_cond_init( &p->ready, NULL);
+    if ( pthread_create( &p->reader, NULL, proxy_reader, p) != 0)
+        return -1;
+    if ( pthread_create( &p->writer, NULL, proxy_writer, p) != 0)
+        return -1;
+    return 0;
+}
+
+static void proxy_pipe_finish( struct proxy_pipe *p)
+{
+    struct proxy_chunk *chunk;
+
+    pthread_join( p->reader, NULL);
+    pthread_join( p->writer, NULL);
+    while ( ( chunk = p->head) != NULL) {   // Left over if the writer failed
+        p->head = chunk->next;
+        free( chunk);
+    }
+    pthread_mutex_destroy( &p->lock);
+    pthread_cond_destroy( &p->ready);
+}
+
+static int proxy_connect( void)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, one = 1;
+
+    memset( &hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ( getaddrinfo( upstreamHost, upstreamPort, &hints, &res) != 0)
+        return -1;
+    for ( ai = res; ai != NULL; ai = ai->ai_next) {
+        if ( ( fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if ( connect( fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close( fd);
+        fd = -1;
+    }
+    freeaddrinfo( res);
+    if ( fd >= 0)
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Serves one client until both directions are closed
+static void *proxy_conn_thread( void *arg)
+{
+    struct proxy_conn *conn = arg;
+    int client = conn->up.from, server = proxy_connect();
+
+    if ( server < 0) {
+        fprintf( stderr, "f4r_proxy: cannot connect to %s:%s\n", upstreamHost, upstreamPort);
+        close( client);
+        free( conn);
+        return NULL;
+    }
+    if ( proxy_pipe_start( &conn->up, client, server) != 0 ||
+         proxy_pipe_start( &conn->down, server, client) != 0) {
+        perror( "f4r_proxy: pthread_create");
+        exit( -1);
+    }
+    proxy_pipe_finish( &conn->up);
+    proxy_pipe_finish( &conn->down);
+    close( client);
+    close( server);
+    free( conn);
+    return NULL;
+}
+
+int main( int argc, char *argv[])
+{
+    struct sockaddr_in addr;
+    int listenPort = 6380, opt, listener, one = 1;
+    char *colon;
+
+    while ( ( opt = getopt( argc, argv, "l:u:d:j:b:")) != -1) {
+        switch ( opt) {
+        case 'l':
+            listenPort = atoi( optarg);
+            break;
+        case 'u':
+            upstreamHost = optarg;
+            if ( ( colon = strrchr( optarg, ':')) != NULL) {
+                *colon = '\0';
+                upstreamPort = colon + 1;
+            }
+            break;
+        case 'd':
+            delay = strtoull( optarg, NULL, 10) * 1000 / 2;
+            break;
+        case 'j':
+            jitter = strtoull( optarg, NULL, 10) * 1000;
+            break;
+        case 'b':
+            bandwidth = strtoull( optarg, NULL, 10);
+            break;
+        default:
+            fprintf( stderr, "usage: f4r_proxy [-l port] [-u host:port] [-d rtt_us] [-j jitter_us]\n"
+                             "                 [-b bytes_per_sec]\n");
+            return 1;
+        }
+    }
+    signal( SIGPIPE, SIG_IGN);
+
+    listener = socket( AF_INET, SOCK_STREAM, 0);
+    memset( &addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK);
+    addr.sin_port = htons( listenPort);
+    setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ( listener < 0 || bind( listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+         listen( listener, 16) != 0) {
+        perror( "f4r_proxy: listen");
+        return 1;
+    }
+
+    for ( ;;) {
+        struct proxy_conn *conn;
+        pthread_t thread;
+        int client = accept( listener, NULL, NULL);
+
+        if ( client < 0) {
+            if ( errno == EINTR)
+                continue;
+            perror( "f4r_proxy: accept");
+            return 1;
+        }
+        setsockopt( client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if ( ( conn = calloc( 1, sizeof(struct proxy_conn))) == NULL) {
+            close( client);
+            continue;
+        }
+        conn->up.from = client;
+        if ( pthread_create( &thread, NULL, proxy_conn_thread, conn) != 0) {
+            close( client);
+            free( conn);
+            continue;
+        }
+        pthread_detach( thread);
+    }
+}
@@ -0,0 +1,538 @@
+/*
+  Replays a workload trace recorded with '-o trace_file=' (see trace.h),
+  either against a mounted file system or straight against redis through
+  the fuse4redis KVS layer, and reports throughput and latency.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Every thread number in the trace is replayed by a thread of its own.
+  A number is only reused after its thread exited, so the concurrency of
+  the original workload is kept. Operations are issued at
+  their recorded time divided by the speed factor, or back to back with
+  '-x 0'. Paths are not recorded, each one becomes a file named after its
+  hash. With '-c' the files the trace uses without creating them are
+  created first, large enough for the reads done on them.
+
+  usage: f4r_replay [-x factor] [-c] (-m mountdir | -r host[:port] [-n conns]) tracefile
+*/
+
+#include "params.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "hist.h"
+#include "kvs.h"
+#include "stats.h"
+#include "trace.h"
+
+#define REPLAY_FDS 4096     // Open file cache for -m, a power of 2
+
+struct replay_thread {
+    pthread_t thread;
+    struct trace_record **ops;
+    size_t count, size;
+    struct hist latency;
+    uint64_t errors, skipped;
+};
+
+static const char *mountDir;        // -m
+static double speed = 1.0;          // -x
+static uint64_t replayStart;
+
+static struct trace_record *records;
+static size_t recordCount;
+static struct replay_thread *threads;
+static int threadCount;
+
+// An open file, closed once neither the cache nor a replay thread in the
+// middle of an operation on it holds it
+struct replay_file {
+    int fd;
+    int refs;
+};
+
+static struct {
+    uint64_t hash;
+    struct replay_file *file;
+} fdCache[REPLAY_FDS];
+static pthread_mutex_t fdLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The replayed name of a recorded path: "f" and the hash in hex, as a
+// key, or as a path below the mount directory.
+static void replay_name( uint64_t hash, char *name, size_t size)
+{
+    if ( mountDir != NULL)
+        snprintf( name, size, "%s/f%016" PRIx64, mountDir, hash);
+    else
+        snprintf( name, size, "f%016" PRIx64, hash);
+}
+
+static int replay_load( const char *file)
+{
+    struct trace_header header;
+    FILE *f = fopen( file, "r");
+    size_t size = 0;
+
+    if ( f == NULL) {
+        perror( file);
+        return -1;
+    }
+    if ( fread( &header, sizeof(header), 1, f) != 1 ||
+         memcmp( header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+         header.record_size != sizeof(struct trace_record)) {
+        fprintf( stderr, "%s: not a fuse4redis trace\n", file);
+        fclose( f);
+        return -1;
+    }
+    for ( ;;) {
+        if ( recordCount == size) {
+            size = size ? size * 2 : 4096;
+            records = realloc( records, size * sizeof(struct trace_record));
+            if ( records == NULL) {
+                perror( "realloc");
+                exit( -1);
+            }
+        }
+        if ( fread( &records[recordCount], sizeof(struct trace_record), 1, f) != 1)
+            break;
+        recordCount++;
+    }
+    fclose( f);
+    return 0;
+}
+
+// Splits the trace by the thread that recorded each operation
+static void replay_split( void)
+{
+    size_t j;
+
+    for ( j = 0; j < recordCount; j++)
+        if ( records[j].thread >= threadCount)
+            threadCount = records[j].thread + 1;
+    threads = calloc( threadCount, sizeof(struct replay_thread));
+    if ( threads == NULL) {
+        perror( "calloc");
+        exit( -1);
+    }
+    for ( j = 0; j < recordCount; j++) {
+        struct replay_thread *t = &threads[records[j].thread];
+
+        if ( t->count == t->size) {
+            t->size = t->size ? t->size * 2 : 256;
+            t->ops = realloc( t->ops, t->size * sizeof(struct trace_record *));
+            if ( t->ops == NULL) {
+                perror( "realloc");
+                exit( -1);
+            }
+        }
+        t->ops[t->count++] = &records[j];
+    }
+}
+
+static int replay_by_path( const void *a, const void *b)
+{
+    const struct trace_record *x = *(struct trace_record * const *) a,
+                              *y = *(struct trace_record * const *) b;
+
+    if ( x->path_hash != y->path_hash)
+        return x->path_hash < y->path_hash ? -1 : 1;
+    return x < y ? -1 : x > y;  // Keeps the recorded order within a path
+}
+
+// Creates the files used, but not created, by the trace. Their size is
+// the end of the furthest read before the trace creates them itself,
+// so replayed reads return data.
+static void replay_prepare( void)
+{
+    struct trace_record **byPath = malloc( recordCount * sizeof(struct trace_record *));
+    size_t j, k, prepared = 0;
+    char name[PATH_MAX];
+
+    if ( byPath == NULL) {
+        perror( "malloc");
+        exit( -1);
+    }
+    for ( j = 0; j < recordCount; j++)
+        byPath[j] = &records[j];
+    qsort( byPath, recordCount, sizeof(struct trace_record *), replay_by_path);
+
+    for ( j = 0; j < recordCount; j = k) {
+        uint64_t hash = byPath[j]->path_hash, end = 0;
+        int created = 0, needed = 0;
+
+        for ( k = j; k < recordCount && byPath[k]->path_hash == hash; k++) {
+            const struct trace_record *r = byPath[k];
+
+            if ( created)
+                continue;
+            if ( r->op == OP_MKNOD || ( r->op == OP_OPEN && ( r->size & O_CREAT)))
+                created = 1;
+            else
+                needed = 1;
+            if ( r->op == OP_READ && r->offset + r->size > end)
+                end = r->offset + r->size;
+        }
+        if ( hash == 0 || hash == trace_hash( "/") || !needed)
+            continue;
+
+        replay_name( hash, name, sizeof(name));
+        if ( mountDir != NULL) {
+            int fd = open( name, O_WRONLY | O_CREAT, 0644);
+
+            if ( fd < 0 || ftruncate( fd, end) != 0)
+                fprintf( stderr, "cannot prepare %s: %s\n", name, strerror(errno));
+            if ( fd >= 0)
+                close( fd);
+        } else if ( kvs_CreateEmptyKey( name) < 0 ||
+                    ( end > 0 && kvs_AppendZeroedBytes( name, end) < 0))
+            fprintf( stderr, "cannot prepare key %s\n", name);
+        prepared++;
+    }
+    free( byPath);
+    fprintf( stderr, "prepared %zu files\n", prepared);
+}
+
+// Drops a reference to a file. Called with fdLock held.
+static void replay_put( struct replay_file *file)
+{
+    if ( file != NULL && --file->refs == 0) {
+        close( file->fd);
+        free( file);
+    }
+}
+
+// Finds the cache slot of a file: its own, a free one, or when the cache
+// is full the home slot, whose file is closed to make room.
+static unsigned replay_slot( uint64_t hash)
+{
+    unsigned home = hash & (REPLAY_FDS - 1), slot = home, probes;
+
+    for ( probes = 0; probes < REPLAY_FDS; probes++) {
+        if ( fdCache[slot].hash == hash || fdCache[slot].hash == 0)
+            return slot;
+        slot = (slot + 1) & (REPLAY_FDS - 1);
+    }
+    replay_put( fdCache[home].file);
+    fdCache[home].file = NULL;
+    fdCache[home].hash = 0;
+    return home;
+}
+
+// Returns an open file, opening it on first use, or NULL with errno set.
+// The caller gives it back with replay_put() once done with its descriptor.
+static struct replay_file *replay_get( uint64_t hash, const char *name)
+{
+    struct replay_file *file;
+    unsigned slot;
+    int fd;
+
+    pthread_mutex_lock( &fdLock);
+    slot = replay_slot( hash);
+    fdCache[slot].hash = hash;
+    if ( fdCache[slot].file == NULL && ( fd = open( name, O_RDWR)) >= 0) {
+        if ( ( fdCache[slot].file = malloc( sizeof(struct replay_file))) == NULL) {
+            close( fd);
+            errno = ENOMEM;
+        } else {
+            fdCache[slot].file->fd = fd;
+            fdCache[slot].file->refs = 1;
+        }
+    }
+    if ( ( file = fdCache[slot].file) != NULL)
+        file->refs++;
+    pthread_mutex_unlock( &fdLock);
+    return file;
+}
+
+// Unlinked or renamed files are not reached through their old name any more.
+// The slot stays taken, as removing it would break the probe sequence. A
+// thread still using the file closes it when it is done.
+static void replay_forget( uint64_t hash)
+{
+    unsigned slot;
+
+    pthread_mutex_lock( &fdLock);
+    slot = replay_slot( hash);
+    if ( fdCache[slot].hash == hash) {
+        replay_put( fdCache[slot].file);
+        fdCache[slot].file = NULL;
+    }
+    pthread_mutex_unlock( &fdLock);
+}
+
+static int replay_filler( void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    (*(size_t *) buf)++;
+    return 0;
+}
+
+// Issues one operation on the mounted file system. Returns -errno, 1 when
+// the operation has nothing to replay, or 0.
+static int replay_mount( const struct trace_record *r, char *buf)
+{
+    char name[PATH_MAX], name2[PATH_MAX];
+    struct replay_file *file;
+    struct stat statbuf;
+    struct dirent *entry;
+    DIR *dir;
+    int fd, result;
+
+    replay_name( r->path_hash, name, sizeof(name));
+    switch ( r->op) {
+    case OP_GETATTR:
+    case OP_FGETATTR:
+        if ( r->path_hash == trace_hash( "/"))
+            return stat( mountDir, &statbuf) ? -errno : 0;
+        return stat( name, &statbuf) ? -errno : 0;
+    case OP_MKNOD:
+        return mknod( name, S_IFREG | 0644, 0) ? -errno : 0;
+    case OP_UNLINK:
+        replay_forget( r->path_hash);
+        return unlink( name) ? -errno : 0;
+    case OP_RENAME:
+        replay_forget( r->path_hash);
+        replay_forget( r->path2_hash);
+        replay_name( r->path2_hash, name2, sizeof(name2));
+        return rename( name, name2) ? -errno : 0;
+    case OP_TRUNCATE:
+    case OP_FTRUNCATE:
+        return truncate( name, r->offset) ? -errno : 0;
+    case OP_OPEN:
+        fd = open( name, r->size & (O_ACCMODE | O_CREAT | O_TRUNC | O_EXCL), 0644);
+        if ( fd < 0)
+            return -errno;
+        close( fd);
+        return 0;
+    case OP_READ:
+    case OP_WRITE:
+    case OP_FSYNC:
+        if ( ( file = replay_get( r->path_hash, name)) == NULL)
+            return -errno;
+        if ( r->op == OP_READ)
+            result = pread( file->fd, buf, r->size, r->offset) < 0 ? -errno : 0;
+        else if ( r->op == OP_WRITE)
+            result = pwrite( file->fd, buf, r->size, r->offset) < 0 ? -errno : 0;
+        else
+            result = fsync( file->fd) ? -errno : 0;
+        pthread_mutex_lock( &fdLock);
+        replay_put( file);
+        pthread_mutex_unlock( &fdLock);
+        return result;
+    case OP_READDIR:
+        if ( ( dir = opendir( mountDir)) == NULL)
+            return -errno;
+        while ( ( entry = readdir( dir)) != NULL)
+            ;
+        closedir( dir);
+        return 0;
+    }
+    return 1;   // release, flush, opendir... happen as part of the above
+}
+
+// Issues the redis commands fuse4redis would for the operation
+static int replay_kvs( const struct trace_record *r, char *buf)
+{
+    char name[PATH_MAX], name2[PATH_MAX];
+    size_t entries = 0;
+    int exists;
+
+    replay_name( r->path_hash, name, sizeof(name));
+    switch ( r->op) {
+    case OP_GETATTR:
+    case OP_FGETATTR:
+        if ( r->path_hash == trace_hash( "/"))
+            return 1;
+        exists = kvs_KeyExists( name);
+        if ( exists <= 0)
+            return exists < 0 ? exists : -ENOENT;
+        kvs_GetKeyLength( name);
+        return 0;
+    case OP_MKNOD:
+        return kvs_CreateEmptyKey( name);
+    case OP_UNLINK:
+        return kvs_DeleteKey( name);
+    case OP_RENAME:
+        replay_name( r->path2_hash, name2, sizeof(name2));
+        return kvs_RenameKey( name, name2);
+    case OP_TRUNCATE:
+    case OP_FTRUNCATE:
+        return kvs_TruncateKey( name, r->offset);
+    case OP_OPEN:
+        exists = kvs_KeyExists( name);
+        if ( exists < 0)
+            return exists;
+        if ( !exists)
+            return ( r->size & O_CREAT) ? kvs_CreateEmptyKey( name) : -ENOENT;
+        return ( r->size & O_TRUNC) ? kvs_TruncateKey( name, 0) : 0;
+    case OP_READ:
+        return kvs_ReadPartialValue( name, buf, r->size, r->offset) < 0 ? -EIO : 0;
+    case OP_WRITE:
+        return kvs_WritePartialValue( name, buf, r->size, r->offset) < 0 ? -EIO : 0;
+    case OP_READDIR:
+        return kvs_ReadDirectory( NULL, &entries, replay_filler);
+    }
+    return 1;
+}
+
+static void *replay_thread( void *arg)
+{
+    struct replay_thread *t = arg;
+    char *buf = NULL;
+    size_t bufSize = 0, j;
+
+    for ( j = 0; j < t->count; j++) {
+        const struct trace_record *r = t->ops[j];
+        uint64_t start;
+        int result;
+
+        if ( r->size > bufSize && ( r->op == OP_READ || r->op == OP_WRITE)) {
+            free( buf);
+            bufSize = r->size;
+            buf = malloc( bufSize);
+            if ( buf == NULL) {
+                perror( "malloc");
+                exit( -1);
+            }
+            memset( buf, 'r', bufSize);
+        }
+        if ( speed > 0) {
+            uint64_t due = replayStart + (uint64_t) (r->timestamp / speed), now;
+
+            while ( ( now = hist_now()) < due) {
+                struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+
+                nanosleep( &ts, NULL);
+            }
+        }
+
+        start = hist_now();
+        result = mountDir != NULL ? replay_mount( r, buf) : replay_kvs( r, buf);
+        if ( result == 1) {
+            t->skipped++;
+            continue;
+        }
+        hist_record( &t->latency, hist_now() - start);
+        // Only count errors the original run did not have
+        if ( result < 0 && r->result >= 0)
+            t->errors++;
+    }
+    free( buf);
+    return NULL;
+}
+
+static void replay_report( const char *label, const struct hist *h)
+{
+    printf( "%-9s mean %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f us\n",
+            label, hist_mean( h) / 1000.0,
+            hist_percentile( h, 50.0) / 1000.0, hist_percentile( h, 90.0) / 1000.0,
+            hist_percentile( h, 99.0) / 1000.0, hist_percentile( h, 99.9) / 1000.0,
+            h->max / 1000.0);
+}
+
+int main( int argc, char *argv[])
+{
+    static struct hist replayed, recorded;
+    const char *redisHost = NULL;
+    uint64_t errors = 0, skipped = 0, elapsed, span = 0;
+    int prepare = 0, port = 6379, conns = 1, opt, j;
+    size_t k;
+    char *colon;
+
+    while ( ( opt = getopt( argc, argv, "x:cm:r:n:")) != -1) {
+        switch ( opt) {
+        case 'x':
+            speed = atof( optarg);
+            break;
+        case 'c':
+            prepare = 1;
+            break;
+        case 'm':
+            mountDir = optarg;
+            break;
+        case 'n':
+            conns = atoi( optarg);
+            break;
+        case 'r':
+            redisHost = optarg;
+            if ( ( colon = strchr( optarg, ':')) != NULL) {
+                *colon = '\0';
+                port = atoi( colon + 1);
+            }
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if ( optind != argc - 1 || ( mountDir == NULL) == ( redisHost == NULL) || speed < 0)
+        goto usage;
+
+    if ( replay_load( argv[optind]) != 0)
+        exit( -1);
+    if ( recordCount == 0) {
+        fprintf( stderr, "%s: empty trace\n", argv[optind]);
+        exit( -1);
+    }
+    replay_split();
+
+    if ( redisHost != NULL) {
+        kvs_init( redisHost, port, conns);
+        if ( kvs_StartIoThread() != 0)
+            exit( -1);
+    }
+    if ( prepare)
+        replay_prepare();
+
+    replayStart = hist_now();
+    for ( j = 0; j < threadCount; j++)
+        if ( pthread_create( &threads[j].thread, NULL, replay_thread, &threads[j]) != 0) {
+            perror( "pthread_create");
+            exit( -1);
+        }
+    for ( j = 0; j < threadCount; j++) {
+        pthread_join( threads[j].thread, NULL);
+        hist_merge( &replayed, &threads[j].latency);
+        errors += threads[j].errors;
+        skipped += threads[j].skipped;
+    }
+    elapsed = hist_now() - replayStart;
+    if ( redisHost != NULL)
+        kvs_Cleanup();
+
+    for ( k = 0; k < recordCount; k++) {
+        if ( records[k].timestamp > span)
+            span = records[k].timestamp;
+        hist_record( &recorded, (uint64_t) records[k].latency_us * 1000);
+    }
+
+    printf( "operations %zu (%" PRIu64 " replayed, %" PRIu64 " skipped), threads %d, new errors %" PRIu64 "\n",
+            recordCount, replayed.count, skipped, threadCount, errors);
+    printf( "elapsed %.3fs (recorded %.3fs), %.0f ops/s\n",
+            elapsed / 1e9, span / 1e9, replayed.count / (elapsed / 1e9));
+    replay_report( "replayed", &replayed);
+    replay_report( "recorded", &recorded);
+    return 0;
+
+usage:
+    fprintf( stderr, "usage: f4r_replay [-x factor] [-c] (-m mountdir | -r host[:port] [-n conns]) tracefile\n"
+                     "  -x  speed factor, 0 replays as fast as possible (default 1)\n"
+                     "  -c  create the files the trace expects to exist first\n"
+                     "  -m  replay on a mounted file system\n"
+                     "  -r  replay straight against redis through the KVS layer\n"
+                     "  -n  redis connections for -r (default 1)\n");
+    return 1;
+}
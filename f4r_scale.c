@@ -0,0 +1,312 @@
+/*
+  Concurrency benchmark: how throughput and tail latency change with the
+  number of client threads, for readers and writers on files of their own
+  or on one shared file. Run on a fuse4redis mount, normally through
+  scale.sh, which also sweeps the number of redis connections.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  For every workload and thread count in '-T', the threads do 4 KB I/O at
+  random offsets for '-t' seconds. Workloads: read-disjoint,
+  write-disjoint, read-shared, write-shared and stat (getattr on the
+  thread's own file). On a fuse4redis mount the redis pipelining seen in
+  '.f4r/metrics' is reported too: commands per batch and how busy the
+  connections were on average. Few commands per batch at full utilization
+  points to the connections, ops/s that stop growing while they are idle
+  point to locking in fuse4redis or libfuse.
+  Results go to stdout as one JSON object per line, or CSV with '-f csv'.
+
+  usage: f4r_scale [-T threads,threads...] [-t seconds] [-s filesize_mb]
+                   [-w workload,...] [-f json|csv] [-l label] dir
+*/
+
+#define _XOPEN_SOURCE 500
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "hist.h"
+
+#define SCALE_MAX_POINTS 16
+#define SCALE_MAX_THREADS 256
+#define SCALE_BS 4096
+
+enum scale_kind { READ_DISJOINT, WRITE_DISJOINT, READ_SHARED, WRITE_SHARED, STAT, KINDS };
+
+static const char *scale_names[] = {
+    "read-disjoint", "write-disjoint", "read-shared", "write-shared", "stat"
+};
+
+struct scale_thread {
+    pthread_t thread;
+    int id;
+    enum scale_kind kind;
+    struct hist latency;
+    uint64_t errors;
+};
+
+// Pipelining counters of the mount, from .f4r/metrics. 'busy' is summed
+// over the 'conns' connections.
+struct scale_io {
+    double batches, commands, busy;
+    int conns;
+};
+
+static const char *dir;
+static int points[SCALE_MAX_POINTS] = { 1, 2, 4, 8, 16, 32, 64 };
+static int pointCount = 7;
+static int seconds = 5;
+static size_t fileSize = 4 << 20;
+static int csv;
+static const char *label = "";
+static volatile int stop;
+
+static void scale_file( int shared, int id, char *name, size_t size)
+{
+    if ( shared)
+        snprintf( name, size, "%s/scale.shared", dir);
+    else
+        snprintf( name, size, "%s/scale.%d", dir, id);
+}
+
+static int scale_io( struct scale_io *io)
+{
+    char name[PATH_MAX], line[256];
+    double value;
+    int conn;
+    FILE *f;
+
+    snprintf( name, sizeof(name), "%s/.f4r/metrics", dir);
+    if ( ( f = fopen( name, "r")) == NULL)
+        return -1;
+    memset( io, 0, sizeof(*io));
+    while ( fgets( line, sizeof(line), f) != NULL) {
+        if ( sscanf( line, "fuse4redis_redis_batches_total %lf", &value) == 1)
+            io->batches = value;
+        else if ( sscanf( line, "fuse4redis_redis_batched_commands_total %lf", &value) == 1)
+            io->commands = value;
+        else if ( sscanf( line, "fuse4redis_redis_busy_seconds_total{conn=\"%d\"} %lf",
+                          &conn, &value) == 2) {
+            io->busy += value;
+            io->conns++;
+        }
+    }
+    fclose( f);
+    return 0;
+}
+
+static void *scale_thread( void *arg)
+{
+    struct scale_thread *t = arg;
+    int shared = t->kind == READ_SHARED || t->kind == WRITE_SHARED;
+    int write = t->kind == WRITE_DISJOINT || t->kind == WRITE_SHARED;
+    char name[PATH_MAX], buf[SCALE_BS];
+    unsigned seed = t->id + 1;
+    struct stat statbuf;
+    int fd;
+
+    memset( buf, 's', sizeof(buf));
+    scale_file( shared, t->id, name, sizeof(name));
+    if ( ( fd = open( name, O_RDWR)) < 0) {
+        fprintf( stderr, "%s: %s\n", name, strerror(errno));
+        t->errors++;
+        return NULL;
+    }
+    while ( !stop) {
+        off_t offset = (off_t) (rand_r( &seed) % (fileSize / SCALE_BS)) * SCALE_BS;
+        uint64_t start = hist_now();
+        ssize_t result;
+
+        if ( t->kind == STAT)
+            result = stat( name, &statbuf) == 0 ? SCALE_BS : -1;
+        else if ( write)
+            result = pwrite( fd, buf, SCALE_BS, offset);
+        else
+            result = pread( fd, buf, SCALE_BS, offset);
+        hist_record( &t->latency, hist_now() - start);
+        if ( result != SCALE_BS)
+            t->errors++;
+    }
+    close( fd);
+    return NULL;
+}
+
+// Creates the files the threads work on, not timed
+static void scale_prepare( int shared, int threads)
+{
+    char name[PATH_MAX], *buf = calloc( 1, 1 << 20);
+    size_t done;
+    int j, fd;
+
+    for ( j = 0; j < ( shared ? 1 : threads); j++) {
+        scale_file( shared, j, name, sizeof(name));
+        if ( buf == NULL || ( fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            perror( name);
+            exit( -1);
+        }
+        for ( done = 0; done < fileSize; done += 1 << 20)
+            if ( pwrite( fd, buf, fileSize - done < 1 << 20 ? fileSize - done : 1 << 20, done) < 0) {
+                perror( name);
+                exit( -1);
+            }
+        close( fd);
+    }
+    free( buf);
+}
+
+static void scale_cleanup( int shared, int threads)
+{
+    char name[PATH_MAX];
+    int j;
+
+    for ( j = 0; j < ( shared ? 1 : threads); j++) {
+        scale_file( shared, j, name, sizeof(name));
+        unlink( name);
+    }
+}
+
+static void scale_report( enum scale_kind kind, int threads, struct scale_thread *all,
+                          uint64_t nanos, struct scale_io *before, struct scale_io *after)
+{
+    static int header;
+    static struct hist latency;
+    unsigned long long errors = 0;
+    double secs = nanos / 1e9, perBatch = -1, utilization = -1;
+    int j;
+
+    memset( &latency, 0, sizeof(latency));
+    for ( j = 0; j < threads; j++) {
+        hist_merge( &latency, &all[j].latency);
+        errors += all[j].errors;
+    }
+    if ( before != NULL && after != NULL) {
+        if ( after->batches > before->batches)
+            perBatch = (after->commands - before->commands) / (after->batches - before->batches);
+        if ( after->conns > 0)    // Mean over the connections
+            utilization = (after->busy - before->busy) / secs / after->conns;
+    }
+
+    if ( csv) {
+        if ( !header++)
+            printf( "label,workload,threads,ops,errors,seconds,ops_per_sec,lat_p50_us,"
+                    "lat_p99_us,lat_max_us,cmds_per_batch,conn_utilization\n");
+        printf( "%s,%s,%d,%llu,%llu,%.3f,%.1f,%.1f,%.1f,%.1f,%.2f,%.3f\n",
+                label, scale_names[kind], threads, (unsigned long long) latency.count, errors,
+                secs, latency.count / secs, hist_percentile( &latency, 50.0) / 1000.0,
+                hist_percentile( &latency, 99.0) / 1000.0, latency.max / 1000.0,
+                perBatch, utilization);
+    } else
+        printf( "{\"label\":\"%s\",\"workload\":\"%s\",\"threads\":%d,\"ops\":%llu,"
+                "\"errors\":%llu,\"seconds\":%.3f,\"ops_per_sec\":%.1f,\"lat_p50_us\":%.1f,"
+                "\"lat_p99_us\":%.1f,\"lat_max_us\":%.1f,\"cmds_per_batch\":%.2f,"
+                "\"conn_utilization\":%.3f}\n",
+                label, scale_names[kind], threads, (unsigned long long) latency.count, errors,
+                secs, latency.count / secs, hist_percentile( &latency, 50.0) / 1000.0,
+                hist_percentile( &latency, 99.0) / 1000.0, latency.max / 1000.0,
+                perBatch, utilization);
+    fflush( stdout);
+}
+
+static void scale_run( enum scale_kind kind, int threads)
+{
+    struct scale_thread *all = calloc( threads, sizeof(struct scale_thread));
+    struct scale_io before, after;
+    int shared = kind == READ_SHARED || kind == WRITE_SHARED, haveIo, j;
+    uint64_t start;
+
+    if ( all == NULL) {
+        perror( "calloc");
+        exit( -1);
+    }
+    scale_prepare( shared, threads);
+    haveIo = scale_io( &before) == 0;
+    stop = 0;
+    start = hist_now();
+    for ( j = 0; j < threads; j++) {
+        all[j].id = j;
+        all[j].kind = kind;
+        if ( pthread_create( &all[j].thread, NULL, scale_thread, &all[j]) != 0) {
+            perror( "pthread_create");
+            exit( -1);
+        }
+    }
+    sleep( seconds);
+    stop = 1;
+    for ( j = 0; j < threads; j++)
+        pthread_join( all[j].thread, NULL);
+    start = hist_now() - start;
+    haveIo = haveIo && scale_io( &after) == 0;
+
+    scale_report( kind, threads, all, start, haveIo ? &before : NULL, haveIo ? &after : NULL);
+    scale_cleanup( shared, threads);
+    free( all);
+}
+
+int main( int argc, char *argv[])
+{
+    char all[] = "read-disjoint,write-disjoint,read-shared,write-shared,stat";
+    char *workloads = all, *w, *save;
+    int opt, k, p;
+
+    while ( ( opt = getopt( argc, argv, "T:t:s:w:f:l:")) != -1) {
+        switch ( opt) {
+        case 'T':
+            for ( pointCount = 0, w = strtok_r( optarg, ",", &save);
+                  w != NULL && pointCount < SCALE_MAX_POINTS; w = strtok_r( NULL, ",", &save))
+                points[pointCount++] = atoi( w);
+            break;
+        case 't':
+            seconds = atoi( optarg);
+            break;
+        case 's':
+            fileSize = strtoul( optarg, NULL, 10) << 20;
+            break;
+        case 'w':
+            workloads = optarg;
+            break;
+        case 'f':
+            csv = strcmp( optarg, "csv") == 0;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if ( optind != argc - 1 || pointCount == 0 || fileSize < SCALE_BS)
+        goto usage;
+    for ( p = 0; p < pointCount; p++)
+        if ( points[p] < 1 || points[p] > SCALE_MAX_THREADS)
+            goto usage;
+    dir = argv[optind];
+
+    for ( w = strtok_r( workloads, ",", &save); w != NULL; w = strtok_r( NULL, ",", &save)) {
+        for ( k = 0; k < KINDS && strcmp( w, scale_names[k]) != 0; k++)
+            ;
+        if ( k == KINDS) {
+            fprintf( stderr, "unknown workload %s\n", w);
+            goto usage;
+        }
+        for ( p = 0; p < pointCount; p++)
+            scale_run( k, points[p]);
+    }
+    return 0;
+
+usage:
+    fprintf( stderr, "usage: f4r_scale [-T threads,threads...] [-t seconds] [-s filesize_mb]\n"
+                     "                 [-w workload,...] [-f json|csv] [-l label] dir\n"
+                     "workloads: read-disjoint write-disjoint read-shared write-shared stat\n");
+    return 1;
+}
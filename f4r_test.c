@@ -22,6 +22,7 @@
 #include <time.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
@@ -202,6 +203,44 @@ void test_rename( void)
     CU_ASSERT( unlink( filename2) == 0);
 }
 
+// Test renaming onto a file just deleted. With '-o async_unlink' and several
+// connections ('-o redis_conns=4'), the deletion of the target may still be
+// queued when the rename is sent, and must not delete the renamed file.
+//
+void test_rename_deleted( void)
+{
+    int fd, j;
+    char filename1[ 32],
+         filename2[ 32],
+         randomstr[ 32] = {0},
+         buffer[ 32];
+
+    for ( j = 0; j < 100; j++) {
+        sprintf( filename1, "testfile%d", rand());
+        sprintf( filename2, "testfile%d", rand());
+        sprintf( randomstr, "randomic text %d", rand());
+
+        fd = open( filename1, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        CU_ASSERT( fd >= 0);
+        CU_ASSERT( write( fd, randomstr, 32) == 32);
+        CU_ASSERT( close(fd) >= 0);
+        fd = open( filename2, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        CU_ASSERT( fd >= 0);
+        CU_ASSERT( close(fd) >= 0);
+
+        // rm filename2; mv filename1 filename2
+        CU_ASSERT( unlink( filename2) == 0);
+        CU_ASSERT( rename( filename1, filename2) == 0);
+
+        fd = open( filename2, O_RDONLY);
+        CU_ASSERT( fd >= 0);
+        CU_ASSERT( read( fd, buffer, 32) == 32);
+        CU_ASSERT( memcmp( buffer, randomstr, 32) == 0 );
+        CU_ASSERT( close(fd) >= 0);
+        CU_ASSERT( unlink( filename2) == 0);
+    }
+}
+
 // Test flags protection flags passed to open
 //
 void test_openflags( void)
@@ -235,6 +274,198 @@ void test_openflags( void)
     CU_ASSERT( unlink( filename) == 0);
 }
 
+// Test the statistics exposed in the control directory
+//
+// A number from a table in the control directory: 'column' (1 is the first
+// after the name) of the row of 'name'. -1 if there is no such row.
+static long long ctl_value( const char *file, const char *name, int column)
+{
+    char buffer[ 8192], *line;
+    long long value = -1;
+    int fd, result, j;
+
+    fd = open( file, O_RDONLY);
+    if ( fd < 0)
+        return -1;
+    result = read( fd, buffer, sizeof( buffer) - 1);
+    close( fd);
+    buffer[ result > 0 ? result : 0] = '\0';
+    for ( line = buffer; line != NULL && *line != '\0'; line = strchr( line, '\n')) {
+        if ( *line == '\n')
+            line++;
+        if ( strncmp( line, name, strlen( name)) != 0 || line[ strlen( name)] != ' ')
+            continue;
+        line += strlen( name);
+        for ( j = 0; j < column; j++)
+            value = strtoll( line, &line, 10);
+        return value;
+    }
+    return -1;
+}
+
+void test_stats( void)
+{
+    long long before, after;
+    int fd;
+    struct stat st;
+    
+    CU_ASSERT( stat( ".f4r", &st) == 0);
+    CU_ASSERT( S_ISDIR( st.st_mode));
+    
+    // A stat() of a file the kernel has not cached goes through getattr
+    before = ctl_value( ".f4r/stats", "getattr", 1);
+    CU_ASSERT( before >= 0);
+    CU_ASSERT( stat( "f4r_test_nonexistent", &st) < 0);
+    after = ctl_value( ".f4r/stats", "getattr", 1);
+    CU_ASSERT( after > before);
+    
+    // The earlier tests read files, served by GETRANGE
+    CU_ASSERT( ctl_value( ".f4r/stats", "GETRANGE", 1) > 0);
+    CU_ASSERT( ctl_value( ".f4r/roundtrips", "read", 1) > 0);
+    CU_ASSERT( ctl_value( ".f4r/roundtrips", "read", 2) > 0);
+
+    // Control files are read only
+    fd = open( ".f4r/stats", O_WRONLY);
+    CU_ASSERT( fd < 0);
+    CU_ASSERT( unlink( ".f4r/stats") < 0);
+}
+
+// Redis commands issued per FUSE operation, read from .f4r/cmdlog. Only
+// there when fuse4redis was mounted with '-o cmdlog'.
+//
+#define CMDLOG_MAX 1024
+
+static struct {
+    unsigned long long seq;
+    char op[ 32];
+    char path[ 64];
+} cmdlog[ CMDLOG_MAX];
+static int cmdlogCount;
+
+// Takes the commands logged since the last call. Returns -1 if some were
+// dropped, so counts would be wrong.
+static int cmdlog_read( void)
+{
+    char line[ 256], cmd[ 32];
+    FILE *f = fopen( ".f4r/cmdlog", "r");
+    int result = 0;
+
+    cmdlogCount = 0;
+    if ( f == NULL)
+        return -1;
+    while ( fgets( line, sizeof( line), f) != NULL) {
+        if ( line[ 0] == '#' || cmdlogCount == CMDLOG_MAX)
+            result = -1;
+        else if ( sscanf( line, "%llu %31s %31s %63s", &cmdlog[ cmdlogCount].seq,
+                          cmdlog[ cmdlogCount].op, cmd, cmdlog[ cmdlogCount].path) == 4)
+            cmdlogCount++;
+    }
+    fclose( f);
+    return result;
+}
+
+// Commands issued by each 'op' on 'path' since the last cmdlog_read().
+// The kernel may send the same operation more than once, so every one of
+// them must have issued the same number of commands. Returns -1 if there
+// was no such operation and -2 if they differ.
+static int cmdlog_cost( const char *op, const char *path)
+{
+    unsigned long long seq = 0;
+    int j, k, count, cost = -1;
+
+    for ( j = 0; j < cmdlogCount; j++) {
+        if ( strcmp( cmdlog[ j].op, op) != 0 || strcmp( cmdlog[ j].path, path) != 0 ||
+             cmdlog[ j].seq == seq)
+            continue;
+        seq = cmdlog[ j].seq;
+        for ( count = 0, k = 0; k < cmdlogCount; k++)
+            count += cmdlog[ k].seq == seq;
+        if ( cost >= 0 && count != cost)
+            return -2;
+        cost = count;
+    }
+    return cost;
+}
+
+// Test the number of redis round trips of each system call. A change that
+// adds a command to a common path shows up here rather than as a slowdown.
+// Needs '-o cmdlog' and, so that every stat() reaches fuse4redis,
+// '-o attr_timeout=0'.
+//
+void test_roundtrips( void)
+{
+    int fd;
+    char filename[ 32], newname[ 36], path[ 40], newpath[ 40], buffer[ 4096];
+    struct stat st;
+    DIR *dir;
+    
+    if ( stat( ".f4r/cmdlog", &st) != 0)
+        return;     // Not in test mode
+    
+    sprintf( filename, "testfile%d", rand());
+    sprintf( newname, "%s.new", filename);
+    sprintf( path, "/%s", filename);
+    sprintf( newpath, "/%s", newname);
+    memset( buffer, 'r', sizeof( buffer));
+    cmdlog_read();
+    
+    // Create: EXISTS for O_EXCL and SET in mknod, then EXISTS in open
+    fd = open( filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    CU_ASSERT( fd >= 0);
+    CU_ASSERT( cmdlog_read() == 0);
+    CU_ASSERT( cmdlog_cost( "mknod", path) == 2);
+    CU_ASSERT( cmdlog_cost( "open", path) == 1);
+
+    // SETRANGE
+    CU_ASSERT( write( fd, buffer, sizeof( buffer)) == sizeof( buffer));
+    CU_ASSERT( close(fd) >= 0);
+    CU_ASSERT( cmdlog_read() == 0);
+    CU_ASSERT( cmdlog_cost( "write", path) == 1);
+    
+    // EXISTS and STRLEN
+    CU_ASSERT( stat( filename, &st) == 0);
+    CU_ASSERT( cmdlog_read() == 0);
+    CU_ASSERT( cmdlog_cost( "getattr", path) == 2);
+
+    // GETRANGE
+    fd = open( filename, O_RDONLY);
+    CU_ASSERT( fd >= 0);
+    CU_ASSERT( read( fd, buffer, sizeof( buffer)) == sizeof( buffer));
+    CU_ASSERT( close(fd) >= 0);
+    CU_ASSERT( cmdlog_read() == 0);
+    CU_ASSERT( cmdlog_cost( "open", path) == 1);
+    CU_ASSERT( cmdlog_cost( "read", path) == 1);
+
+    // Extending is STRLEN and SETRANGE, shrinking STRLEN, GETRANGE and SET
+    CU_ASSERT( truncate( filename, 2 * sizeof( buffer)) == 0);
+    CU_ASSERT( cmdlog_read() == 0);
+    CU_ASSERT( cmdlog_cost( "truncate", path) == 2);
+    CU_ASSERT( truncate( filename, 100) == 0);
+    CU_ASSERT( cmdlog_read() == 0);
+    CU_ASSERT( cmdlog_cost( "truncate", path) == 3);
+
+    // KEYS, however many keys there are
+    dir = opendir( ".");
+    CU_ASSERT( dir != NULL);
+    if ( dir != NULL) {
+        while ( readdir( dir) != NULL)
+            ;
+        closedir( dir);
+    }
+    CU_ASSERT( cmdlog_read() == 0);
+    CU_ASSERT( cmdlog_cost( "readdir", "/") == 1);
+
+    // RENAME, logged under the old name
+    CU_ASSERT( rename( filename, newname) == 0);
+    CU_ASSERT( cmdlog_read() == 0);
+    CU_ASSERT( cmdlog_cost( "rename", path) == 1);
+
+    // UNLINK
+    CU_ASSERT( unlink( newname) == 0);
+    CU_ASSERT( cmdlog_read() == 0);
+    CU_ASSERT( cmdlog_cost( "unlink", newpath) == 1);
+}
+
 int main( int argc, char*argv[])
 {
     CU_pSuite pSuite;
@@ -256,7 +487,10 @@ int main( int argc, char*argv[])
     CU_ADD_TEST(pSuite, test_extend);
     CU_ADD_TEST(pSuite, test_truncate);
     CU_ADD_TEST(pSuite, test_rename);
+    CU_ADD_TEST(pSuite, test_rename_deleted);
     CU_ADD_TEST(pSuite, test_openflags);
+    CU_ADD_TEST(pSuite, test_stats);
+    CU_ADD_TEST(pSuite, test_roundtrips);
     
     CU_basic_set_mode( CU_BRM_VERBOSE);
     CU_basic_run_tests();
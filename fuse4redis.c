@@ -29,7 +29,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
-#include <hiredis.h>
+#include <stddef.h>
 #include <sys/types.h>
 
 #ifdef HAVE_SYS_XATTR_H
@@ -37,9 +37,16 @@
 #endif
 
 #include "log.h"
-
-// Redis connection
-redisContext *redisCtx;
+#include "cache.h"
+#include "cmdlog.h"
+#include "ctl.h"
+#include "kvs.h"
+#include "metrics.h"
+#include "probes.h"
+#include "slowlog.h"
+#include "stats.h"
+#include "trace.h"
+#include "wal.h"
 
 // Strips path from file name
 // TODO: right now this simple macro suffices since we do not support subfolders 
@@ -47,371 +54,6 @@ redisContext *redisCtx;
 #define FILE_NAME(path) (path[0] == '/' ? path + 1 : path)
 
 
-//////////////////////////////////////////////////////////////////////
-//
-// Ancilary functions to abstract database (KVS) details
-//
-// TODO: Move these functions to a separate source code file
-
-const char *hostname = "127.0.0.1";
-const int port = 6379;
-
-
-// Initial connection to redis upon startup. Simply aborts if it fails.
-//
-void kvs_init( const char *hostname, int port)
-{
-    struct timeval timeout = { 1, 500000 }; // 1.5 seconds
-    
-    redisCtx = redisConnectWithTimeout(hostname, port, timeout);
-    if (redisCtx == NULL ) {
-        printf("Connection error: can't allocate redis context\n");
-        exit(-1);
-    }
-
-    if ( redisCtx->err) {
-        printf("Connection error: %s\n", redisCtx->errstr);
-        redisFree(redisCtx);
-        exit(-2);
-    }
-}
-
-// Reconnects to redis. Simply aborts if fail. Logs errors in logfile.
-// NOTE: while we could choose not to abort if we cannot reconnect, we would flood 
-// the logs with error messages as the FS continues to be used, so we chose to retry 
-// only once and require that the system admin (or the user) restart fuse4redis in 
-// case redis was out for longer than a short while. 
-//
-void kvs_Reconnect( const char *hostname, int port)
-{
-    struct timeval timeout = { 1, 500000 }; // 1.5 seconds
-    
-    redisCtx = redisConnectWithTimeout(hostname, port, timeout);
-    if (redisCtx == NULL ) {
-        log_msg("kvs_Reconnect: Connection error: can't allocate redis context\n");
-        exit(-3);
-    }
-
-    if ( redisCtx->err != 0) {
-        log_msg( "kvs_Reconnect: Connection error #%d: %s\n", redisCtx->err, redisCtx->errstr);
-        redisFree(redisCtx);
-        exit(-4);
-    }
-}
-
-
-// Connection to redis may be lost and a reconnection may fix it.
-// Instead of calling redisCommand throughout the code and handling this 
-// on every call, we will wrap redisCommand and provide better error handling
-// in one single place, maintaining the rest of the code cleanner.
-// Guarantees that resultReply in non-NULL upon successfull return.
-
-int kvs_RedisCommand( redisReply **resultReply, const char *cmd, ...)
-{
-    va_list valist;
-    redisReply *kvsReply;
-    int tries = 0;
-
-    while ( tries < 2) {     // This loop retries once if redis connection error
-        va_start(valist, cmd);    // Initialize valist each time used
-        kvsReply = redisvCommand(redisCtx, cmd, valist);
-        va_end(valist);     // Clean valist
-
-        if (kvsReply == NULL) {
-            log_msg( "Error when invoking redis: #%d: %s\n", redisCtx->err, 
-                     redisCtx->errstr);
-            log_msg( "Attempting to reconnect once!\n");
-            redisFree(redisCtx);
-            kvs_Reconnect( hostname, port);   // One retry, as kvs_Reconnect() exits if error
-            tries ++;
-        } else
-            break;
-    }
-    
-    if (kvsReply == NULL) {
-        log_msg("kvs_RedisCommand: ERROR - returned error after successful reconnection\n");
-        log_msg("kvs_RedisCommand: redis error #%d: %s\n", redisCtx->err, redisCtx->errstr);
-        exit(-5);
-    }
-
-    *resultReply = kvsReply;
-             
-    if ( kvsReply->type == REDIS_REPLY_ERROR) {
-        log_msg( "kvs_RedisCommand: ERROR - Redis says: %s\n", kvsReply->str);
-        freeReplyObject( kvsReply);
-        *resultReply = NULL;    // Releasing it here upon error keeps code a little cleanner
-        return -EIO;
-    }
-    return 0;
-}
-
-// Disconnects from redis. 
-void kvs_Cleanup( void)
-{
-    redisFree(redisCtx);
-}
-
-// Creates an empty redis key to represent an empty file
-int kvs_CreateEmptyKey( const char *name)
-{
-    redisReply *reply;
-    int result;
-    
-    result = kvs_RedisCommand( &reply, "SET %s %s", name, "");
-
-    if (result >= 0) 
-        freeReplyObject(reply);
-    return result;
-}
-
-
-// Checks if a key (representing a file) already exists
-int kvs_KeyExists( const char *name)
-{
-    redisReply *reply;
-    int exists, result;
-
-    result = kvs_RedisCommand( &reply, "EXISTS %s", name);
-    if (result < 0)
-        return result;
-    if (reply->type != REDIS_REPLY_INTEGER) {
-        log_msg( "kvs_KeyExists: ERROR - Unexpected response from redis type=%d\n", 
-                 reply->type);
-        freeReplyObject(reply);
-        return -EPROTO;
-    }
-    exists = (int) reply->integer; // 1 if exists, 0 otherwise
-    freeReplyObject(reply);
-    
-    return exists;  
-}
-
-// Delete key from KVS
-int kvs_DeleteKey( const char *name)
-{
-    redisReply *reply;
-    int result;
-
-    result = kvs_RedisCommand( &reply, "DEL %s", name);
-    if ( result < 0 )
-        return result;
-    if (reply->type != REDIS_REPLY_INTEGER) {
-        log_msg( "kvs_DeleteKey: ERROR - Unexpected result from redis type=%d\n", reply->type);
-        freeReplyObject(reply);
-        return -EPROTO;
-    }
-    
-    if ( reply->integer == 0)  // 1 if key existed, 0 otherwise
-        return -ENOENT;
-    freeReplyObject(reply);
-
-    return 0;
-}
-
-// Rename key in KVS
-int kvs_RenameKey( const char *name, const char *newname)
-{
-    redisReply *reply;
-    int result;
-
-    // Some KVS will blindly replace existing keys, wich is the expected FS behaviour
-    // Redis does blindly replace!
-    result = kvs_RedisCommand( &reply, "RENAME %s %s", name, newname);
-    if ( result < 0)
-        return result; 
-
-    freeReplyObject(reply);
-    
-    return 0;
-}
-
-
-// Get length of a key (known to exist, if not redis returns len=0)
-size_t kvs_GetKeyLength( const char *name)
-{
-    redisReply *reply;
-    size_t ksize;
-    int result;
-    
-    // Redis returns length 0 for nonexisting keys, so explicitly check
-    result = kvs_KeyExists( name);
-    if ( result < 0)    // redis error
-        return result;
-    if ( result == 0)
-        return -ENOENT;
-        
-    result = kvs_RedisCommand( &reply, "STRLEN %s", name);
-    if ( result < 0)    // redis error
-        return result;
-    if (reply->type != REDIS_REPLY_INTEGER) {
-        log_msg( "kvs_GetKeyLength: ERROR - Unexpected result from redis type=%d\n", 
-                 reply->type);
-        freeReplyObject(reply);
-        return -EPROTO;
-    }
-    ksize = (size_t)reply->integer;
-    freeReplyObject(reply);
-    return ksize;
-}
-
-// Extends the value of an existing key (must exist) using null characters.
-// Caller must ensure newsize is larger than current size 
-int kvs_AppendZeroedBytes( const char *name, size_t newsize)
-{
-    redisReply *reply;
-    char zbuffer[1] = {0};
-    int result;
-    
-    // Extending a key's value is really a corner case. Take advantage that redis does it
-    // automatically when we set bytes beyond current size
-    result = kvs_RedisCommand( &reply, "SETRANGE %s %ld %b", name, newsize - 1, zbuffer, 1);
-    if ( result < 0)    // redis error
-        return result;
-
-    if (reply->type != REDIS_REPLY_INTEGER) {
-        log_msg( "kvs_AppendZeroedBytes: ERROR - Unexpected result from redis type=%d\n",
-                 reply->type);
-        freeReplyObject(reply);
-        return -EPROTO;
-    }
-    freeReplyObject(reply);
-
-    return 0;
-}
-
-// Truncates the value of an existing key discarding the trailing content
-int kvs_TruncateKey( const char *name, size_t newsize)
-{
-    redisReply *reply1 = NULL,
-               *reply2;
-    int result;
-
-    if ( newsize > 0 ) {    // Need to preserve beginning of value 
-        result = kvs_RedisCommand( &reply1,"GETRANGE %s %ld %ld", name, (size_t)0, newsize);
-        if ( result < 0)
-            return result;
-        if (reply1->type != REDIS_REPLY_STRING) {
-            log_msg( "kvs_TruncateKey: ERROR - Unexpected result from redis type=%d\n", 
-                     reply1->type);
-            freeReplyObject(reply1);
-            return -EPROTO;
-        }
-    }
-    result = kvs_RedisCommand( &reply2, "SET %s %b", name, 
-                           newsize > 0 ? reply1->str : "", newsize);
-    if ( reply1 != NULL)
-        freeReplyObject(reply1);
-    if ( result >= 0)
-        freeReplyObject(reply2);
-    return result;
-}
-
-    
-// This will copy the root directory file list into the FUSE buffer using the FUSE 
-// 'filler' function.
-//
-// TODO: Passing the FUSE filler function to this KVS abstraction layer decouples  
-//       the FUSE code from redis, but not vice versa. Ideally this abstraction layer 
-//       would simply return a list of strings (entries), and the calling code would 
-//       transfer them to FUSE. However this incurs a penalty allocating space for a 
-//       variable size list and deallocating it soon after. The implementation below
-//       represents an acceptable compromise, given the purpose of this program.
-//
-// TODO: Function prototype is not adequate to support subfolders eventually. Root 
-//       folder is implicitly assumed.
-//
-// TODO: Fuse4redis creates only string values. However if keys with other value types 
-//       (e.g. integer) are created using redis-cli, these keys will result in errors 
-//       when accessed.
-//
-int kvs_ReadDirectory( void *buf, fuse_fill_dir_t filler)
-{
-    redisReply *reply;
-    int result;
-      
-    result = kvs_RedisCommand( &reply, "KEYS *");
-    if ( result < 0)
-        return result;
-        
-   // The loop below exits when either all keys were copied, or filler()
-   // returns something non-zero.  The first case just means I've
-   // read the whole 'redis' directory; the second means the buffer is full.
-    if (reply->type == REDIS_REPLY_ARRAY) {
-        int j;
-        for ( j = 0; j < reply->elements; j++) {
-            if (filler(buf, reply->element[j]->str, NULL, 0) != 0) {
-	            log_msg("kvs_ReadDirectory: ERROR - filler returned buffer full\n");
-                freeReplyObject(reply);
-	            return -ENOMEM;
-	        }
-        }
-    } else {  // Only array is an acceptable result
-        log_msg( "kvs_ReadDirectory: ERROR - query did not return a list, returned type=%d\n",
-                 reply->type);
-        return -EPROTO;
-    }
-    freeReplyObject(reply);
-    return 0;
-}
-
-// Reads the partial contents of a key starting at offset
-int kvs_ReadPartialValue(const char *keyname, char *buf, size_t size, off_t offset)
-{
-    redisReply *reply;
-    int length, result;
-  
-    // Redis has command to get substrings, which is handy!
-    result = kvs_RedisCommand(&reply,"GETRANGE %s %ld %ld", keyname,
-                         offset, offset + size - 1);  // Assuming size will never be 0
-    if ( result < 0)
-        return result;
-    if (reply->type != REDIS_REPLY_STRING) {
-        log_msg( "kvs_ReadPartialValue: ERROR - Unexpected result from redis type=%d\n", 
-                 reply->type);
-        freeReplyObject(reply);
-        return -EPROTO;
-    }
-    
-    length = reply->len;
-    memcpy( buf, reply->str, length);
-    freeReplyObject(reply);
-  
-    return length;
-}
-
-// Writes/overwrites the partial contents of a key starting at offset
-int kvs_WritePartialValue(const char *keyname, const char *buf, size_t size, off_t offset)
-{
-    redisReply *reply;
-    int result;
-  
-    // Redis has a command to write partial values of keys, which is handy!
-    // Impressively, redis handles writes beyond the current length as expected, 
-    // including filling with zeroes when offset is beyond current length. In a nutshell,
-    // it already implements the same semantics a the write call in Linux. Nice!!!
-    // But beware, different from write, redis returns the resulting total length of 
-    // the new key.
-    result = kvs_RedisCommand(&reply,"SETRANGE %s %ld %b", keyname,
-                         offset, buf, size);
-    if ( result < 0)
-        return result;
-
-    if (reply->type != REDIS_REPLY_INTEGER) {
-        log_msg( "kvs_WritePartialValue: ERROR - Unexpected result from redis type=%d\n", 
-                 reply->type);
-        freeReplyObject(reply);
-        return -EPROTO;
-    }
-    freeReplyObject(reply);
-    
-    return size; // Success: return number of bytes in buf actually written.
-}
-//////
-
-//
-// End of section that abstracts database (KVS) details
-//
-//////////////////////////////////////////////////////////////////////
 
 
 
@@ -431,12 +73,23 @@ int f4r_getattr(const char *path, struct stat *statbuf)
     size_t fsize = 0;
     const char *filename = FILE_NAME(path);
     
-    log_msg( "f4r_getattr: Called for path=%s\n", path);
+    log_debug( "f4r_getattr: Called for path=%s\n", path);
     
+    if ( ctl_is_path( path))
+        return ctl_getattr( path, statbuf);
+
     statbuf->st_mode = S_IRWXU | S_IRWXG | S_IRWXO;
-    if (strcmp(path, "/") == 0) {   // Atributes for the FS' root dir
+    if (strcmp(path, "/") == 0 || kvs_IsDatabase( filename)) {   // Root or a database's dir
         statbuf->st_mode = statbuf->st_mode | S_IFDIR;
         statbuf->st_size = 0;
+    } else if ( ! kvs_IsFileName( filename)) {
+        return -ENOENT;     // With multiple databases, files are only in their dirs
+    } else if ( cache_enabled) {    // Immutable, the size is asked for once
+        int result = cache_length( filename, &fsize);
+
+        if ( result < 0)
+            return result;
+        statbuf->st_mode = statbuf->st_mode | S_IFREG;
     } else {
         // First check if file/key exists, because STRLEN simply returns 0 if it doesn't
         int exists = kvs_KeyExists( filename);
@@ -451,6 +104,8 @@ int f4r_getattr(const char *path, struct stat *statbuf)
         fsize = kvs_GetKeyLength( filename);
         if ( fsize < 0 )
             return fsize;
+        if ( wal_enabled)
+            fsize = wal_length( filename, fsize);
     }
     statbuf->st_size = fsize;
     statbuf->st_uid = getuid();
@@ -474,7 +129,7 @@ int f4r_getattr(const char *path, struct stat *statbuf)
 // f4r_readlink() code by Bernardo F Costa (thanks!)
 int f4r_readlink(const char *path, char *link, size_t size)
 {
-    log_msg( "f4r_readlink: Called for path=%s\n", path);
+    log_debug( "f4r_readlink: Called for path=%s\n", path);
     
     return -ENOSYS;     // Not supported
 }
@@ -489,10 +144,17 @@ int f4r_mknod(const char *path, mode_t mode, dev_t dev)
     const char *filename = FILE_NAME(path);
     int result;
     
-    log_msg( "f4r_mknod: Called for path=%s\n", path);
+    log_debug( "f4r_mknod: Called for path=%s\n", path);
     
+    if ( ctl_is_path( path))
+        return -EACCES;
+
     if ( ! S_ISREG(mode)) // fuse4redis only support regular file creation
         return -EINVAL;
+    if ( ! kvs_IsFileName( filename))
+        return -EACCES;
+    if ( F4R_DATA->immutable)
+        return -EROFS;
         
     // With O_EXCL, file/key cannot already exist 
     if (mode & O_EXCL) {
@@ -506,6 +168,8 @@ int f4r_mknod(const char *path, mode_t mode, dev_t dev)
     }
     
     // Create an empty redis key to represent an empty file
+    if ( wal_enabled && ( result = wal_barrier( filename)) < 0)
+        return result;
     result = kvs_CreateEmptyKey( filename);
     if ( result < 0)
         return result;
@@ -516,26 +180,34 @@ int f4r_mknod(const char *path, mode_t mode, dev_t dev)
 /** Create a directory */
 int f4r_mkdir(const char *path, mode_t mode)
 {
-    log_msg( "f4r_mkdir: Called for path=%s\n", path);
+    log_debug( "f4r_mkdir: Called for path=%s\n", path);
     return -ENOSYS;
 }
 
 /** Remove a file */
 int f4r_unlink(const char *path)
 {    
-    log_msg( "f4r_unlink: Called for path=%s\n", path);
+    int result;
+
+    log_debug( "f4r_unlink: Called for path=%s\n", path);
 
     if (strcmp(path, "/") == 0) {   // Trying to delete the FS' root dir
         return -EISDIR;
     }
+    if ( ctl_is_path( path))
+        return -EACCES;
+    if ( F4R_DATA->immutable)
+        return -EROFS;
 
+    if ( wal_enabled && ( result = wal_barrier( FILE_NAME(path))) < 0)
+        return result;
     return kvs_DeleteKey( FILE_NAME(path));
 }
 
 /** Remove a directory */
 int f4r_rmdir(const char *path)
 {
-    log_msg( "f4r_rmdir: Called for path=%s\n", path);
+    log_debug( "f4r_rmdir: Called for path=%s\n", path);
 
     return -ENOSYS;
 }
@@ -546,7 +218,7 @@ int f4r_rmdir(const char *path)
 // to the symlink() system call.
 int f4r_symlink(const char *path, const char *link)
 {
-    log_msg( "f4r_symlink: Called for path=%s\n", path);
+    log_debug( "f4r_symlink: Called for path=%s\n", path);
     
     return -ENOSYS;
 }
@@ -557,16 +229,26 @@ int f4r_rename(const char *path, const char *newpath)
 {
     const char *filename = FILE_NAME(path),
                *newname = FILE_NAME(newpath);
+    int result;
     
-    log_msg( "f4r_rename: Called for path=%s newpath=%s\n", path, newpath);
+    log_debug( "f4r_rename: Called for path=%s newpath=%s\n", path, newpath);
     
+    if ( ctl_is_path( path) || ctl_is_path( newpath) || ! kvs_IsFileName( newname))
+        return -EACCES;
+    if ( F4R_DATA->immutable)
+        return -EROFS;
+
+    // Journaled writes to either name must not land after the rename
+    if ( wal_enabled && ( ( result = wal_barrier( filename)) < 0 ||
+                          ( result = wal_barrier( newname)) < 0))
+        return result;
      return kvs_RenameKey( filename, newname);
 }
 
 /** Create a hard link to a file */
 int f4r_link(const char *path, const char *newpath)
 {
-    log_msg( "f4r_link: Called for path=%s\n", path);
+    log_debug( "f4r_link: Called for path=%s\n", path);
     
     return -ENOSYS;
 }
@@ -574,14 +256,14 @@ int f4r_link(const char *path, const char *newpath)
 /** Change the permission bits of a file */
 int f4r_chmod(const char *path, mode_t mode)
 {
-    log_msg( "f4r_chmod: Called for path=%s\n", path);
+    log_debug( "f4r_chmod: Called for path=%s\n", path);
     return -ENOSYS;
 }
 
 /** Change the owner and group of a file */
 int f4r_chown(const char *path, uid_t uid, gid_t gid)
 {
-    log_msg( "f4r_chown: Called for path=%s\n", path);
+    log_debug( "f4r_chown: Called for path=%s\n", path);
     return -ENOSYS;
 }
 
@@ -590,9 +272,17 @@ int f4r_truncate(const char *path, off_t newsize)
 {
     size_t ksize;
     const char *filename = FILE_NAME( path);
+    int result;
     
-    log_msg( "f4r_truncate: Called for path=%s\n", path);
+    log_debug( "f4r_truncate: Called for path=%s\n", path);
     
+    if ( ctl_is_path( path))
+        return -EACCES;
+    if ( F4R_DATA->immutable)
+        return -EROFS;
+
+    if ( wal_enabled && ( result = wal_barrier( filename)) < 0)
+        return result;
     ksize = kvs_GetKeyLength( filename);
     if ( ksize < 0)
         return ksize;
@@ -611,7 +301,7 @@ int f4r_truncate(const char *path, off_t newsize)
 /** Change the access and/or modification times of a file */
 int f4r_utime(const char *path, struct utimbuf *ubuf)
 {
-    log_msg( "f4r_utime: Called for path=%s\n", path);
+    log_debug( "f4r_utime: Called for path=%s\n", path);
     return -ENOSYS;
 }
 
@@ -630,11 +320,28 @@ int f4r_open(const char *path, struct fuse_file_info *fi)
     int exists, result;
     const char *filename = FILE_NAME( path);
     
-    log_msg( "f4r_open: Called for path=%s\n", path);
+    log_debug( "f4r_open: Called for path=%s\n", path);
     
     if (strcmp(path, "/") == 0) {   // Trying to open the FS' root dir
         return -EISDIR;
     }
+    if ( ctl_is_path( path))
+        return ctl_open( path, fi);
+    if ( kvs_IsDatabase( filename))
+        return -EISDIR;
+    if ( ! kvs_IsFileName( filename))
+        return fi->flags & O_CREAT ? -EACCES : -ENOENT;
+    if ( cache_enabled) {
+        size_t fsize;
+
+        // Immutable: no writing, and the kernel may keep the pages it read
+        if ( ( fi->flags & O_ACCMODE) != O_RDONLY || ( fi->flags & O_TRUNC))
+            return -EROFS;
+        if ( ( result = cache_length( filename, &fsize)) < 0)
+            return result;
+        fi->keep_cache = 1;
+        return 0;
+    }
     
     exists = kvs_KeyExists( filename);
     if ( exists < 0)
@@ -651,6 +358,8 @@ int f4r_open(const char *path, struct fuse_file_info *fi)
     } else {
         if( fi->flags & O_TRUNC) {
             // Empty the file, if existing
+            if ( wal_enabled && ( result = wal_barrier( filename)) < 0)
+                return result;
             result = kvs_TruncateKey( filename, 0);
             if ( result < 0)
                 return result;
@@ -673,14 +382,20 @@ int f4r_open(const char *path, struct fuse_file_info *fi)
  */
 int f4r_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    log_msg( "f4r_read: Called for path=%s\n", path);
+    log_debug( "f4r_read: Called for path=%s\n", path);
     
     if (strcmp(path, "/") == 0) {   // Trying to read the FS' root dir
         return -EISDIR;
     }
+    if ( ctl_is_path( path))
+        return ctl_read( path, buf, size, offset, fi);
 
     // Note that we do not check if file is open for reading. Other layers
     // in the FS stack already do it.        
+    if ( cache_enabled)
+        return cache_read( FILE_NAME(path), buf, size, offset);
+    if ( wal_enabled)
+        return wal_read( FILE_NAME(path), buf, size, offset);
     return kvs_ReadPartialValue(FILE_NAME(path), buf, size, offset);
 }
 
@@ -695,14 +410,20 @@ int f4r_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 int f4r_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
-    log_msg( "f4r_write: Called path=%s\n", path);
+    log_debug( "f4r_write: Called path=%s\n", path);
 
     if (strcmp(path, "/") == 0) {   // Trying to read the FS' root dir
         return -EISDIR;
     }
+    if ( ctl_is_path( path))
+        return -EACCES;
+    if ( F4R_DATA->immutable)
+        return -EROFS;
     
     // Note that we do not check if file is open for writing. Other layers
     // in the FS stack already do it.        
+    if ( wal_enabled)
+        return wal_write( FILE_NAME(path), buf, size, offset);
     return kvs_WritePartialValue( FILE_NAME(path), buf, size, offset);
 }
 
@@ -715,7 +436,7 @@ int f4r_write(const char *path, const char *buf, size_t size, off_t offset,
  */
 int f4r_statfs(const char *path, struct statvfs *statv)
 {
-    log_msg( "f4r_statfs: Called for path=%s\n", path);
+    log_debug( "f4r_statfs: Called for path=%s\n", path);
     return -ENOSYS;
 }
 
@@ -744,7 +465,7 @@ int f4r_statfs(const char *path, struct statvfs *statv)
  */
 int f4r_flush(const char *path, struct fuse_file_info *fi)
 {
-    log_msg( "f4r_flush: Called path=%s\n", path);
+    log_debug( "f4r_flush: Called path=%s\n", path);
     
     return 0;   // No op. Nothing to flush to KVS.
 }
@@ -765,7 +486,10 @@ int f4r_flush(const char *path, struct fuse_file_info *fi)
  */
 int f4r_release(const char *path, struct fuse_file_info *fi)
 {
-    log_msg( "f4r_release: Called for path=%s\n", path);
+    log_debug( "f4r_release: Called for path=%s\n", path);
+
+    if ( ctl_is_path( path))
+        return ctl_release( path, fi);
 
     // We do not keep any file related state and do not use handles. Nothing to do here!
     return 0;
@@ -780,36 +504,44 @@ int f4r_release(const char *path, struct fuse_file_info *fi)
  */
 int f4r_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-    log_msg( "f4r_fsync: Called for path=%s\n", path);
-    return 0;
+    log_debug( "f4r_fsync: Called for path=%s\n", path);
+
+    if ( ctl_is_path( path))
+        return 0;
+
+    // With a journal, writes are durable once it has them
+    if ( wal_enabled)
+        return wal_sync();
+    // Writes are in redis already, how durable they are is up to -o fsync
+    return kvs_Sync( FILE_NAME( path));
 }
 
 #ifdef HAVE_SYS_XATTR_H
 /** Set extended attributes */
 int f4r_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
-    log_msg( "f4r_setxattr: Called for path=%s\n", path);
+    log_debug( "f4r_setxattr: Called for path=%s\n", path);
     return -ENOSYS;
 }
 
 /** Get extended attributes */
 int f4r_getxattr(const char *path, const char *name, char *value, size_t size)
 {
-    log_msg( "f4r_getxattr: Called for path=%s\n", path);
+    log_debug( "f4r_getxattr: Called for path=%s\n", path);
     return -ENOSYS;
 }
 
 /** List extended attributes */
 int f4r_listxattr(const char *path, char *list, size_t size)
 {
-    log_msg( "f4r_listxattr: Called for path=%s\n", path);
+    log_debug( "f4r_listxattr: Called for path=%s\n", path);
     return -ENOSYS;
 }
 
 /** Remove extended attributes */
 int f4r_removexattr(const char *path, const char *name)
 {
-    log_msg( "f4r_removexattr: Called for path=%s\n", path);
+    log_debug( "f4r_removexattr: Called for path=%s\n", path);
     return -ENOSYS;
 }
 #endif
@@ -823,8 +555,12 @@ int f4r_removexattr(const char *path, const char *name)
  */
 int f4r_opendir(const char *path, struct fuse_file_info *fi)
 {
-    log_msg( "f4r_opendir: Called for path=%s\n", path);
+    log_debug( "f4r_opendir: Called for path=%s\n", path);
     
+    if (strcmp(path, CTL_DIR) == 0)    // The control directory is always there
+        return 0;
+    if ( kvs_IsDatabase( FILE_NAME(path)))
+        return 0;
     if (strcmp(path, "/") != 0) {   // Trying to open dir other than FS' root dir
         return -ENOTDIR;
     }
@@ -858,12 +594,23 @@ int f4r_opendir(const char *path, struct fuse_file_info *fi)
 int f4r_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	       struct fuse_file_info *fi)
 {
-    log_msg( "f4r_readdir: Called for path=%s\n", path);
+    log_debug( "f4r_readdir: Called for path=%s\n", path);
     
+    if (ctl_is_path(path))
+        return ctl_readdir( path, buf, filler);
+    if ( kvs_IsDatabase( FILE_NAME(path)))
+        return cache_enabled ? cache_readdir( FILE_NAME(path), buf, filler) :
+                               kvs_ReadDirectory( FILE_NAME(path), buf, filler);
     if (strcmp(path, "/") != 0)   // Only the FS' root dir is currently allowed
         return -ENOTDIR;
     
-    return kvs_ReadDirectory( buf, filler);
+    if (filler(buf, CTL_DIR_NAME, NULL, 0) != 0)
+        return -ENOMEM;
+    if ( kvs_MultiDb())
+        return kvs_ListDatabases( buf, filler);
+    if ( cache_enabled)
+        return cache_readdir( NULL, buf, filler);
+    return kvs_ReadDirectory( NULL, buf, filler);
 }
 
 /** Release directory
@@ -872,7 +619,7 @@ int f4r_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
  */
 int f4r_releasedir(const char *path, struct fuse_file_info *fi)
 {
-    log_msg( "f4r_releasedir: Called for path=%s\n", path);
+    log_debug( "f4r_releasedir: Called for path=%s\n", path);
     
     // We do not keep any oopen directory related state. Nothing to do here!
     return 0;
@@ -885,12 +632,15 @@ int f4r_releasedir(const char *path, struct fuse_file_info *fi)
  *
  * Introduced in version 2.3
  */
-// when exactly is this called?  when a user calls fsync and it
-// happens to be a directory? ??? >>> I need to implement this...
+// Called when fsync() is done on a directory, to make creations, renames
+// and deletions in it durable. These may have gone through any connection.
 int f4r_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 {
-    log_msg( "f4r_fsyncdir: Called for path=%s\n", path);
-    return 0;
+    log_debug( "f4r_fsyncdir: Called for path=%s\n", path);
+
+    if ( ctl_is_path( path))
+        return 0;
+    return kvs_Sync( NULL);
 }
 
 /**
@@ -912,8 +662,16 @@ int f4r_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 // FUSE).
 void *f4r_init(struct fuse_conn_info *conn)
 {
-    log_msg( "f4r_init: Called init. FUSE is initializing!\n");
+    log_info( "f4r_init: Called init. FUSE is initializing!\n");
     
+    // FUSE has daemonized by now, so it is safe to start threads
+    log_start();
+    if ( kvs_StartIoThread() < 0)
+        exit(-6);
+    if ( wal_start() < 0)
+        exit(-6);
+    metrics_start( F4R_DATA->metrics_socket, F4R_DATA->metrics_file, F4R_DATA->metrics_interval);
+
     return F4R_DATA;
 }
 
@@ -926,9 +684,13 @@ void *f4r_init(struct fuse_conn_info *conn)
  */
 void f4r_destroy(void *userdata)
 {
-    log_msg( "f4r_destroy: Called cleanup operation.\n");
+    log_info( "f4r_destroy: Called cleanup operation.\n");
     
+    metrics_stop();
+    trace_stop();
+    wal_stop();
     kvs_Cleanup();
+    log_stop();
 }
 
 /**
@@ -944,7 +706,7 @@ void f4r_destroy(void *userdata)
  */
 int f4r_access(const char *path, int mask)
 {
-    log_msg( "f4r_access: Called for path=%s with mask=%d\n", path, mask);
+    log_debug( "f4r_access: Called for path=%s with mask=%d\n", path, mask);
     return 0;
 }
 
@@ -977,10 +739,10 @@ int f4r_access(const char *path, int mask)
  */
 int f4r_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
-    log_msg( "f4r_ftruncate: Called for path=%s\n", path);
+    log_debug( "f4r_ftruncate: Called for path=%s\n", path);
     
     // Since we have the path and do not use handles, ftruncate and truncate are equal
-    return f4r_truncate( FILE_NAME( path), offset);
+    return f4r_truncate( path, offset);
 }
 
 /**
@@ -997,60 +759,322 @@ int f4r_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
  */
 int f4r_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
 {
-    log_msg( "f4r_fgetattr: Called for path=%s\n", path);
+    log_debug( "f4r_fgetattr: Called for path=%s\n", path);
 
     // Since we do not keep file handles, we simply delegate to f4r_getattr()
-    return f4r_getattr( FILE_NAME( path), statbuf);
+    return f4r_getattr( path, statbuf);
+}
+
+///////////////////////////////////////////////////////////
+//
+// Instrumented entry points. FUSE calls these, which time the real
+// callback above and record it in the per-operation statistics. Keeping
+// this out of the callbacks leaves their error paths untouched, and calls
+// between callbacks (ftruncate -> truncate) are not counted twice.
+//
+#define OP_ENTER(op, path, size, offset) \
+    struct f4r_opctx opctx; stats_op_enter( &opctx, op, path, size, offset)
+#define OP_LEAVE(result) op_leave( &opctx, result)
+
+static inline int op_leave( struct f4r_opctx *ctx, int result)
+{
+    stats_op_leave( ctx, result);
+    slowlog_check( ctx, result);
+    trace_check( ctx, result);
+    return result;
+}
+
+static int op_getattr(const char *path, struct stat *statbuf)
+{
+    OP_ENTER( OP_GETATTR, path, 0, 0);
+    return OP_LEAVE( f4r_getattr( path, statbuf));
+}
+
+static int op_readlink(const char *path, char *link, size_t size)
+{
+    OP_ENTER( OP_READLINK, path, size, 0);
+    return OP_LEAVE( f4r_readlink( path, link, size));
+}
+
+static int op_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    OP_ENTER( OP_MKNOD, path, 0, 0);
+    return OP_LEAVE( f4r_mknod( path, mode, dev));
+}
+
+static int op_mkdir(const char *path, mode_t mode)
+{
+    OP_ENTER( OP_MKDIR, path, 0, 0);
+    return OP_LEAVE( f4r_mkdir( path, mode));
+}
+
+static int op_unlink(const char *path)
+{
+    OP_ENTER( OP_UNLINK, path, 0, 0);
+    return OP_LEAVE( f4r_unlink( path));
+}
+
+static int op_rmdir(const char *path)
+{
+    OP_ENTER( OP_RMDIR, path, 0, 0);
+    return OP_LEAVE( f4r_rmdir( path));
+}
+
+static int op_symlink(const char *path, const char *link)
+{
+    OP_ENTER( OP_SYMLINK, path, 0, 0);
+    return OP_LEAVE( f4r_symlink( path, link));
+}
+
+static int op_rename(const char *path, const char *newpath)
+{
+    OP_ENTER( OP_RENAME, path, 0, 0);
+    opctx.path2 = newpath;
+    return OP_LEAVE( f4r_rename( path, newpath));
+}
+
+static int op_link(const char *path, const char *newpath)
+{
+    OP_ENTER( OP_LINK, path, 0, 0);
+    return OP_LEAVE( f4r_link( path, newpath));
+}
+
+static int op_chmod(const char *path, mode_t mode)
+{
+    OP_ENTER( OP_CHMOD, path, 0, 0);
+    return OP_LEAVE( f4r_chmod( path, mode));
+}
+
+static int op_chown(const char *path, uid_t uid, gid_t gid)
+{
+    OP_ENTER( OP_CHOWN, path, 0, 0);
+    return OP_LEAVE( f4r_chown( path, uid, gid));
+}
+
+static int op_truncate(const char *path, off_t newsize)
+{
+    OP_ENTER( OP_TRUNCATE, path, 0, newsize);
+    return OP_LEAVE( f4r_truncate( path, newsize));
+}
+
+static int op_utime(const char *path, struct utimbuf *ubuf)
+{
+    OP_ENTER( OP_UTIME, path, 0, 0);
+    return OP_LEAVE( f4r_utime( path, ubuf));
+}
+
+static int op_open(const char *path, struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_OPEN, path, 0, 0);
+    opctx.flags = fi->flags;
+    return OP_LEAVE( f4r_open( path, fi));
+}
+
+static int op_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_READ, path, size, offset);
+    return OP_LEAVE( f4r_read( path, buf, size, offset, fi));
+}
+
+static int op_write(const char *path, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_WRITE, path, size, offset);
+    return OP_LEAVE( f4r_write( path, buf, size, offset, fi));
+}
+
+static int op_statfs(const char *path, struct statvfs *statv)
+{
+    OP_ENTER( OP_STATFS, path, 0, 0);
+    return OP_LEAVE( f4r_statfs( path, statv));
+}
+
+static int op_flush(const char *path, struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_FLUSH, path, 0, 0);
+    return OP_LEAVE( f4r_flush( path, fi));
+}
+
+static int op_release(const char *path, struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_RELEASE, path, 0, 0);
+    return OP_LEAVE( f4r_release( path, fi));
+}
+
+static int op_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_FSYNC, path, 0, 0);
+    return OP_LEAVE( f4r_fsync( path, datasync, fi));
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static int op_setxattr(const char *path, const char *name, const char *value, size_t size,
+                       int flags)
+{
+    OP_ENTER( OP_SETXATTR, path, size, 0);
+    return OP_LEAVE( f4r_setxattr( path, name, value, size, flags));
+}
+
+static int op_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    OP_ENTER( OP_GETXATTR, path, size, 0);
+    return OP_LEAVE( f4r_getxattr( path, name, value, size));
+}
+
+static int op_listxattr(const char *path, char *list, size_t size)
+{
+    OP_ENTER( OP_LISTXATTR, path, size, 0);
+    return OP_LEAVE( f4r_listxattr( path, list, size));
+}
+
+static int op_removexattr(const char *path, const char *name)
+{
+    OP_ENTER( OP_REMOVEXATTR, path, 0, 0);
+    return OP_LEAVE( f4r_removexattr( path, name));
+}
+#endif
+
+static int op_opendir(const char *path, struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_OPENDIR, path, 0, 0);
+    return OP_LEAVE( f4r_opendir( path, fi));
+}
+
+static int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                      struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_READDIR, path, 0, offset);
+    return OP_LEAVE( f4r_readdir( path, buf, filler, offset, fi));
+}
+
+static int op_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_RELEASEDIR, path, 0, 0);
+    return OP_LEAVE( f4r_releasedir( path, fi));
+}
+
+static int op_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_FSYNCDIR, path, 0, 0);
+    return OP_LEAVE( f4r_fsyncdir( path, datasync, fi));
+}
+
+static int op_access(const char *path, int mask)
+{
+    OP_ENTER( OP_ACCESS, path, 0, 0);
+    return OP_LEAVE( f4r_access( path, mask));
+}
+
+static int op_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_FTRUNCATE, path, 0, offset);
+    return OP_LEAVE( f4r_ftruncate( path, offset, fi));
+}
+
+static int op_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+{
+    OP_ENTER( OP_FGETATTR, path, 0, 0);
+    return OP_LEAVE( f4r_fgetattr( path, statbuf, fi));
 }
 
 struct fuse_operations f4r_oper = {
-  .getattr = f4r_getattr,
-  .readlink = f4r_readlink,
+  .getattr = op_getattr,
+  .readlink = op_readlink,
   // no .getdir -- that's deprecated
   .getdir = NULL,
-  .mknod = f4r_mknod,
-  .mkdir = f4r_mkdir,
-  .unlink = f4r_unlink,
-  .rmdir = f4r_rmdir,
-  .symlink = f4r_symlink,
-  .rename = f4r_rename,
-  .link = f4r_link,
-  .chmod = f4r_chmod,
-  .chown = f4r_chown,
-  .truncate = f4r_truncate,
-  .utime = f4r_utime,
-  .open = f4r_open,
-  .read = f4r_read,
-  .write = f4r_write,
+  .mknod = op_mknod,
+  .mkdir = op_mkdir,
+  .unlink = op_unlink,
+  .rmdir = op_rmdir,
+  .symlink = op_symlink,
+  .rename = op_rename,
+  .link = op_link,
+  .chmod = op_chmod,
+  .chown = op_chown,
+  .truncate = op_truncate,
+  .utime = op_utime,
+  .open = op_open,
+  .read = op_read,
+  .write = op_write,
   /** Just a placeholder, don't set */ // huh???
-  .statfs = f4r_statfs,
-  .flush = f4r_flush,
-  .release = f4r_release,
-  .fsync = f4r_fsync,
+  .statfs = op_statfs,
+  .flush = op_flush,
+  .release = op_release,
+  .fsync = op_fsync,
   
 #ifdef HAVE_SYS_XATTR_H
-  .setxattr = f4r_setxattr,
-  .getxattr = f4r_getxattr,
-  .listxattr = f4r_listxattr,
-  .removexattr = f4r_removexattr,
+  .setxattr = op_setxattr,
+  .getxattr = op_getxattr,
+  .listxattr = op_listxattr,
+  .removexattr = op_removexattr,
 #endif
   
-  .opendir = f4r_opendir,
-  .readdir = f4r_readdir,
-  .releasedir = f4r_releasedir,
-  .fsyncdir = f4r_fsyncdir,
+  .opendir = op_opendir,
+  .readdir = op_readdir,
+  .releasedir = op_releasedir,
+  .fsyncdir = op_fsyncdir,
   .init = f4r_init,
   .destroy = f4r_destroy,
-  .access = f4r_access,
-  .ftruncate = f4r_ftruncate,
-  .fgetattr = f4r_fgetattr
+  .access = op_access,
+  .ftruncate = op_ftruncate,
+  .fgetattr = op_fgetattr
 };
 
 
+// fuse4redis specific mount options. Anything else is left for FUSE.
+#define F4R_OPT(t, p) { t, offsetof(struct f4r_state, p), 0 }
+
+static struct fuse_opt f4r_opts[] = {
+    F4R_OPT("redis_host=%s", redis_host),
+    F4R_OPT("redis_port=%d", redis_port),
+    F4R_OPT("redis_conns=%d", redis_conns),
+    F4R_OPT("redis_sentinel=%s", redis_sentinel),
+    F4R_OPT("redis_master=%s", redis_master),
+    F4R_OPT("redis_retry_ms=%u", redis_retry_ms),
+    F4R_OPT("redis_dbs=%s", redis_dbs),
+    { "async_unlink", offsetof(struct f4r_state, async_unlink), 1 },
+    { "checksums", offsetof(struct f4r_state, checksums), 1 },
+    F4R_OPT("loglevel=%d", loglevel),
+    F4R_OPT("metrics_socket=%s", metrics_socket),
+    F4R_OPT("metrics_file=%s", metrics_file),
+    F4R_OPT("metrics_interval=%d", metrics_interval),
+    F4R_OPT("slow_op_us=%u", slow_op_us),
+    F4R_OPT("slowlog_entries=%u", slowlog_entries),
+    F4R_OPT("trace_file=%s", trace_file),
+    { "trace", offsetof(struct f4r_state, trace), 1 },
+    { "cmdlog", offsetof(struct f4r_state, cmdlog), 1 },
+    F4R_OPT("fsync=%s", fsync),
+    F4R_OPT("fsync_window_us=%u", fsync_window_us),
+    { "immutable", offsetof(struct f4r_state, immutable), 1 },
+    F4R_OPT("cache_mb=%u", cache_mb),
+    F4R_OPT("wal=%s", wal),
+    F4R_OPT("wal_max_mb=%u", wal_max_mb),
+    FUSE_OPT_END
+};
+
+// Paths used only once FUSE runs, after it changed directory to '/', are
+// made absolute while they still mean what the user meant
+static char *f4r_abspath( const char *option, char *path)
+{
+    char cwd[ PATH_MAX], *abs;
+
+    if ( path == NULL || path[ 0] == '/')
+        return path;
+    if ( getcwd( cwd, sizeof( cwd)) == NULL ||
+         ( abs = malloc( strlen( cwd) + strlen( path) + 2)) == NULL) {
+        fprintf(stderr, "Cannot make %s=%s an absolute path: %s\n", option, path, strerror( errno));
+        exit( -12);
+    }
+    sprintf( abs, "%s/%s", cwd, path);
+    return abs;
+}
+
 int main(int argc, char *argv[])
 {
     int fuse_stat;
     struct f4r_state *f4r_data;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 
     // See which version of fuse we're running
@@ -1066,20 +1090,68 @@ int main(int argc, char *argv[])
         exit( -1);
     }
  	
-    f4r_data = malloc(sizeof(struct f4r_state));
+    f4r_data = calloc(1, sizeof(struct f4r_state));
     if (f4r_data == NULL) {
         perror("main calloc");
         abort();
     }
+    f4r_data->redis_host = "127.0.0.1";
+    f4r_data->redis_port = 6379;
+    f4r_data->redis_conns = 1;
+    f4r_data->redis_retry_ms = 30000;
+    f4r_data->loglevel = LOG_INFO;
+    if (fuse_opt_parse(&args, f4r_data, f4r_opts, NULL) == -1)
+        exit( -1);
+
     f4r_data->logfile = log_open();
+    log_level = f4r_data->loglevel;
 
 
-    // TODO: implement option to connect to a remote redis host
-    kvs_init(hostname, port);
+    if (f4r_data->redis_sentinel != NULL &&
+        kvs_SetSentinels( f4r_data->redis_sentinel, f4r_data->redis_master) != 0) {
+        fprintf(stderr, "Invalid sentinel list %s, use host:port[,host:port...]\n",
+                f4r_data->redis_sentinel);
+        exit( -10);
+    }
+    if (f4r_data->redis_dbs != NULL && kvs_SetDatabases( f4r_data->redis_dbs) != 0) {
+        fprintf(stderr, "Invalid database list %s, use e.g. 0-15 or 0,3,7\n", f4r_data->redis_dbs);
+        exit( -11);
+    }
+    kvs_SetRetryTime( f4r_data->redis_retry_ms);
+    kvs_SetAsyncUnlink( f4r_data->async_unlink);
+    kvs_SetChecksums( f4r_data->checksums);
+    kvs_init( f4r_data->redis_host, f4r_data->redis_port, f4r_data->redis_conns);
+    stats_init();
+    slowlog_init( f4r_data->slow_op_us, f4r_data->slowlog_entries);
+    cmdlog_init( f4r_data->cmdlog);
+    if (f4r_data->fsync != NULL && kvs_SetSyncMode( f4r_data->fsync, f4r_data->fsync_window_us) != 0) {
+        fprintf(stderr, "Invalid fsync mode %s, use none, wait:<replicas>[:<timeout_ms>] or "
+                "waitaof:<local>:<replicas>[:<timeout_ms>]; the timeout bounds how long a\n"
+                "WAIT or WAITAOF holds up the other requests on its connection\n", f4r_data->fsync);
+        exit( -8);
+    }
+    if (f4r_data->wal != NULL && wal_init( f4r_data->wal, f4r_data->wal_max_mb) != 0) {
+        fprintf(stderr, "Cannot open write-ahead journal %s\n", f4r_data->wal);
+        exit( -9);
+    }
+    if (f4r_data->trace_file != NULL && trace_init( f4r_data->trace_file, f4r_data->trace) != 0) {
+        fprintf(stderr, "Cannot create trace file %s\n", f4r_data->trace_file);
+        exit( -7);
+    }
+    f4r_data->metrics_socket = f4r_abspath( "metrics_socket", f4r_data->metrics_socket);
+    f4r_data->metrics_file = f4r_abspath( "metrics_file", f4r_data->metrics_file);
+    if (f4r_data->immutable) {
+        // Nothing changes, so the kernel may keep what it read for as long as
+        // it likes. Inserted first, so timeouts given by the user win.
+        cache_init( f4r_data->cache_mb);
+        fuse_opt_insert_arg(&args, 1, "-oro,kernel_cache,entry_timeout=31536000,"
+                            "attr_timeout=31536000,negative_timeout=31536000");
+    }
     
     // turn over control to fuse
     
-    fuse_stat = fuse_main(argc, argv, &f4r_oper, f4r_data);
+    fuse_stat = fuse_main(args.argc, args.argv, &f4r_oper, f4r_data);
+    fuse_opt_free_args(&args);
     
     return fuse_stat;
 }
@@ -0,0 +1,71 @@
+/*
+  Log-linear latency histograms, in the spirit of HdrHistogram.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#include "hist.h"
+
+static uint64_t hist_bucket_lower(int bucket)
+{
+    int e, m;
+
+    if (bucket < HIST_SUB)
+        return bucket;
+    e = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    m = bucket % HIST_SUB;
+    return (uint64_t) (HIST_SUB + m) << (e - HIST_SUB_BITS);
+}
+
+// Smallest value that no longer falls in 'bucket'
+uint64_t hist_bucket_upper(int bucket)
+{
+    return hist_bucket_lower(bucket + 1);
+}
+
+// Adds src to dst. src may be concurrently updated by its owner.
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    int b;
+
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    if (max > dst->max)
+        dst->max = max;
+    for (b = 0; b < HIST_BUCKETS; b++)
+        dst->bucket[b] += __atomic_load_n(&src->bucket[b], __ATOMIC_RELAXED);
+}
+
+// Value below which 'percent' of the recorded values fall. Reported as the
+// middle of the bucket, but never above the largest value seen.
+uint64_t hist_percentile(const struct hist *h, double percent)
+{
+    uint64_t total = 0, seen = 0, rank;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+        total += h->bucket[b];
+    if (total == 0)
+        return 0;
+
+    rank = (uint64_t) (percent / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if (seen >= rank) {
+            uint64_t lower = hist_bucket_lower(b),
+                     value = lower + (hist_bucket_upper(b) - lower) / 2;
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+uint64_t hist_mean(const struct hist *h)
+{
+    return h->count > 0 ? h->sum / h->count : 0;
+}
@@ -0,0 +1,70 @@
+/*
+  Log-linear latency histograms, in the spirit of HdrHistogram.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Values (nanoseconds) below 16 get a bucket each. Above that every power
+  of two is split in 16 buckets, so any reported value is within 6.25%
+  of the true one. A histogram has a single writer, which updates it with
+  relaxed atomic stores so that other threads may merge it at any time.
+*/
+
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP    36      // 2^36ns is about 68s, larger values are clamped
+#define HIST_BUCKETS    ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+static inline uint64_t hist_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int hist_bucket(uint64_t value)
+{
+    int e;
+
+    if (value < HIST_SUB)
+        return (int) value;
+    e = 63 - __builtin_clzll(value);
+    if (e > HIST_MAX_EXP)
+        return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+           (int) ((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Adds a value. Only the thread owning the histogram may call this.
+static inline void hist_record(struct hist *h, uint64_t value)
+{
+    int b = hist_bucket(value);
+
+    __atomic_store_n(&h->bucket[b], h->bucket[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value > h->max)
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+void hist_merge(struct hist *dst, const struct hist *src);
+uint64_t hist_percentile(const struct hist *h, double percent);
+uint64_t hist_mean(const struct hist *h);
+uint64_t hist_bucket_upper(int bucket);
+
+#endif
@@ -0,0 +1,1936 @@
+/*
+  Key-value store (KVS) layer of fuse4redis: everything that talks to redis.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The file system logic in fuse4redis.c only sees the kvs_* functions
+  declared in kvs.h. Tools such as f4r_replay link this layer directly.
+*/
+
+#include "params.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fuse.h>
+#include <hiredis.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmdlog.h"
+#include "crc32c.h"
+#include "ctl.h"
+#include "log.h"
+#include "kvs.h"
+#include "kvs_queue.h"
+#include "probes.h"
+#include "stats.h"
+
+// A command waiting to be sent by an I/O thread. It lives on the stack of
+// the FUSE thread that issued it, which sleeps on 'done' until the reply is in.
+// A detached one, an UNLINK nobody waits for, is on the heap instead and the
+// I/O thread frees it, see kvs_DeleteKey().
+struct kvs_request {
+    struct kvsq_node node;      // Must be first, the queue hands back this pointer
+    char *cmd;                  // Command already formatted in redis protocol
+    size_t len;
+    redisReply *reply;
+    sem_t done;
+    int detached;
+    int merged;                 // Detached UNLINKs it stands for, see kvs_Complete()
+    int once;                   // Fails rather than runs twice, see kvs_PipelineBatch()
+    char *key;                  // Of a detached UNLINK, to merge it with others
+    uint64_t submitted;         // Where its time goes, see stats_cmd_stages()
+    uint64_t dequeued;
+    uint64_t sent;
+    uint64_t replied;
+};
+
+// Upper bound on the commands written to redis in one go
+#define KVS_MAX_BATCH 256
+
+#define KVS_MAX_SENTINELS 8
+#define KVS_BACKOFF_MIN_US 10000
+#define KVS_BACKOFF_MAX_US 1000000
+#define KVS_SYNC_FILES 256
+
+// A redis connection with its own queue and I/O thread. Only that thread
+// uses the context once FUSE is running.
+struct kvs_conn {
+    redisContext *ctx;
+    struct kvsq queue;
+    pthread_t thread;
+    int index;
+    int db;                     // Redis database it SELECTed
+    uint64_t commands;          // Sent, for the databases file
+    unsigned attempts;          // Failed reconnections since it was lost
+    unsigned backoff;           // Microseconds until the next one
+    struct {                    // Group commit of fsync(), see kvs_Sync()
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+        uint64_t started;       // Barriers issued so far
+        uint64_t finished;      // and completed
+        int running;            // A leader is waiting for one
+        int result;             // of the last one completed
+        uint64_t epoch;         // Reconnections so far, see kvs_SyncLost()
+        uint64_t written;       // Writes acknowledged so far
+        uint64_t durable;       // How many of them a barrier covered
+        uint64_t lostFrom;      // Writes after lostFrom up to lostTo were
+        uint64_t lostTo;        // on a connection lost before one covered them
+        int lostAll;            // Not reported to fsync() of the directory yet
+        struct {                // Writes to keys hashing here since the
+            uint64_t first;     // last fsync() of one of them
+            uint64_t last;
+        } files[KVS_SYNC_FILES];
+    } sync;
+};
+
+// The connections of one redis database. Each is SELECTed once when it
+// connects, so commands never switch databases, and a busy database only
+// slows down its own connections.
+struct kvs_db {
+    int number;
+    int first;                  // Its connections in kvsConns
+    int count;
+};
+
+static struct kvs_conn kvsConns[KVS_MAX_CONNS];
+static int kvsConnCount = 0;
+static int kvsIoRunning = 0;
+
+// Database 0 only, unless '-o redis_dbs' mounts several, each as a directory
+static struct kvs_db kvsDbs[KVS_MAX_CONNS] = { { 0, 0, 0 } };
+static int kvsDbCount = 1;
+static int kvsMultiDb = 0;
+
+// Where redis is, remembered for reconnections. With sentinels it is
+// whatever they say the master is, asked again on every reconnection.
+static const char *kvsHost;
+static int kvsPort;
+static struct {
+    char host[256];
+    int port;
+} kvsSentinels[KVS_MAX_SENTINELS];
+static int kvsSentinelCount = 0;
+static const char *kvsMasterName = "mymaster";
+
+// How long a request waits for redis to come back before it fails with EIO
+static uint64_t kvsRetryNanos = 30000000000ULL;
+static int kvsStopping = 0;
+
+// Whether kvs_DeleteKey() returns before redis has deleted the key
+static int kvsAsyncUnlink = 0;
+
+// Whether files carry block checksums, see kvs_WriteChecked(). Writers of the
+// same file take turns, as each computes checksums from what it read before.
+#define KVS_CRC_LOCKS 256
+static int kvsChecksums = 0;
+static pthread_mutex_t kvsCrcLocks[KVS_CRC_LOCKS];
+
+// Parses '-o redis_sentinel=host:port[,host:port...]'. 'master' is the name
+// the sentinels know the master by, NULL for "mymaster".
+int kvs_SetSentinels( const char *spec, const char *master)
+{
+    const char *p = spec, *colon, *comma;
+    size_t len;
+    int count = 0;
+
+    while ( *p != '\0') {
+        if ( count == KVS_MAX_SENTINELS)
+            return -EINVAL;
+        comma = strchr( p, ',');
+        if ( comma == NULL)
+            comma = p + strlen( p);
+        colon = memchr( p, ':', comma - p);
+        len = ( colon != NULL ? colon : comma) - p;
+        if ( len == 0 || len >= sizeof(kvsSentinels[0].host))
+            return -EINVAL;
+        memcpy( kvsSentinels[count].host, p, len);
+        kvsSentinels[count].host[len] = '\0';
+        kvsSentinels[count].port = colon != NULL ? atoi( colon + 1) : 26379;
+        if ( kvsSentinels[count].port <= 0)
+            return -EINVAL;
+        count++;
+        p = *comma == ',' ? comma + 1 : comma;
+    }
+    if ( count == 0)
+        return -EINVAL;
+    kvsSentinelCount = count;
+    if ( master != NULL)
+        kvsMasterName = master;
+    return 0;
+}
+
+// Makes kvs_DeleteKey() return without waiting for redis
+void kvs_SetAsyncUnlink( int enable)
+{
+    kvsAsyncUnlink = enable;
+}
+
+// Makes writes maintain, and reads verify, a CRC-32C of every block of a file
+void kvs_SetChecksums( int enable)
+{
+    kvsChecksums = enable;
+}
+
+// Sets how long requests are held while redis is unreachable
+void kvs_SetRetryTime( unsigned ms)
+{
+    kvsRetryNanos = (uint64_t) ms * 1000000;
+}
+
+// Parses '-o redis_dbs=LIST', the databases to mount, as in "0-15" or "0,3,7".
+// Each becomes a directory in the root named after its number, and keys are
+// files in those.
+int kvs_SetDatabases( const char *spec)
+{
+    struct kvs_db dbs[KVS_MAX_CONNS];
+    const char *p = spec;
+    char *end;
+    long from, to, n;
+    int count = 0, j;
+
+    while ( *p != '\0') {
+        from = to = strtol( p, &end, 10);
+        if ( end == p || from < 0)
+            return -EINVAL;
+        if ( *end == '-') {
+            p = end + 1;
+            to = strtol( p, &end, 10);
+            if ( end == p || to < from)
+                return -EINVAL;
+        }
+        for ( n = from; n <= to; n++) {
+            for ( j = 0; j < count && dbs[j].number != n; j++)
+                ;
+            if ( j < count)
+                continue;       // Listed twice
+            if ( count == KVS_MAX_CONNS)
+                return -EINVAL;
+            dbs[count++].number = n;
+        }
+        if ( *end == ',' && end[1] != '\0')
+            end++;
+        else if ( *end != '\0')
+            return -EINVAL;
+        p = end;
+    }
+    if ( count == 0)
+        return -EINVAL;
+    memcpy( kvsDbs, dbs, count * sizeof(struct kvs_db));
+    kvsDbCount = count;
+    kvsMultiDb = 1;
+    return 0;
+}
+
+// Asks the sentinels, in turn, where the master is
+static int kvs_AskSentinels( char *host, size_t size, int *port)
+{
+    struct timeval timeout = { 0, 500000 };
+    int j;
+
+    for ( j = 0; j < kvsSentinelCount; j++) {
+        redisContext *ctx = redisConnectWithTimeout( kvsSentinels[j].host, kvsSentinels[j].port, timeout);
+        redisReply *reply = NULL;
+        int found = 0;
+
+        if ( ctx != NULL && ctx->err == 0) {
+            redisSetTimeout( ctx, timeout);
+            reply = redisCommand( ctx, "SENTINEL get-master-addr-by-name %s", kvsMasterName);
+        }
+        if ( reply != NULL && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+             reply->element[0]->type == REDIS_REPLY_STRING &&
+             reply->element[1]->type == REDIS_REPLY_STRING) {
+            snprintf( host, size, "%s", reply->element[0]->str);
+            *port = atoi( reply->element[1]->str);
+            found = 1;
+        } else
+            log_debug( "kvs_AskSentinels: sentinel %s:%d does not know master %s\n",
+                       kvsSentinels[j].host, kvsSentinels[j].port, kvsMasterName);
+        if ( reply != NULL)
+            freeReplyObject( reply);
+        redisFree( ctx);
+        if ( found)
+            return 0;
+    }
+    return -EHOSTUNREACH;
+}
+
+// Opens a connection to redis, or to the master the sentinels name. After a
+// failover a sentinel may still name the old master for a moment, so it
+// has to say it is one (ROLE). Returns NULL if that fails, with the reason
+// in 'error'. The connection is to database 'db'.
+static redisContext *kvs_Connect( int db, char *error, size_t size)
+{
+    struct timeval timeout = { 1, 500000 }; // 1.5 seconds
+    char host[256];
+    int port = kvsPort;
+    redisContext *ctx;
+    redisReply *reply;
+
+    snprintf( host, sizeof(host), "%s", kvsHost);
+    if ( kvsSentinelCount > 0 && kvs_AskSentinels( host, sizeof(host), &port) < 0) {
+        snprintf( error, size, "no sentinel knows master %s", kvsMasterName);
+        return NULL;
+    }
+    ctx = redisConnectWithTimeout( host, port, timeout);
+    if ( ctx == NULL) {
+        snprintf( error, size, "can't allocate redis context");
+        return NULL;
+    }
+    if ( ctx->err) {
+        snprintf( error, size, "%s:%d: %s", host, port, ctx->errstr);
+        redisFree( ctx);
+        return NULL;
+    }
+    // A master that vanished without closing the connection is noticed by
+    // TCP keepalive, and then reconnected to like any other loss
+    redisEnableKeepAlive( ctx);
+    if ( kvsSentinelCount > 0) {
+        reply = redisCommand( ctx, "ROLE");
+        if ( reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements == 0 ||
+             reply->element[0]->type != REDIS_REPLY_STRING ||
+             strcmp( reply->element[0]->str, "master") != 0) {
+            snprintf( error, size, "%s:%d is not a master", host, port);
+            if ( reply != NULL)
+                freeReplyObject( reply);
+            redisFree( ctx);
+            return NULL;
+        }
+        freeReplyObject( reply);
+    }
+    if ( db != 0) {
+        reply = redisCommand( ctx, "SELECT %d", db);
+        if ( reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+            snprintf( error, size, "SELECT %d: %s", db, reply != NULL ? reply->str : ctx->errstr);
+            if ( reply != NULL)
+                freeReplyObject( reply);
+            redisFree( ctx);
+            return NULL;
+        }
+        freeReplyObject( reply);
+    }
+    return ctx;
+}
+
+static void kvs_RenderDatabases( struct ctl_buf *out);
+static int kvs_LoadScripts( redisContext *ctx);
+static void kvs_SyncLost( struct kvs_conn *conn);
+static uint64_t kvs_SyncEpoch( struct kvs_db *db, const char *name);
+static void kvs_SyncWritten( struct kvs_db *db, const char *name, uint64_t epoch);
+
+// Initial connections to redis upon startup. Simply aborts if one fails.
+// 'conns' is per database.
+//
+void kvs_init( const char *hostname, int port, int conns)
+{
+    char error[512];
+    int d, j;
+    
+    kvsHost = hostname;
+    kvsPort = port;
+    conns = conns < 1 ? 1 : conns;
+    if ( conns * kvsDbCount > KVS_MAX_CONNS) {
+        conns = KVS_MAX_CONNS / kvsDbCount;
+        printf("Too many connections, using %d per database\n", conns);
+    }
+    kvsConnCount = 0;
+    for ( d = 0; d < kvsDbCount; d++) {
+        kvsDbs[d].first = kvsConnCount;
+        kvsDbs[d].count = conns;
+        for ( j = kvsConnCount; j < kvsConnCount + conns; j++) {
+            redisContext *ctx = kvs_Connect( kvsDbs[d].number, error, sizeof(error));
+
+            if ( ctx == NULL) {
+                printf("Connection error: %s\n", error);
+                exit(-2);
+            }
+            kvsConns[j].ctx = ctx;
+            kvsConns[j].index = j;
+            kvsConns[j].db = kvsDbs[d].number;
+            pthread_mutex_init( &kvsConns[j].sync.lock, NULL);
+            pthread_cond_init( &kvsConns[j].sync.done, NULL);
+        }
+        kvsConnCount += conns;
+    }
+    if ( kvsChecksums && kvs_LoadScripts( kvsConns[0].ctx) < 0)
+        exit(-2);
+    for ( j = 0; j < KVS_CRC_LOCKS; j++)
+        pthread_mutex_init( &kvsCrcLocks[j], NULL);
+    if ( kvsMultiDb)
+        ctl_register( "databases", kvs_RenderDatabases);
+}
+
+// Hands a reply, or NULL if there is none, to whoever waits for it. A detached
+// request has nobody, so its outcome is only logged and counted.
+static void kvs_Complete( struct kvs_request *req, redisReply *reply)
+{
+    int j;
+
+    if ( ! req->detached) {
+        req->reply = reply;
+        sem_post( &req->done);      // req may vanish after this
+        return;
+    }
+    if ( reply == NULL || reply->type == REDIS_REPLY_ERROR)
+        log_err( "kvs_DeleteKey: ERROR - UNLINK failed: %s\n", reply != NULL ? reply->str :
+                 "redis unreachable");
+    // Each fired kvs__cmd__entry when it was queued, merged or not
+    for ( j = 0; j < req->merged; j++)
+        F4R_PROBE4(kvs__cmd__return, stats_cmd_names[CMD_UNLINK], reply != NULL ? reply->type : -1,
+                   req->replied - req->submitted, 0);
+    stats_cmd_record( CMD_UNLINK, req->replied - req->submitted,
+                      reply == NULL || reply->type == REDIS_REPLY_ERROR, req->len, 0);
+    if ( reply != NULL)
+        freeReplyObject( reply);
+    free( req->cmd);
+    free( req->key);
+    free( req);
+}
+
+// Fails a request that cannot be sent. Its FUSE thread gets EIO.
+static void kvs_Fail( struct kvs_request *req)
+{
+    req->sent = req->replied = hist_now();
+    kvs_Complete( req, NULL);
+}
+
+// Reconnects to redis, retrying with exponential backoff (10 ms doubling up
+// to 1 s) while the requests in 'batch' have time left. Requests that run
+// out of it fail, the rest keep their order. Requests submitted meanwhile
+// wait in the queue. Returns how many are left; if none, the connection
+// may still be down and the next batch tries again, without starting the
+// backoff over. Only the first failure and the recovery are logged, so an
+// outage does not flood the log.
+static int kvs_Reconnect( struct kvs_conn *conn, struct kvs_request **batch, int count)
+{
+    char error[512];
+    int j, left;
+
+    for ( ;;) {
+        redisFree( conn->ctx);
+        conn->ctx = kvs_Connect( conn->db, error, sizeof(error));
+        if ( conn->ctx != NULL) {
+            log_info( "kvs_Reconnect: connection %d reestablished after %u failed attempts\n",
+                      conn->index, conn->attempts);
+            conn->attempts = 0;
+            conn->backoff = 0;
+            kvs_SyncLost( conn);
+            stats_io_reconnect();
+            return count;
+        }
+        if ( conn->attempts++ == 0)
+            log_warn( "kvs_Reconnect: Connection error: %s, retrying\n", error);
+        else
+            log_debug( "kvs_Reconnect: attempt %u failed: %s\n", conn->attempts, error);
+
+        for ( j = left = 0; j < count; j++)
+            if ( __atomic_load_n( &kvsStopping, __ATOMIC_RELAXED) ||
+                 hist_now() - batch[j]->submitted >= kvsRetryNanos) {
+                kvs_Fail( batch[j]);
+                stats_io_expired();
+            } else
+                batch[left++] = batch[j];
+        if ( left == 0)
+            return 0;
+        count = left;
+
+        conn->backoff = conn->backoff == 0 ? KVS_BACKOFF_MIN_US :
+                        conn->backoff * 2 > KVS_BACKOFF_MAX_US ? KVS_BACKOFF_MAX_US :
+                        conn->backoff * 2;
+        usleep( conn->backoff);
+    }
+}
+
+// Whether an error reply means redis cannot serve commands right now, as
+// while it loads its data or once it became a replica in a failover. The
+// command did not run, so it is sent again after reconnecting.
+static int kvs_Unavailable( const redisReply *reply)
+{
+    return reply->type == REDIS_REPLY_ERROR &&
+           ( strncmp( reply->str, "LOADING", 7) == 0 || strncmp( reply->str, "READONLY", 8) == 0);
+}
+
+// Whether redis closed an idle connection. Nothing is due on it, so anything
+// to read is the end of the stream or an error.
+static int kvs_Closed( redisContext *ctx)
+{
+    struct pollfd pfd = { ctx->fd, POLLIN, 0 };
+
+    return poll( &pfd, 1, 0) != 0;
+}
+
+// Writes a batch of commands back-to-back and then collects the replies in order,
+// so concurrent FUSE threads share one round trip instead of paying one each.
+// Connection to redis may be lost, or redis may be unavailable for a while, as
+// in a failover. Commands whose reply did not arrive are then resent after
+// reconnecting, which kvs_Reconnect() keeps trying for a bounded time.
+// They may have run already, so they run at least once. That is harmless for
+// those that set what they set again, but a RENAME or UNLINK would fail the
+// second time, or take effect a second time, so these are marked 'once' and
+// fail with EIO instead. Only the one redis answered as unavailable surely
+// did not run. As redis restarting while a connection is idle would fail them
+// too, one is only sent on a connection that shows no sign of being closed.
+static void kvs_PipelineBatch( struct kvs_conn *conn, struct kvs_request **batch, int count)
+{
+    int first = 0, done, rejected, left, j;
+    uint64_t sent;
+
+    while ( first < count) {
+        if ( conn->ctx == NULL) {
+            count = first + kvs_Reconnect( conn, batch + first, count - first);
+            continue;
+        }
+        for ( j = first; j < count && ! batch[j]->once; j++)
+            ;
+        if ( j < count && kvs_Closed( conn->ctx)) {
+            redisFree( conn->ctx);
+            conn->ctx = NULL;
+            continue;
+        }
+        for ( j = first; j < count; j++)
+            redisAppendFormattedCommand( conn->ctx, batch[j]->cmd, batch[j]->len);
+        // redisGetReply() would write them too, but this way we know when
+        do {
+            if ( redisBufferWrite( conn->ctx, &done) != REDIS_OK)
+                break;
+        } while ( ! done);
+        sent = hist_now();
+
+        rejected = 0;
+        for ( j = first; j < count; j++) {
+            void *reply;
+
+            if ( redisGetReply( conn->ctx, &reply) != REDIS_OK)
+                break;
+            if ( kvs_Unavailable( reply)) {
+                log_warn( "Redis unavailable: %s\n", ((redisReply *) reply)->str);
+                freeReplyObject( reply);
+                rejected = 1;
+                break;
+            }
+            batch[j]->sent = sent;
+            batch[j]->replied = hist_now();
+            kvs_Complete( batch[j], reply);     // batch[j] may vanish after this
+        }
+        if ( j == count)
+            return;
+
+        if ( conn->ctx->err != 0)
+            log_warn( "Error when invoking redis: #%d: %s\n", conn->ctx->err, conn->ctx->errstr);
+        redisFree( conn->ctx);
+        conn->ctx = NULL;
+        first = j;
+        for ( j = left = first + rejected; j < count; j++)
+            if ( batch[j]->once) {
+                log_warn( "kvs_PipelineBatch: reply lost, failing a command that may have run\n");
+                kvs_Fail( batch[j]);
+            } else
+                batch[left++] = batch[j];
+        count = left;
+    }
+}
+
+// Replaces 'count' detached UNLINKs, adjacent in a batch, by one UNLINK of all
+// their keys. Only adjacent ones: moving one past another command on its key
+// would reorder them. Returns NULL if out of memory, leaving them as they are.
+static struct kvs_request *kvs_MergeUnlinks( struct kvs_request **run, int count)
+{
+    struct kvs_request *merged = calloc( 1, sizeof(struct kvs_request));
+    const char **argv = malloc( ( count + 1) * sizeof(char *));
+    long long len = -1;
+    int j;
+
+    if ( merged != NULL && argv != NULL) {
+        argv[0] = "UNLINK";
+        for ( j = 0; j < count; j++)
+            argv[j + 1] = run[j]->key;
+        len = redisFormatCommandArgv( &merged->cmd, count + 1, argv, NULL);
+    }
+    free( argv);
+    if ( len < 0) {
+        free( merged);
+        return NULL;
+    }
+    merged->len = len;
+    merged->detached = 1;
+    for ( j = 0; j < count; j++)
+        merged->merged += run[j]->merged;
+    merged->submitted = run[0]->submitted;
+    merged->dequeued = run[count - 1]->dequeued;
+    for ( j = 0; j < count; j++) {
+        free( run[j]->cmd);
+        free( run[j]->key);
+        free( run[j]);
+    }
+    return merged;
+}
+
+// Merges the runs of detached UNLINKs in a batch. Returns the new count.
+static int kvs_CoalesceUnlinks( struct kvs_request **batch, int count)
+{
+    struct kvs_request *merged;
+    int j, k, out = 0;
+
+    for ( j = 0; j < count; j = k) {
+        for ( k = j; k < count && batch[k]->detached; k++)
+            ;
+        if ( k - j < 2 || ( merged = kvs_MergeUnlinks( batch + j, k - j)) == NULL) {
+            k = k > j ? k : j + 1;
+            while ( j < k)
+                batch[out++] = batch[j++];
+        } else
+            batch[out++] = merged;
+    }
+    return out;
+}
+
+// Drains the submission queue of a connection. A request without command asks
+// the thread to stop.
+static void *kvs_IoThread( void *arg)
+{
+    struct kvs_conn *conn = arg;
+    struct kvs_request *batch[KVS_MAX_BATCH];
+    long left;
+    int count, popped, stop = 0;
+
+    stats_io_start( conn->index);
+    while ( ! stop) {
+        kvsq_wait( &conn->queue);
+        do {
+            struct kvsq_node *node;
+            uint64_t start = hist_now();
+
+            count = 0;
+            while ( count < KVS_MAX_BATCH && (node = kvsq_pop( &conn->queue)) != NULL) {
+                struct kvs_request *req = (struct kvs_request *) node;
+
+                if ( req->cmd == NULL) {
+                    stop = 1;
+                    sem_post( &req->done);
+                    continue;
+                }
+                req->dequeued = hist_now();
+                batch[count++] = req;
+            }
+            popped = count;
+            if ( count > 1)
+                count = kvs_CoalesceUnlinks( batch, count);
+            if ( count > 0)
+                kvs_PipelineBatch( conn, batch, count);
+            left = kvsq_done( &conn->queue, popped + stop);
+            __atomic_fetch_add( &conn->commands, count, __ATOMIC_RELAXED);
+            if ( count > 0)
+                stats_io_batch( conn->index, count, left, hist_now() - start);
+        } while ( left > 0 && ! stop);
+    }
+    return NULL;
+}
+
+// Starts the I/O threads. Must run after fuse_main() daemonizes, since threads do
+// not survive the fork. The connections opened by kvs_init() do.
+int kvs_StartIoThread( void)
+{
+    int result, j;
+
+    for ( j = 0; j < kvsConnCount; j++) {
+        kvsq_init( &kvsConns[j].queue);
+        result = pthread_create( &kvsConns[j].thread, NULL, kvs_IoThread, &kvsConns[j]);
+        if ( result != 0) {
+            log_err( "kvs_StartIoThread: ERROR - cannot create I/O thread: %s\n", strerror(result));
+            return -result;
+        }
+        kvsIoRunning = j + 1;
+    }
+    return 0;
+}
+
+// The connection serving a key of a database. Commands on the same key always
+// share one, so they reach redis in the order they were issued.
+static struct kvs_conn *kvs_ConnForKey( struct kvs_db *db, const char *key, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for ( ; size > 0; size--, key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211ULL;
+    }
+    return &kvsConns[db->first + hash % db->count];
+}
+
+// The connection serving a command. The key is the first argument,
+// "*<n>\r\n$<len>\r\n<command>\r\n$<len>\r\n<key>\r\n" in redis protocol.
+static struct kvs_conn *kvs_ConnFor( struct kvs_db *db, const char *cmd, size_t len)
+{
+    const char *p = cmd, *end = cmd + len;
+    long size;
+    int arg;
+
+    if ( db->count == 1)
+        return &kvsConns[db->first];
+    for ( arg = 0; arg < 2; arg++) {
+        while ( p < end && *p != '$')
+            p++;
+        if ( p >= end)
+            return &kvsConns[db->first];    // Command without arguments, no key
+        size = strtol( p + 1, (char **) &p, 10);
+        p += 2;     // \r\n
+        if ( arg == 0)
+            p += size;
+    }
+    return kvs_ConnForKey( db, p, size < end - p ? size : end - p);
+}
+
+// Hands a formatted command to the I/O thread and waits for its reply
+static void kvs_Submit( struct kvs_conn *conn, struct kvs_request *req)
+{
+    sem_init( &req->done, 0, 0);
+    req->submitted = hist_now();
+    kvsq_push( &conn->queue, &req->node);
+    while ( sem_wait( &req->done) != 0 && errno == EINTR)
+        ;
+    sem_destroy( &req->done);
+}
+
+// Size of a reply as it travelled on the wire, in redis protocol (RESP).
+// Only used for accounting, so it does not have to be fast.
+static size_t kvs_ReplySize( const redisReply *reply)
+{
+    char digits[24];
+    size_t size, j;
+
+    switch ( reply->type) {
+    case REDIS_REPLY_STRING:    // $<len>\r\n<data>\r\n
+        return 1 + snprintf( digits, sizeof(digits), "%zu", reply->len) + 2 + reply->len + 2;
+    case REDIS_REPLY_STATUS:    // +<text>\r\n
+    case REDIS_REPLY_ERROR:
+        return 1 + reply->len + 2;
+    case REDIS_REPLY_INTEGER:
+        return 1 + snprintf( digits, sizeof(digits), "%lld", reply->integer) + 2;
+    case REDIS_REPLY_NIL:       // $-1\r\n
+        return 5;
+    case REDIS_REPLY_ARRAY:
+        size = 1 + snprintf( digits, sizeof(digits), "%zu", reply->elements) + 2;
+        for ( j = 0; j < reply->elements; j++)
+            size += kvs_ReplySize( reply->element[j]);
+        return size;
+    }
+    return 0;
+}
+
+// Instead of calling redisCommand throughout the code and handling errors 
+// on every call, we will wrap redisCommand and provide better error handling
+// in one single place, maintaining the rest of the code cleanner.
+// Guarantees that resultReply in non-NULL upon successfull return.
+// 'conn' is where the command goes, NULL for the connection of its key in 'db'.
+static int kvs_vCommand( struct kvs_db *db, struct kvs_conn *conn, int once,
+                         redisReply **resultReply, const char *cmd, va_list valist)
+{
+    struct kvs_request req;
+    redisReply *kvsReply;
+    uint64_t start = hist_now(), nanos;
+    size_t replySize;
+    int len, cmdId = stats_cmd_id( cmd);
+
+    len = redisvFormatCommand( &req.cmd, cmd, valist);
+    if ( len < 0) {
+        log_err( "kvs_RedisCommand: ERROR - cannot format command %s\n", cmd);
+        return -ENOMEM;
+    }
+    req.len = len;
+    req.reply = NULL;
+    req.detached = 0;
+    req.once = once;
+
+    F4R_PROBE2(kvs__cmd__entry, stats_cmd_names[cmdId], req.len);
+    cmdlog_check( cmdId);
+    kvs_Submit( conn != NULL ? conn : kvs_ConnFor( db, req.cmd, req.len), &req);
+    stats_cmd_stages( req.dequeued - req.submitted, req.sent - req.dequeued,
+                      req.replied - req.sent, hist_now() - req.replied);
+    free( req.cmd);
+
+    // No reply if redis could not be reached in time
+    kvsReply = req.reply;
+    *resultReply = kvsReply;
+    nanos = hist_now() - start;
+    if ( kvsReply == NULL) {
+        log_err( "kvs_RedisCommand: ERROR - redis unreachable, %s failed\n", stats_cmd_names[cmdId]);
+        F4R_PROBE4(kvs__cmd__return, stats_cmd_names[cmdId], -1, nanos, 0);
+        stats_cmd_record( cmdId, nanos, 1, req.len, 0);
+        return -EIO;
+    }
+    replySize = kvs_ReplySize( kvsReply);
+    F4R_PROBE4(kvs__cmd__return, stats_cmd_names[cmdId], kvsReply->type, nanos, replySize);
+    stats_cmd_record( cmdId, nanos, kvsReply->type == REDIS_REPLY_ERROR, req.len, replySize);
+             
+    if ( kvsReply->type == REDIS_REPLY_ERROR) {
+        // A script redis does not have (any more), kvs_Eval() loads it
+        int noScript = strncmp( kvsReply->str, "NOSCRIPT", 8) == 0;
+
+        if ( ! noScript)
+            log_err( "kvs_RedisCommand: ERROR - Redis says: %s\n", kvsReply->str);
+        freeReplyObject( kvsReply);
+        *resultReply = NULL;    // Releasing it here upon error keeps code a little cleanner
+        return noScript ? -ENOEXEC : -EIO;
+    }
+    return 0;
+}
+
+int kvs_RedisCommand( redisReply **resultReply, const char *cmd, ...)
+{
+    va_list valist;
+    int result;
+
+    va_start(valist, cmd);
+    result = kvs_vCommand( &kvsDbs[0], NULL, 0, resultReply, cmd, valist);
+    va_end(valist);
+    return result;
+}
+
+// A command on a key of a given database
+static int kvs_Command( struct kvs_db *db, redisReply **resultReply, const char *cmd, ...)
+{
+    va_list valist;
+    int result;
+
+    va_start(valist, cmd);
+    result = kvs_vCommand( db, NULL, 0, resultReply, cmd, valist);
+    va_end(valist);
+    return result;
+}
+
+// A command on a given connection, for those whose first argument is no key
+static int kvs_CommandOn( struct kvs_conn *conn, redisReply **resultReply, const char *cmd, ...)
+{
+    va_list valist;
+    int result;
+
+    va_start(valist, cmd);
+    result = kvs_vCommand( NULL, conn, 0, resultReply, cmd, valist);
+    va_end(valist);
+    return result;
+}
+
+// A command on a given connection that must not run twice, as RENAME: if its
+// reply is lost with the connection, it fails rather than being resent
+static int kvs_CommandOnce( struct kvs_conn *conn, redisReply **resultReply, const char *cmd, ...)
+{
+    va_list valist;
+    int result;
+
+    va_start(valist, cmd);
+    result = kvs_vCommand( NULL, conn, 1, resultReply, cmd, valist);
+    va_end(valist);
+    return result;
+}
+
+// Stops the I/O threads and disconnects from redis. 
+void kvs_Cleanup( void)
+{
+    int j;
+
+    // An I/O thread retrying to reach redis gives up on its requests
+    __atomic_store_n( &kvsStopping, 1, __ATOMIC_RELAXED);
+    for ( j = 0; j < kvsIoRunning; j++) {
+        struct kvs_request stop = { .cmd = NULL };
+
+        kvs_Submit( &kvsConns[j], &stop);
+        pthread_join( kvsConns[j].thread, NULL);
+        kvsq_destroy( &kvsConns[j].queue);
+    }
+    kvsIoRunning = 0;
+    for ( j = 0; j < kvsConnCount; j++)
+        redisFree( kvsConns[j].ctx);
+}
+
+///////////////////////////////////////////////////////////
+//
+// Databases. With '-o redis_dbs', file names are "<db>/<key>"; otherwise
+// they are keys of database 0.
+//
+
+// The database a directory name stands for, NULL if none is mounted as it
+static struct kvs_db *kvs_DbNamed( const char *name, size_t len)
+{
+    char *end;
+    long n;
+    int j;
+
+    if ( len == 0 || len > 10 || ! isdigit( (unsigned char) name[0]))
+        return NULL;
+    n = strtol( name, &end, 10);
+    if ( (size_t) ( end - name) != len)
+        return NULL;
+    for ( j = 0; j < kvsDbCount; j++)
+        if ( kvsDbs[j].number == n)
+            return &kvsDbs[j];
+    return NULL;
+}
+
+// The database of a file, leaving in 'name' its key. The file system checks
+// names first, so an unknown database is only possible from other callers
+// and goes to the first one.
+static struct kvs_db *kvs_DbOf( const char **name)
+{
+    const char *slash;
+    struct kvs_db *db;
+
+    if ( ! kvsMultiDb || ( slash = strchr( *name, '/')) == NULL ||
+         ( db = kvs_DbNamed( *name, slash - *name)) == NULL)
+        return &kvsDbs[0];
+    *name = slash + 1;
+    return db;
+}
+
+// Whether multiple databases are mounted, as directories
+int kvs_MultiDb( void)
+{
+    return kvsMultiDb;
+}
+
+// Whether 'name' is the directory of a mounted database
+int kvs_IsDatabase( const char *name)
+{
+    return kvsMultiDb && kvs_DbNamed( name, strlen( name)) != NULL;
+}
+
+// Whether 'name' can be a file, "<db>/<key>" with no further directories
+int kvs_IsFileName( const char *name)
+{
+    const char *slash = strchr( name, '/');
+
+    if ( ! kvsMultiDb)
+        return 1;
+    return slash != NULL && slash[1] != '\0' && strchr( slash + 1, '/') == NULL &&
+           kvs_DbNamed( name, slash - name) != NULL;
+}
+
+// Lists the database directories, the root directory with multiple databases
+int kvs_ListDatabases( void *buf, fuse_fill_dir_t filler)
+{
+    char name[16];
+    int j;
+
+    for ( j = 0; j < kvsDbCount; j++) {
+        snprintf( name, sizeof(name), "%d", kvsDbs[j].number);
+        if ( filler( buf, name, NULL, 0) != 0)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+// .f4r/databases: connections and commands sent per database
+static void kvs_RenderDatabases( struct ctl_buf *out)
+{
+    uint64_t commands;
+    long queued;
+    int d, j;
+
+    ctl_printf( out, "# db conns commands queued\n");
+    for ( d = 0; d < kvsDbCount; d++) {
+        commands = 0;
+        queued = 0;
+        for ( j = kvsDbs[d].first; j < kvsDbs[d].first + kvsDbs[d].count; j++) {
+            commands += __atomic_load_n( &kvsConns[j].commands, __ATOMIC_RELAXED);
+            if ( j < kvsIoRunning)
+                queued += atomic_load_explicit( &kvsConns[j].queue.pending, memory_order_relaxed);
+        }
+        ctl_printf( out, "%d %d %llu %ld\n", kvsDbs[d].number, kvsDbs[d].count,
+                    (unsigned long long) commands, queued);
+    }
+}
+
+///////////////////////////////////////////////////////////
+//
+// Block checksums. With '-o checksums' every 4 KB block of a file has a
+// CRC-32C in a sidecar key "<key>/crc32c", four bytes per block, little
+// endian. File names have no slash, so it cannot clash with a file, and
+// listings skip it. Lua scripts change a file and its checksums together,
+// and read them together, so a reader never sees one without the other.
+// Files without a sidecar key, as created by other clients or by mounts
+// without checksums, are read unchecked.
+//
+#define KVS_CRC_BLOCK 4096
+#define KVS_CRC_SUFFIX "/crc32c"
+#define KVS_CRC_KEY_MAX 1024
+
+// Commands name the scripts by their SHA1, so that redis gets the source
+// only once, from kvs_LoadScripts(), instead of with every read and write
+struct kvs_script {
+    const char *source;
+    char sha[41];
+};
+
+// The data of whole blocks from 'first' to 'last' (inclusive, clipped at the
+// end of the file), whether there are checksums and theirs
+static struct kvs_script kvsCrcRead = {
+    "return {redis.call('GETRANGE', KEYS[1], ARGV[1], ARGV[2]),"
+    " redis.call('EXISTS', KEYS[2]),"
+    " redis.call('GETRANGE', KEYS[2], ARGV[3], ARGV[4])}"
+};
+
+// What a write of ARGV[1] to ARGV[2] leaves of the blocks it touches: the
+// length of the file, whether it has checksums, the first block that changes
+// (an earlier one if the write leaves a gap of zeros) and the contents of that
+// up to the write and of the last one after it
+static struct kvs_script kvsCrcFetch = {
+    "local n = redis.call('STRLEN', KEYS[1])\n"
+    "local off, e, b = tonumber(ARGV[1]), tonumber(ARGV[2]), tonumber(ARGV[3])\n"
+    "local start = math.floor(math.min(off, n) / b) * b\n"
+    "local head, tail = '', ''\n"
+    "if start < off then head = redis.call('GETRANGE', KEYS[1], start, off - 1) end\n"
+    "if e < n and e % b ~= 0 then tail = redis.call('GETRANGE', KEYS[1], e, math.ceil(e / b) * b - 1) end\n"
+    "return {n, redis.call('EXISTS', KEYS[2]), start, head, tail}"
+};
+
+// SETRANGE of the data and of its checksums, unless the file's length is
+// not within ARGV[5] and ARGV[6] (-1 for no limit), which the checksums
+// assumed. Then -1.
+static struct kvs_script kvsCrcWrite = {
+    "if redis.call('EXISTS', KEYS[2]) == 1 then\n"
+    "  local n = redis.call('STRLEN', KEYS[1])\n"
+    "  if n < tonumber(ARGV[5]) or (tonumber(ARGV[6]) >= 0 and n > tonumber(ARGV[6])) then return -1 end\n"
+    "  redis.call('SETRANGE', KEYS[2], ARGV[3], ARGV[4])\n"
+    "end\n"
+    "return redis.call('SETRANGE', KEYS[1], ARGV[1], ARGV[2])"
+};
+
+// RENAME of a file and of its checksums, dropping those of the file it replaces
+static struct kvs_script kvsCrcRename = {
+    "redis.call('RENAME', KEYS[1], KEYS[2])\n"
+    "if redis.call('EXISTS', KEYS[3]) == 1 then redis.call('RENAME', KEYS[3], KEYS[4])\n"
+    "else redis.call('UNLINK', KEYS[4]) end\n"
+    "return 1"
+};
+
+static struct kvs_script *kvsCrcScripts[] = {
+    &kvsCrcRead, &kvsCrcFetch, &kvsCrcWrite, &kvsCrcRename
+};
+
+// Has redis cache the scripts and notes their SHA1. Only for kvs_init(),
+// before the I/O threads own the connection.
+static int kvs_LoadScripts( redisContext *ctx)
+{
+    redisReply *reply;
+    size_t j;
+
+    for ( j = 0; j < sizeof(kvsCrcScripts) / sizeof(kvsCrcScripts[0]); j++) {
+        reply = redisCommand( ctx, "SCRIPT LOAD %s", kvsCrcScripts[j]->source);
+        if ( reply == NULL || reply->type != REDIS_REPLY_STRING ||
+             reply->len != sizeof(kvsCrcScripts[j]->sha) - 1) {
+            printf( "Cannot load checksum scripts: %s\n", reply == NULL ? ctx->errstr :
+                    reply->type == REDIS_REPLY_ERROR ? reply->str : "unexpected reply");
+            if ( reply != NULL)
+                freeReplyObject( reply);
+            return -EIO;
+        }
+        memcpy( kvsCrcScripts[j]->sha, reply->str, reply->len + 1);
+        freeReplyObject( reply);
+    }
+    return 0;
+}
+
+// Runs a script with EVALSHA. 'args' formats its number of keys, keys and
+// arguments. Redis forgets scripts when it restarts, and a replica promoted
+// in a failover may never have had them, so on NOSCRIPT it loads the script
+// again on this connection and retries.
+static int kvs_Eval( struct kvs_conn *conn, int once, redisReply **resultReply,
+                     struct kvs_script *script, const char *args, ...)
+{
+    char cmd[128];
+    redisReply *reply;
+    va_list valist;
+    int result, loaded = 0;
+
+    snprintf( cmd, sizeof(cmd), "EVALSHA %s %s", script->sha, args);
+    for ( ;;) {
+        va_start(valist, args);
+        result = kvs_vCommand( NULL, conn, once, resultReply, cmd, valist);
+        va_end(valist);
+        if ( result != -ENOEXEC || loaded)
+            return result == -ENOEXEC ? -EIO : result;
+        log_info( "kvs_Eval: redis lost script %s, loading it again\n", script->sha);
+        if ( ( result = kvs_CommandOn( conn, &reply, "SCRIPT LOAD %s", script->source)) < 0)
+            return result;
+        freeReplyObject( reply);
+        loaded = 1;
+    }
+}
+
+// The sidecar key of a file's key
+static int kvs_CrcKey( const char *key, char *crcKey)
+{
+    if ( snprintf( crcKey, KVS_CRC_KEY_MAX, "%s" KVS_CRC_SUFFIX, key) >= KVS_CRC_KEY_MAX)
+        return -ENAMETOOLONG;
+    return 0;
+}
+
+static int kvs_IsCrcKey( const char *key)
+{
+    size_t len = strlen( key), suffix = strlen( KVS_CRC_SUFFIX);
+
+    return len > suffix && strcmp( key + len - suffix, KVS_CRC_SUFFIX) == 0;
+}
+
+static pthread_mutex_t *kvs_CrcLock( const char *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for ( ; *key != '\0'; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211ULL;
+    }
+    return &kvsCrcLocks[hash % KVS_CRC_LOCKS];
+}
+
+static void kvs_PutCrc( unsigned char *p, uint32_t crc)
+{
+    p[0] = crc;
+    p[1] = crc >> 8;
+    p[2] = crc >> 16;
+    p[3] = crc >> 24;
+}
+
+static uint32_t kvs_GetCrc( const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// Checksums of the blocks from 'start' to 'last', once 'size' bytes of 'buf'
+// are written at 'offset'. Both are where a block begins or 'last' is where
+// the file ends. 'head' is what the file had from 'start' on before the write,
+// zeros where it ends early, and 'tail' what it has after the write.
+static void kvs_CrcBlocks( unsigned char *out, off_t start, off_t last,
+                           const char *head, size_t headLen, const char *buf, size_t size,
+                           off_t offset, const char *tail, size_t tailLen)
+{
+    static const char zeros[KVS_CRC_BLOCK];
+    off_t block, pos, blockEnd, end = offset + size;
+    size_t n, have;
+    uint32_t crc;
+
+    for ( block = start; block < last; block = blockEnd, out += 4) {
+        blockEnd = block + KVS_CRC_BLOCK < last ? block + KVS_CRC_BLOCK : last;
+        crc = 0;
+        pos = block;
+        if ( pos < offset) {
+            n = ( blockEnd < offset ? blockEnd : offset) - pos;
+            have = (size_t) ( pos - start) < headLen ? headLen - ( pos - start) : 0;
+            have = have < n ? have : n;
+            crc = crc32c( crc, head + ( pos - start), have);
+            crc = crc32c( crc, zeros, n - have);
+            pos += n;
+        }
+        if ( pos < end && pos < blockEnd) {
+            n = ( blockEnd < end ? blockEnd : end) - pos;
+            crc = crc32c( crc, buf + ( pos - offset), n);
+            pos += n;
+        }
+        if ( pos < blockEnd) {
+            n = blockEnd - pos;
+            have = (size_t) ( pos - end) < tailLen ? tailLen - ( pos - end) : 0;
+            have = have < n ? have : n;
+            crc = crc32c( crc, tail + ( pos - end), have);
+            crc = crc32c( crc, zeros, n - have);
+        }
+        kvs_PutCrc( out, crc);
+    }
+}
+
+// Writes 'size' bytes at 'offset' along with the checksums of the blocks from
+// 'start' to 'last', computed here. Returns 1 if the file's length was not
+// between 'minLen' and 'maxLen' as they assumed.
+static int kvs_CrcSetRange( struct kvs_conn *conn, const char *key, const char *crcKey,
+                            const char *buf, size_t size, off_t offset,
+                            off_t start, off_t last, const char *head, size_t headLen,
+                            const char *tail, size_t tailLen, long long minLen, long long maxLen)
+{
+    size_t count = ( last - start + KVS_CRC_BLOCK - 1) / KVS_CRC_BLOCK;
+    unsigned char *crcs = malloc( count * 4 + 1);
+    redisReply *reply;
+    int result;
+
+    if ( crcs == NULL)
+        return -ENOMEM;
+    kvs_CrcBlocks( crcs, start, last, head, headLen, buf, size, offset, tail, tailLen);
+    result = kvs_Eval( conn, 0, &reply, &kvsCrcWrite, "2 %s %s %lld %b %lld %b %lld %lld",
+                       key, crcKey, (long long) offset, buf, size,
+                       (long long) ( start / KVS_CRC_BLOCK * 4), crcs, count * 4,
+                       minLen, maxLen);
+    free( crcs);
+    if ( result < 0)
+        return result;
+    if ( reply->type != REDIS_REPLY_INTEGER) {
+        log_err( "kvs_WritePartialValue: ERROR - Unexpected result from redis type=%d\n",
+                 reply->type);
+        freeReplyObject( reply);
+        return -EPROTO;
+    }
+    result = reply->integer < 0 ? 1 : 0;
+    freeReplyObject( reply);
+    return result;
+}
+
+// A write that keeps the checksums right. One that starts a block and ends
+// one, or the file, needs nothing else; any other first reads what it leaves
+// of the blocks it touches, in the same round trip as the file's length.
+static int kvs_WriteChecked( struct kvs_db *db, const char *key, const char *buf,
+                             size_t size, off_t offset)
+{
+    struct kvs_conn *conn = kvs_ConnForKey( db, key, strlen( key));
+    pthread_mutex_t *lock = kvs_CrcLock( key);
+    char crcKey[KVS_CRC_KEY_MAX];
+    redisReply *reply;
+    off_t end = offset + size, start, last;
+    int result;
+
+    if ( ( result = kvs_CrcKey( key, crcKey)) < 0)
+        return result;
+    pthread_mutex_lock( lock);
+    result = 1;
+    if ( offset % KVS_CRC_BLOCK == 0)
+        result = kvs_CrcSetRange( conn, key, crcKey, buf, size, offset, offset, end,
+                                  NULL, 0, NULL, 0, offset, end % KVS_CRC_BLOCK == 0 ? -1 : end);
+    if ( result == 1) {
+        result = kvs_Eval( conn, 0, &reply, &kvsCrcFetch, "2 %s %s %lld %lld %d",
+                           key, crcKey, (long long) offset, (long long) end, KVS_CRC_BLOCK);
+        if ( result >= 0) {
+            if ( reply->type != REDIS_REPLY_ARRAY || reply->elements != 5 ||
+                 reply->element[0]->type != REDIS_REPLY_INTEGER ||
+                 reply->element[1]->type != REDIS_REPLY_INTEGER ||
+                 reply->element[2]->type != REDIS_REPLY_INTEGER ||
+                 reply->element[3]->type != REDIS_REPLY_STRING ||
+                 reply->element[4]->type != REDIS_REPLY_STRING) {
+                log_err( "kvs_WritePartialValue: ERROR - Unexpected result from redis type=%d\n",
+                         reply->type);
+                result = -EPROTO;
+            } else {
+                // Up to the end of the write's last block, or of the file
+                last = ( end + KVS_CRC_BLOCK - 1) / KVS_CRC_BLOCK * KVS_CRC_BLOCK;
+                if ( last > reply->element[0]->integer)
+                    last = reply->element[0]->integer > end ? reply->element[0]->integer : end;
+                start = reply->element[2]->integer;
+                if ( reply->element[1]->integer == 0)     // Unchecked, no checksums to compute
+                    start = last;
+                result = kvs_CrcSetRange( conn, key, crcKey, buf, size, offset, start, last,
+                                          reply->element[3]->str, reply->element[3]->len,
+                                          reply->element[4]->str, reply->element[4]->len, 0, -1);
+            }
+            freeReplyObject( reply);
+        }
+    }
+    pthread_mutex_unlock( lock);
+    return result;
+}
+
+// Replaces a file and all its checksums, which also gives a file created
+// unchecked some
+static int kvs_SetChecked( struct kvs_db *db, const char *key, const char *value, size_t size)
+{
+    size_t count = ( size + KVS_CRC_BLOCK - 1) / KVS_CRC_BLOCK;
+    char crcKey[KVS_CRC_KEY_MAX];
+    unsigned char *crcs;
+    redisReply *reply;
+    int result;
+
+    if ( ( result = kvs_CrcKey( key, crcKey)) < 0)
+        return result;
+    if ( ( crcs = malloc( count * 4 + 1)) == NULL)
+        return -ENOMEM;
+    kvs_CrcBlocks( crcs, 0, size, NULL, 0, value, size, 0, NULL, 0);
+    result = kvs_Command( db, &reply, "MSET %s %b %s %b", key, value, size, crcKey, crcs, count * 4);
+    free( crcs);
+    if ( result >= 0)
+        freeReplyObject( reply);
+    return result;
+}
+
+// Reads whole blocks around the range asked for and checks them against their
+// checksums before copying the range out
+static int kvs_ReadChecked( struct kvs_db *db, const char *key, char *buf, size_t size,
+                            off_t offset)
+{
+    off_t first = offset / KVS_CRC_BLOCK * KVS_CRC_BLOCK,
+          last = ( offset + size + KVS_CRC_BLOCK - 1) / KVS_CRC_BLOCK * KVS_CRC_BLOCK;
+    char crcKey[KVS_CRC_KEY_MAX];
+    redisReply *reply, *data, *crcs;
+    size_t pos, n, skip = offset - first;
+    int length, result;
+
+    if ( ( result = kvs_CrcKey( key, crcKey)) < 0)
+        return result;
+    result = kvs_Eval( kvs_ConnForKey( db, key, strlen( key)), 0, &reply, &kvsCrcRead,
+                       "2 %s %s %lld %lld %lld %lld", key, crcKey,
+                       (long long) first, (long long) last - 1,
+                       (long long) ( first / KVS_CRC_BLOCK * 4),
+                       (long long) ( last / KVS_CRC_BLOCK * 4 - 1));
+    if ( result < 0)
+        return result;
+    if ( reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 ||
+         reply->element[0]->type != REDIS_REPLY_STRING ||
+         reply->element[1]->type != REDIS_REPLY_INTEGER ||
+         reply->element[2]->type != REDIS_REPLY_STRING) {
+        log_err( "kvs_ReadPartialValue: ERROR - Unexpected result from redis type=%d\n",
+                 reply->type);
+        freeReplyObject( reply);
+        return -EPROTO;
+    }
+    data = reply->element[0];
+    crcs = reply->element[2];
+    for ( pos = 0; reply->element[1]->integer == 1 && pos < data->len; pos += n) {
+        n = data->len - pos < KVS_CRC_BLOCK ? data->len - pos : KVS_CRC_BLOCK;
+        if ( pos / KVS_CRC_BLOCK * 4 + 4 > crcs->len ||
+             kvs_GetCrc( (unsigned char *) crcs->str + pos / KVS_CRC_BLOCK * 4) !=
+             crc32c( 0, data->str + pos, n)) {
+            log_err( "kvs_ReadPartialValue: ERROR - checksum mismatch in %s at offset %lld\n",
+                     key, (long long) ( first + pos));
+            stats_checksum_error();
+            freeReplyObject( reply);
+            return -EIO;
+        }
+    }
+    length = data->len > skip ? ( data->len - skip < size ? data->len - skip : size) : 0;
+    memcpy( buf, data->str + skip, length);
+    freeReplyObject( reply);
+    return length;
+}
+
+// Creates an empty redis key to represent an empty file
+int kvs_CreateEmptyKey( const char *name)
+{
+    struct kvs_db *db = kvs_DbOf( &name);
+    uint64_t epoch = kvs_SyncEpoch( db, name);
+    char crcKey[KVS_CRC_KEY_MAX];
+    redisReply *reply;
+    int result;
+    
+    if ( kvsChecksums) {    // With no checksums yet, as it has no blocks
+        if ( ( result = kvs_CrcKey( name, crcKey)) < 0)
+            return result;
+        result = kvs_Command( db, &reply, "MSET %s %s %s %s", name, "", crcKey, "");
+    } else
+        result = kvs_Command( db, &reply, "SET %s %s", name, "");
+
+    if (result >= 0) {
+        freeReplyObject(reply);
+        kvs_SyncWritten( db, name, epoch);
+    }
+    return result;
+}
+
+
+// Checks if a key (representing a file) already exists
+int kvs_KeyExists( const char *name)
+{
+    struct kvs_db *db = kvs_DbOf( &name);
+    redisReply *reply;
+    int exists, result;
+
+    result = kvs_Command( db, &reply, "EXISTS %s", name);
+    if (result < 0)
+        return result;
+    if (reply->type != REDIS_REPLY_INTEGER) {
+        log_err( "kvs_KeyExists: ERROR - Unexpected response from redis type=%d\n", 
+                 reply->type);
+        freeReplyObject(reply);
+        return -EPROTO;
+    }
+    exists = (int) reply->integer; // 1 if exists, 0 otherwise
+    freeReplyObject(reply);
+    
+    return exists;  
+}
+
+// Queues an UNLINK of 'name' on a connection without waiting for it
+static int kvs_DeleteKeyAsync( struct kvs_conn *conn, const char *name)
+{
+    struct kvs_request *req = calloc( 1, sizeof(struct kvs_request));
+    int len;
+
+    if ( req == NULL || ( req->key = strdup( name)) == NULL ||
+         ( len = redisFormatCommand( &req->cmd, "UNLINK %s", name)) < 0) {
+        if ( req != NULL)
+            free( req->key);
+        free( req);
+        return -ENOMEM;
+    }
+    req->len = len;
+    req->detached = 1;
+    req->merged = 1;
+    F4R_PROBE2(kvs__cmd__entry, stats_cmd_names[CMD_UNLINK], req->len);
+    cmdlog_check( CMD_UNLINK);
+    req->submitted = hist_now();
+    kvsq_push( &conn->queue, &req->node);
+    return 0;
+}
+
+// UNLINK frees the value in a background thread of redis, where DEL would
+// stall every client while a large one is freed. With async unlink, the key
+// is only queued for deletion: the kernel looked the file up before, so it
+// existed. Later commands on the key go to the same connection and run after
+// it, and so does a rename onto it, see kvs_RenameKey(). Its I/O thread
+// merges queued deletions into multi-key UNLINKs.
+int kvs_DeleteKey( const char *name)
+{
+    struct kvs_db *db = kvs_DbOf( &name);
+    struct kvs_conn *conn;
+    char crcKey[KVS_CRC_KEY_MAX];
+    redisReply *reply;
+    int result;
+
+    if ( kvsChecksums && ( result = kvs_CrcKey( name, crcKey)) < 0)
+        return result;
+    conn = kvs_ConnForKey( db, name, strlen( name));
+    if ( kvsAsyncUnlink) {
+        result = kvs_DeleteKeyAsync( conn, name);
+        if ( result == 0 && kvsChecksums)
+            result = kvs_DeleteKeyAsync( conn, crcKey);
+        return result;
+    }
+
+    result = kvs_CommandOnce( conn, &reply, "UNLINK %s", name);
+    if ( result < 0 )
+        return result;
+    if (reply->type != REDIS_REPLY_INTEGER) {
+        log_err( "kvs_DeleteKey: ERROR - Unexpected result from redis type=%d\n", reply->type);
+        freeReplyObject(reply);
+        return -EPROTO;
+    }
+    
+    result = reply->integer == 0 ? -ENOENT : 0;  // 1 if key existed, 0 otherwise
+    freeReplyObject(reply);
+
+    // Only the file itself tells whether it existed. Its checksums, or ones
+    // left without a file, go with whatever is sent next on the connection.
+    if ( kvsChecksums) {
+        int queued = kvs_DeleteKeyAsync( conn, crcKey);
+
+        if ( result == 0)
+            result = queued;
+    }
+    return result;
+}
+
+// Rename key in KVS
+int kvs_RenameKey( const char *name, const char *newname)
+{
+    struct kvs_db *db = kvs_DbOf( &name);
+    struct kvs_conn *conn;
+    uint64_t epoch;
+    redisReply *reply;
+    int result;
+
+    // Keys cannot move between databases under a new name in one command, so
+    // like between file systems, mv has to copy
+    if ( kvs_DbOf( &newname) != db)
+        return -EXDEV;
+    epoch = kvs_SyncEpoch( db, newname);
+    // Some KVS will blindly replace existing keys, wich is the expected FS behaviour
+    // Redis does blindly replace! It goes to the connection of the new name,
+    // after any deletion of it still queued there, which would otherwise
+    // delete the renamed file. Everything sent on the old name's connection
+    // was acknowledged already, as the kernel looked it up.
+    conn = kvs_ConnForKey( db, newname, strlen( newname));
+    if ( kvsChecksums) {
+        char crcKey[KVS_CRC_KEY_MAX], newCrcKey[KVS_CRC_KEY_MAX];
+
+        if ( ( result = kvs_CrcKey( name, crcKey)) < 0 ||
+             ( result = kvs_CrcKey( newname, newCrcKey)) < 0)
+            return result;
+        result = kvs_Eval( conn, 1, &reply, &kvsCrcRename, "4 %s %s %s %s",
+                           name, newname, crcKey, newCrcKey);
+    } else
+        result = kvs_CommandOnce( conn, &reply, "RENAME %s %s", name, newname);
+    if ( result < 0)
+        return result; 
+
+    freeReplyObject(reply);
+    kvs_SyncWritten( db, newname, epoch);
+    
+    return 0;
+}
+
+
+// Get length of a key (known to exist, if not redis returns len=0)
+size_t kvs_GetKeyLength( const char *name)
+{
+    struct kvs_db *db;
+    redisReply *reply;
+    size_t ksize;
+    int result;
+    
+    // Redis returns length 0 for nonexisting keys, so explicitly check
+    result = kvs_KeyExists( name);
+    if ( result < 0)    // redis error
+        return result;
+    if ( result == 0)
+        return -ENOENT;
+        
+    db = kvs_DbOf( &name);
+    result = kvs_Command( db, &reply, "STRLEN %s", name);
+    if ( result < 0)    // redis error
+        return result;
+    if (reply->type != REDIS_REPLY_INTEGER) {
+        log_err( "kvs_GetKeyLength: ERROR - Unexpected result from redis type=%d\n", 
+                 reply->type);
+        freeReplyObject(reply);
+        return -EPROTO;
+    }
+    ksize = (size_t)reply->integer;
+    freeReplyObject(reply);
+    return ksize;
+}
+
+// Extends the value of an existing key (must exist) using null characters.
+// Caller must ensure newsize is larger than current size 
+int kvs_AppendZeroedBytes( const char *name, size_t newsize)
+{
+    struct kvs_db *db = kvs_DbOf( &name);
+    uint64_t epoch = kvs_SyncEpoch( db, name);
+    redisReply *reply;
+    char zbuffer[1] = {0};
+    int result;
+    
+    // Extending a key's value is really a corner case. Take advantage that redis does it
+    // automatically when we set bytes beyond current size
+    if ( kvsChecksums) {
+        result = kvs_WriteChecked( db, name, zbuffer, 1, newsize - 1);
+        if ( result < 0)
+            return result;
+        kvs_SyncWritten( db, name, epoch);
+        return 0;
+    }
+    result = kvs_Command( db, &reply, "SETRANGE %s %ld %b", name, newsize - 1, zbuffer, 1);
+    if ( result < 0)    // redis error
+        return result;
+
+    if (reply->type != REDIS_REPLY_INTEGER) {
+        log_err( "kvs_AppendZeroedBytes: ERROR - Unexpected result from redis type=%d\n",
+                 reply->type);
+        freeReplyObject(reply);
+        return -EPROTO;
+    }
+    freeReplyObject(reply);
+    kvs_SyncWritten( db, name, epoch);
+
+    return 0;
+}
+
+// Truncates the value of an existing key discarding the trailing content
+static int kvs_Truncate( struct kvs_db *db, const char *name, size_t newsize)
+{
+    redisReply *reply1 = NULL,
+               *reply2;
+    int result;
+
+    if ( newsize > 0 ) {    // Need to preserve beginning of value 
+        result = kvs_Command( db, &reply1,"GETRANGE %s %ld %ld", name, (size_t)0, newsize);
+        if ( result < 0)
+            return result;
+        if (reply1->type != REDIS_REPLY_STRING) {
+            log_err( "kvs_TruncateKey: ERROR - Unexpected result from redis type=%d\n", 
+                     reply1->type);
+            freeReplyObject(reply1);
+            return -EPROTO;
+        }
+    }
+    if ( kvsChecksums)
+        result = kvs_SetChecked( db, name, newsize > 0 ? reply1->str : "", newsize);
+    else if ( ( result = kvs_Command( db, &reply2, "SET %s %b", name,
+                                      newsize > 0 ? reply1->str : "", newsize)) >= 0)
+        freeReplyObject(reply2);
+    if ( reply1 != NULL)
+        freeReplyObject(reply1);
+    return result;
+}
+
+int kvs_TruncateKey( const char *name, size_t newsize)
+{
+    struct kvs_db *db = kvs_DbOf( &name);
+    uint64_t epoch = kvs_SyncEpoch( db, name);
+    pthread_mutex_t *lock;
+    int result;
+
+    if ( ! kvsChecksums)
+        result = kvs_Truncate( db, name, newsize);
+    else {
+        lock = kvs_CrcLock( name);
+        pthread_mutex_lock( lock);
+        result = kvs_Truncate( db, name, newsize);
+        pthread_mutex_unlock( lock);
+    }
+    if ( result >= 0)
+        kvs_SyncWritten( db, name, epoch);
+    return result;
+}
+
+    
+// This will copy the root directory file list into the FUSE buffer using the FUSE 
+// 'filler' function.
+//
+// TODO: Passing the FUSE filler function to this KVS abstraction layer decouples  
+//       the FUSE code from redis, but not vice versa. Ideally this abstraction layer 
+//       would simply return a list of strings (entries), and the calling code would 
+//       transfer them to FUSE. However this incurs a penalty allocating space for a 
+//       variable size list and deallocating it soon after. The implementation below
+//       represents an acceptable compromise, given the purpose of this program.
+//
+// 'dir' is the directory of a database with multiple databases mounted, NULL
+// for the root otherwise. Listing one database does not touch the others.
+//
+// TODO: Fuse4redis creates only string values. However if keys with other value types 
+//       (e.g. integer) are created using redis-cli, these keys will result in errors 
+//       when accessed.
+//
+int kvs_ReadDirectory( const char *dir, void *buf, fuse_fill_dir_t filler)
+{
+    struct kvs_db *db = dir != NULL ? kvs_DbNamed( dir, strlen( dir)) : &kvsDbs[0];
+    redisReply *reply;
+    int result;
+      
+    if ( db == NULL)
+        return -ENOENT;
+    result = kvs_Command( db, &reply, "KEYS *");
+    if ( result < 0)
+        return result;
+        
+   // The loop below exits when either all keys were copied, or filler()
+   // returns something non-zero.  The first case just means I've
+   // read the whole 'redis' directory; the second means the buffer is full.
+    if (reply->type == REDIS_REPLY_ARRAY) {
+        int j;
+        for ( j = 0; j < reply->elements; j++) {
+            if ( kvs_IsCrcKey( reply->element[j]->str))
+                continue;
+            if (filler(buf, reply->element[j]->str, NULL, 0) != 0) {
+	            log_err("kvs_ReadDirectory: ERROR - filler returned buffer full\n");
+                freeReplyObject(reply);
+	            return -ENOMEM;
+	        }
+        }
+    } else {  // Only array is an acceptable result
+        log_err( "kvs_ReadDirectory: ERROR - query did not return a list, returned type=%d\n",
+                 reply->type);
+        return -EPROTO;
+    }
+    freeReplyObject(reply);
+    return 0;
+}
+
+// Reads the partial contents of a key starting at offset
+int kvs_ReadPartialValue(const char *keyname, char *buf, size_t size, off_t offset)
+{
+    struct kvs_db *db = kvs_DbOf( &keyname);
+    redisReply *reply;
+    int length, result;
+  
+    if ( kvsChecksums)
+        return kvs_ReadChecked( db, keyname, buf, size, offset);
+    // Redis has command to get substrings, which is handy!
+    result = kvs_Command( db, &reply,"GETRANGE %s %ld %ld", keyname,
+                         offset, offset + size - 1);  // Assuming size will never be 0
+    if ( result < 0)
+        return result;
+    if (reply->type != REDIS_REPLY_STRING) {
+        log_err( "kvs_ReadPartialValue: ERROR - Unexpected result from redis type=%d\n", 
+                 reply->type);
+        freeReplyObject(reply);
+        return -EPROTO;
+    }
+    
+    length = reply->len;
+    memcpy( buf, reply->str, length);
+    freeReplyObject(reply);
+  
+    return length;
+}
+
+// Writes/overwrites the partial contents of a key starting at offset
+int kvs_WritePartialValue(const char *keyname, const char *buf, size_t size, off_t offset)
+{
+    struct kvs_db *db = kvs_DbOf( &keyname);
+    uint64_t epoch = kvs_SyncEpoch( db, keyname);
+    redisReply *reply;
+    int result;
+  
+    // Redis has a command to write partial values of keys, which is handy!
+    // Impressively, redis handles writes beyond the current length as expected, 
+    // including filling with zeroes when offset is beyond current length. In a nutshell,
+    // it already implements the same semantics a the write call in Linux. Nice!!!
+    // But beware, different from write, redis returns the resulting total length of 
+    // the new key.
+    if ( kvsChecksums) {
+        result = kvs_WriteChecked( db, keyname, buf, size, offset);
+        if ( result < 0)
+            return result;
+        kvs_SyncWritten( db, keyname, epoch);
+        return size;
+    }
+    result = kvs_Command( db, &reply,"SETRANGE %s %ld %b", keyname,
+                         offset, buf, size);
+    if ( result < 0)
+        return result;
+
+    if (reply->type != REDIS_REPLY_INTEGER) {
+        log_err( "kvs_WritePartialValue: ERROR - Unexpected result from redis type=%d\n", 
+                 reply->type);
+        freeReplyObject(reply);
+        return -EPROTO;
+    }
+    freeReplyObject(reply);
+    kvs_SyncWritten( db, keyname, epoch);
+    
+    return size; // Success: return number of bytes in buf actually written.
+}
+
+///////////////////////////////////////////////////////////
+//
+// Durability of fsync(). Redis acknowledges a write once it is in memory;
+// WAIT also waits for replicas to have it, WAITAOF for the append only file
+// to be fsynced locally and/or on replicas. Either covers every earlier
+// write of the same connection, which is the one of the file's key.
+//
+enum kvs_sync_mode { KVS_SYNC_NONE, KVS_SYNC_WAIT, KVS_SYNC_WAITAOF };
+
+static enum kvs_sync_mode kvsSyncMode = KVS_SYNC_NONE;
+static int kvsSyncLocal, kvsSyncReplicas;
+static long kvsSyncTimeout = 1000;      // Milliseconds, 0 would wait forever
+static unsigned kvsSyncWindow;          // Microseconds a leader waits for company
+
+// Parses the fsync mount option: "none", "wait:<replicas>[:<timeout_ms>]" or
+// "waitaof:<local>:<replicas>[:<timeout_ms>]", where local is 0 or 1.
+// 'window_us' is how long a group commit waits for more fsync() calls.
+int kvs_SetSyncMode( const char *spec, unsigned window_us)
+{
+    enum kvs_sync_mode mode;
+    int local = 0, replicas = 0;
+    long timeout = 1000;
+
+    if ( strcmp( spec, "none") == 0)
+        mode = KVS_SYNC_NONE;
+    else if ( sscanf( spec, "wait:%d:%ld", &replicas, &timeout) >= 1 && replicas >= 0)
+        mode = KVS_SYNC_WAIT;
+    else if ( sscanf( spec, "waitaof:%d:%d:%ld", &local, &replicas, &timeout) >= 2 &&
+              ( local == 0 || local == 1) && replicas >= 0 && local + replicas > 0)
+        mode = KVS_SYNC_WAITAOF;
+    else
+        return -EINVAL;
+    if ( timeout <= 0)
+        return -EINVAL;
+    kvsSyncMode = mode;
+    kvsSyncLocal = local;
+    kvsSyncReplicas = replicas;
+    kvsSyncTimeout = timeout;
+    kvsSyncWindow = window_us;
+    return 0;
+}
+
+static int kvs_SyncConn( struct kvs_conn *conn)
+{
+    redisReply *reply;
+    int result, durable;
+
+    if ( kvsSyncMode == KVS_SYNC_WAIT)
+        result = kvs_CommandOn( conn, &reply, "WAIT %d %ld", kvsSyncReplicas, kvsSyncTimeout);
+    else
+        result = kvs_CommandOn( conn, &reply, "WAITAOF %d %d %ld", kvsSyncLocal,
+                                kvsSyncReplicas, kvsSyncTimeout);
+    if ( result < 0)
+        return result;
+
+    // WAIT answers how many replicas have the writes, WAITAOF how many local
+    // and replica fsyncs there were. Fewer than asked means it timed out.
+    if ( reply->type == REDIS_REPLY_INTEGER)
+        durable = reply->integer >= kvsSyncReplicas;
+    else if ( reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+              reply->element[0]->type == REDIS_REPLY_INTEGER &&
+              reply->element[1]->type == REDIS_REPLY_INTEGER)
+        durable = reply->element[0]->integer >= kvsSyncLocal &&
+                  reply->element[1]->integer >= kvsSyncReplicas;
+    else {
+        log_err( "kvs_Sync: ERROR - Unexpected result from redis type=%d\n", reply->type);
+        freeReplyObject( reply);
+        return -EPROTO;
+    }
+    freeReplyObject( reply);
+    if ( ! durable) {
+        log_warn( "kvs_Sync: writes not durable after %ld ms\n", kvsSyncTimeout);
+        return -EIO;
+    }
+    return 0;
+}
+
+// A barrier only covers writes made on the connection it goes through, so
+// writes acknowledged on one that was lost since, and not covered yet, are
+// not known to be durable: redis may have lost them too. fsync() of those
+// files fails with EIO, once, like the kernel reports a failed writeback.
+// Writes are counted as redis acknowledges them, and the epoch tells those
+// that may have been acknowledged before a reconnection.
+static void kvs_SyncLost( struct kvs_conn *conn)
+{
+    if ( kvsSyncMode == KVS_SYNC_NONE)
+        return;
+    pthread_mutex_lock( &conn->sync.lock);
+    __atomic_add_fetch( &conn->sync.epoch, 1, __ATOMIC_RELEASE);
+    if ( conn->sync.written > conn->sync.durable) {
+        log_warn( "kvs_Sync: %llu writes on connection %d may not be durable\n",
+                  (unsigned long long) ( conn->sync.written - conn->sync.durable),
+                  conn->index);
+        if ( conn->sync.lostTo == 0 || conn->sync.durable < conn->sync.lostFrom)
+            conn->sync.lostFrom = conn->sync.durable;
+        conn->sync.lostTo = conn->sync.written;
+        conn->sync.lostAll = 1;
+    }
+    pthread_mutex_unlock( &conn->sync.lock);
+}
+
+static struct kvs_conn *kvs_SyncFile( struct kvs_db *db, const char *name, int *file)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const char *p;
+
+    for ( p = name; *p != '\0'; p++) {
+        hash ^= (unsigned char) *p;
+        hash *= 1099511628211ULL;
+    }
+    *file = hash % KVS_SYNC_FILES;
+    return kvs_ConnForKey( db, name, p - name);
+}
+
+// Taken before a write to a file is sent, and passed to kvs_SyncWritten()
+// once redis acknowledged it
+static uint64_t kvs_SyncEpoch( struct kvs_db *db, const char *name)
+{
+    if ( kvsSyncMode == KVS_SYNC_NONE)
+        return 0;
+    return __atomic_load_n( &kvs_ConnForKey( db, name, strlen( name))->sync.epoch,
+                            __ATOMIC_ACQUIRE);
+}
+
+static void kvs_SyncWritten( struct kvs_db *db, const char *name, uint64_t epoch)
+{
+    struct kvs_conn *conn;
+    uint64_t write;
+    int file;
+
+    if ( kvsSyncMode == KVS_SYNC_NONE)
+        return;
+    conn = kvs_SyncFile( db, name, &file);
+    pthread_mutex_lock( &conn->sync.lock);
+    write = ++conn->sync.written;
+    if ( conn->sync.epoch != epoch) {   // May have been on the lost connection
+        if ( conn->sync.lostTo == 0 || write - 1 < conn->sync.lostFrom)
+            conn->sync.lostFrom = write - 1;
+        conn->sync.lostTo = write;
+        conn->sync.lostAll = 1;
+    }
+    if ( conn->sync.files[file].first == 0)
+        conn->sync.files[file].first = write;
+    conn->sync.files[file].last = write;
+    pthread_mutex_unlock( &conn->sync.lock);
+}
+
+// Group commit: one barrier covers every write acknowledged before it was
+// issued, so concurrent fsync() calls on a connection share one. The first
+// caller to find no barrier running leads: it waits up to kvsSyncWindow for
+// others to arrive, then issues the barrier. Callers arriving while one is
+// running need the next one, since the running one may miss their writes,
+// and wait for it. Whoever wakes first after a barrier leads the next.
+static int kvs_SyncGroup( struct kvs_conn *conn)
+{
+    uint64_t need, barrier, covers;
+    int result, led = 0;
+
+    pthread_mutex_lock( &conn->sync.lock);
+    need = conn->sync.started + 1;
+    while ( conn->sync.finished < need) {
+        if ( conn->sync.running) {
+            pthread_cond_wait( &conn->sync.done, &conn->sync.lock);
+            continue;
+        }
+        conn->sync.running = 1;
+        if ( kvsSyncWindow > 0) {
+            pthread_mutex_unlock( &conn->sync.lock);
+            usleep( kvsSyncWindow);
+            pthread_mutex_lock( &conn->sync.lock);
+        }
+        barrier = ++conn->sync.started;
+        covers = conn->sync.written;
+        pthread_mutex_unlock( &conn->sync.lock);
+
+        result = kvs_SyncConn( conn);
+        led = 1;
+
+        pthread_mutex_lock( &conn->sync.lock);
+        // Had the connection been lost meanwhile, kvs_SyncLost() took note
+        if ( result == 0 && covers > conn->sync.durable)
+            conn->sync.durable = covers;
+        conn->sync.finished = barrier;
+        conn->sync.result = result;
+        conn->sync.running = 0;
+        pthread_cond_broadcast( &conn->sync.done);
+    }
+    // A later barrier than needed may have finished, it covers this caller too
+    result = conn->sync.result;
+    pthread_mutex_unlock( &conn->sync.lock);
+    stats_io_sync( led);
+    return result;
+}
+
+// Waits until earlier writes to a key, or to any key if name is NULL, are as
+// durable as the sync mode asks. Returns -EIO if they are not in time, or
+// if some may have been lost with a connection to redis.
+int kvs_Sync( const char *name)
+{
+    struct kvs_conn *conn;
+    uint64_t first, last;
+    int result = 0, j, file;
+
+    if ( kvsSyncMode == KVS_SYNC_NONE)
+        return 0;
+    if ( name != NULL) {
+        struct kvs_db *db = kvs_DbOf( &name);
+
+        conn = kvs_SyncFile( db, name, &file);
+        pthread_mutex_lock( &conn->sync.lock);
+        first = conn->sync.files[file].first;
+        last = conn->sync.files[file].last;
+        conn->sync.files[file].first = 0;
+        pthread_mutex_unlock( &conn->sync.lock);
+
+        result = kvs_SyncGroup( conn);
+
+        pthread_mutex_lock( &conn->sync.lock);
+        if ( result < 0) {          // Still to be covered by the next one
+            if ( first != 0 && ( conn->sync.files[file].first == 0 ||
+                                 conn->sync.files[file].first > first))
+                conn->sync.files[file].first = first;
+        } else if ( first != 0 && first <= conn->sync.lostTo && last > conn->sync.lostFrom) {
+            log_warn( "kvs_Sync: writes to %s may have been lost with connection %d\n",
+                      name, conn->index);
+            result = -EIO;
+        }
+        pthread_mutex_unlock( &conn->sync.lock);
+        return result;
+    }
+    for ( j = 0; j < kvsConnCount && result == 0; j++)
+        result = kvs_SyncGroup( &kvsConns[j]);
+    for ( j = 0; j < kvsConnCount; j++) {
+        conn = &kvsConns[j];
+        pthread_mutex_lock( &conn->sync.lock);
+        if ( result == 0 && conn->sync.lostAll) {
+            log_warn( "kvs_Sync: writes may have been lost with connection %d\n", conn->index);
+            result = -EIO;
+            conn->sync.lostAll = 0;
+        }
+        pthread_mutex_unlock( &conn->sync.lock);
+    }
+    return result;
+}
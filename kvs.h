@@ -0,0 +1,49 @@
+/*
+  Key-value store (KVS) layer of fuse4redis: everything that talks to redis.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Unless stated otherwise functions return >= 0 on success or -errno.
+*/
+
+#ifndef _KVS_H_
+#define _KVS_H_
+
+#include <fuse.h>
+#include <hiredis.h>
+#include <sys/types.h>
+
+#define KVS_MAX_CONNS 64     // Redis connections, each with its own I/O thread
+
+int kvs_SetSentinels( const char *spec, const char *master);
+void kvs_SetRetryTime( unsigned ms);
+void kvs_SetAsyncUnlink( int enable);
+void kvs_SetChecksums( int enable);
+int kvs_SetDatabases( const char *spec);
+void kvs_init( const char *hostname, int port, int conns);
+int kvs_StartIoThread( void);
+void kvs_Cleanup( void);
+int kvs_RedisCommand( redisReply **resultReply, const char *cmd, ...);
+
+int kvs_CreateEmptyKey( const char *name);
+int kvs_KeyExists( const char *name);
+int kvs_DeleteKey( const char *name);
+int kvs_RenameKey( const char *name, const char *newname);
+size_t kvs_GetKeyLength( const char *name);
+int kvs_AppendZeroedBytes( const char *name, size_t newsize);
+int kvs_TruncateKey( const char *name, size_t newsize);
+int kvs_ReadDirectory( const char *dir, void *buf, fuse_fill_dir_t filler);
+int kvs_ReadPartialValue( const char *keyname, char *buf, size_t size, off_t offset);
+int kvs_WritePartialValue( const char *keyname, const char *buf, size_t size, off_t offset);
+
+int kvs_MultiDb( void);
+int kvs_IsDatabase( const char *name);
+int kvs_IsFileName( const char *name);
+int kvs_ListDatabases( void *buf, fuse_fill_dir_t filler);
+
+int kvs_SetSyncMode( const char *spec, unsigned window_us);
+int kvs_Sync( const char *name);
+
+#endif
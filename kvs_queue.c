@@ -0,0 +1,98 @@
+/*
+  Lock-free multi-producer single-consumer queue used to hand KVS
+  requests from the FUSE worker threads to the redis I/O thread.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  This is the intrusive MPSC queue described by Dmitry Vyukov. Producers
+  only do an atomic exchange on the head, so FUSE threads never block each
+  other while submitting. The consumer owns the tail and may briefly see a
+  node that was exchanged in but not yet linked; kvsq_pop() then returns
+  NULL and the caller simply retries.
+*/
+
+#include <errno.h>
+#include <sched.h>
+
+#include "kvs_queue.h"
+
+void kvsq_init(struct kvsq *q)
+{
+    atomic_store(&q->stub.next, NULL);
+    atomic_store(&q->head, &q->stub);
+    q->tail = &q->stub;
+    atomic_store(&q->pending, 0);
+    sem_init(&q->wake, 0, 0);
+}
+
+void kvsq_destroy(struct kvsq *q)
+{
+    sem_destroy(&q->wake);
+}
+
+static void kvsq_link(struct kvsq *q, struct kvsq_node *node)
+{
+    struct kvsq_node *prev;
+
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Counting before linking guarantees the consumer never reports more work
+// done than was announced, so a wakeup can never be lost.
+void kvsq_push(struct kvsq *q, struct kvsq_node *node)
+{
+    if (atomic_fetch_add(&q->pending, 1) == 0)
+        sem_post(&q->wake);
+    kvsq_link(q, node);
+}
+
+// Returns the oldest node, or NULL if none is visible yet. Consumer only.
+struct kvsq_node *kvsq_pop(struct kvsq *q)
+{
+    struct kvsq_node *tail = q->tail,
+                     *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;    // A producer is half way through kvsq_link()
+
+    kvsq_link(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Sleeps until there is pending work. Consumer only.
+void kvsq_wait(struct kvsq *q)
+{
+    while (sem_wait(&q->wake) != 0 && errno == EINTR)
+        ;
+}
+
+// Reports 'count' nodes as processed and returns how many are still pending.
+// When this returns 0 the consumer must go back to kvsq_wait().
+long kvsq_done(struct kvsq *q, long count)
+{
+    long left = atomic_fetch_sub(&q->pending, count) - count;
+
+    if (left > 0 && count == 0)
+        sched_yield();  // Work announced but not linked yet, let producer finish
+    return left;
+}
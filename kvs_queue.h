@@ -0,0 +1,36 @@
+/*
+  Lock-free multi-producer single-consumer queue used to hand KVS
+  requests from the FUSE worker threads to the redis I/O thread.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _KVS_QUEUE_H_
+#define _KVS_QUEUE_H_
+
+#include <semaphore.h>
+#include <stdatomic.h>
+
+// Nodes are intrusive: embed one as the first member of whatever is queued
+struct kvsq_node {
+    struct kvsq_node *_Atomic next;
+};
+
+struct kvsq {
+    struct kvsq_node *_Atomic head;   // Producers push here
+    struct kvsq_node *tail;           // Only the consumer touches this
+    struct kvsq_node stub;
+    atomic_long pending;              // Pushed but not yet reported done
+    sem_t wake;                       // Posted when pending leaves zero
+};
+
+void kvsq_init(struct kvsq *q);
+void kvsq_destroy(struct kvsq *q);
+void kvsq_push(struct kvsq *q, struct kvsq_node *node);
+struct kvsq_node *kvsq_pop(struct kvsq *q);
+void kvsq_wait(struct kvsq *q);
+long kvsq_done(struct kvsq *q, long count);
+
+#endif
@@ -17,10 +17,13 @@
 
 #include <errno.h>
 #include <fuse.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -28,6 +31,43 @@
 
 #include "log.h"
 
+// Messages are formatted into a ring owned by the calling thread and written
+// out by a background thread, so FUSE callbacks never do file I/O or take a
+// lock to log. Each ring has a single producer (its thread) and a single
+// consumer (the writer thread). When a ring is full the message is dropped
+// and counted rather than stalling the caller.
+#define LOG_RING_SLOTS  512
+#define LOG_LINE_MAX    254
+
+struct log_slot {
+    unsigned short len;
+    char text[LOG_LINE_MAX];
+};
+
+struct log_ring {
+    struct log_ring *next;
+    atomic_uint head;           // Next slot the producer fills
+    atomic_uint tail;           // Next slot the writer drains
+    atomic_ulong dropped;
+    atomic_int dead;            // Owner thread exited, free once drained
+    struct log_slot slot[LOG_RING_SLOTS];
+};
+
+int log_level = LOG_INFO;
+
+// Kept here rather than fetched through F4R_DATA, because fuse_get_context()
+// is only meaningful on FUSE worker threads and the KVS I/O thread logs too.
+static FILE *log_file;
+
+static __thread struct log_ring *log_myring;
+static struct log_ring *log_rings;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static pthread_t log_thread;
+static atomic_int log_running;
+static atomic_int log_stopping;
+
 FILE *log_open()
 {
     FILE *logfile;
@@ -40,18 +80,180 @@ FILE *log_open()
 	exit(EXIT_FAILURE);
     }
     
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    // Full buffering: only the writer thread touches the file and it flushes
+    // after every batch it drains.
+    setvbuf(logfile, NULL, _IOFBF, 64 * 1024);
 
+    log_file = logfile;
     return logfile;
 }
 
-void log_msg(const char *format, ...)
+static void log_ring_release(void *ring)
+{
+    atomic_store(&((struct log_ring *) ring)->dead, 1);
+}
+
+static void log_make_key(void)
+{
+    pthread_key_create(&log_ring_key, log_ring_release);
+}
+
+// First message from a thread allocates its ring. This is the only place
+// a producer takes a lock.
+static struct log_ring *log_get_ring(void)
+{
+    struct log_ring *ring = log_myring;
+
+    if (ring != NULL)
+        return ring;
+
+    ring = calloc(1, sizeof(struct log_ring));
+    if (ring == NULL)
+        return NULL;
+    pthread_once(&log_key_once, log_make_key);
+    pthread_setspecific(log_ring_key, ring);
+
+    pthread_mutex_lock(&log_rings_lock);
+    ring->next = log_rings;
+    log_rings = ring;
+    pthread_mutex_unlock(&log_rings_lock);
+
+    log_myring = ring;
+    return ring;
+}
+
+static void log_vwrite(const char *format, va_list ap)
+{
+    struct log_ring *ring;
+    struct log_slot *slot;
+    unsigned head;
+    int len;
+
+    if (!atomic_load_explicit(&log_running, memory_order_acquire)) {
+        // No writer thread yet (before FUSE daemonizes) or anymore
+        vfprintf(log_file != NULL ? log_file : stderr, format, ap);
+        return;
+    }
+
+    ring = log_get_ring();
+    if (ring == NULL)
+        return;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    slot = &ring->slot[head % LOG_RING_SLOTS];
+    len = vsnprintf(slot->text, LOG_LINE_MAX, format, ap);
+    if (len < 0)
+        return;
+    if (len >= LOG_LINE_MAX) {      // Truncated, but keep it a whole line
+        len = LOG_LINE_MAX - 1;
+        slot->text[len - 1] = '\n';
+    }
+    slot->len = len;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Copies everything queued in the rings to the logfile. Returns the number
+// of messages written. Writer thread only.
+static int log_drain(void)
+{
+    struct log_ring **link, *ring;
+    int written = 0;
+
+    pthread_mutex_lock(&log_rings_lock);
+    link = &log_rings;
+    while ((ring = *link) != NULL) {
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed),
+                 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long dropped;
+        int dead = atomic_load(&ring->dead);
+
+        for (; tail != head; tail++, written++) {
+            struct log_slot *slot = &ring->slot[tail % LOG_RING_SLOTS];
+            fwrite(slot->text, 1, slot->len, log_file);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0)
+            fprintf(log_file, "log: %lu messages dropped, ring was full\n", dropped);
+
+        if (dead) {         // Owner is gone and nothing can be added anymore
+            *link = ring->next;
+            free(ring);
+        } else
+            link = &ring->next;
+    }
+    pthread_mutex_unlock(&log_rings_lock);
+
+    if (written > 0)
+        fflush(log_file);
+    return written;
+}
+
+static void *log_writer(void *arg)
+{
+    struct timespec idle = { 0, 10 * 1000 * 1000 };    // 10ms
+
+    while (!atomic_load(&log_stopping)) {
+        if (log_drain() == 0)
+            nanosleep(&idle, NULL);
+    }
+    log_drain();
+    return NULL;
+}
+
+// Starts the writer thread. Like every thread in fuse4redis it must be
+// started after FUSE daemonizes.
+int log_start(void)
+{
+    int result;
+
+    if (log_file == NULL)
+        return -EBADF;
+    atomic_store(&log_stopping, 0);
+    result = pthread_create(&log_thread, NULL, log_writer, NULL);
+    if (result != 0)
+        return -result;
+    atomic_store_explicit(&log_running, 1, memory_order_release);
+    return 0;
+}
+
+// Flushes pending messages and stops the writer thread. Messages logged
+// afterwards are written synchronously.
+void log_stop(void)
+{
+    if (!atomic_load(&log_running))
+        return;
+    atomic_store_explicit(&log_running, 0, memory_order_release);
+    atomic_store(&log_stopping, 1);
+    pthread_join(log_thread, NULL);
+    fflush(log_file);
+}
+
+void log_write(const char *format, ...)
 {
     va_list ap;
     va_start(ap, format);
 
-    vfprintf(F4R_DATA->logfile, format, ap);
+    log_vwrite(format, ap);
+    va_end(ap);
+}
+
+// Used by the structure dumps below, which are debugging aids
+void log_msg(const char *format, ...)
+{
+    va_list ap;
+
+    if (LOG_DEBUG > log_level)
+        return;
+    va_start(ap, format);
+    log_vwrite(format, ap);
+    va_end(ap);
 }
 
 // Report errors to logfile and give -errno to caller
@@ -59,7 +261,7 @@ int log_error(char *func)
 {
     int ret = -errno;
     
-    log_msg("    ERROR %s: %s\n", func, strerror(errno));
+    log_err("    ERROR %s: %s\n", func, strerror(errno));
     
     return ret;
 }
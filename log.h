@@ -9,11 +9,51 @@
 #define _LOG_H_
 #include <stdio.h>
 
+// Log levels. A message is kept if its level is <= log_level
+#define LOG_ERR     0
+#define LOG_WARN    1
+#define LOG_INFO    2
+#define LOG_DEBUG   3
+
+// Calls above this level vanish at compile time. Build with 'make DEBUG=1'
+// to keep the per-callback debug traces.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_INFO
+#endif
+
+extern int log_level;
+
+#define log_at(level, ...) \
+  do { if ((level) <= log_level) log_write(__VA_ARGS__); } while (0)
+
+#define log_err(...)    log_at(LOG_ERR, __VA_ARGS__)
+
+#if LOG_COMPILE_LEVEL >= LOG_WARN
+#define log_warn(...)   log_at(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...)   do { } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_INFO
+#define log_info(...)   log_at(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...)   do { } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_DEBUG
+#define log_debug(...)  log_at(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...)  do { } while (0)
+#endif
+
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
   log_msg("    " #field " = " #format "\n", typecast st->field)
 
 FILE *log_open(void);
+int log_start(void);
+void log_stop(void);
+void log_write(const char *format, ...);
 void log_msg(const char *format, ...);
 void log_conn(struct fuse_conn_info *conn);
 int log_error(char *func);
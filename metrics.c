@@ -0,0 +1,197 @@
+/*
+  Serves the Prometheus metrics of /.f4r/metrics outside the mount: on a
+  local Unix domain socket and/or as a node_exporter textfile.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The socket answers every connection with the current metrics. If the
+  client sends an HTTP request first, the answer is a minimal HTTP/1.0
+  response, so 'curl --unix-socket PATH http://localhost/metrics' works.
+  The textfile is rewritten atomically (write and rename) every
+  'interval' seconds.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ctl.h"
+#include "log.h"
+#include "metrics.h"
+#include "stats.h"
+
+static const char *metrics_socket_path;
+static const char *metrics_file_path;
+static int metrics_interval;
+static int metrics_fd = -1;
+static pthread_t metrics_socket_thread, metrics_file_thread;
+static volatile int metrics_stopping;
+
+static void metrics_send(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return;
+        data += sent;
+        len -= sent;
+    }
+}
+
+static void metrics_serve(int fd)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    struct ctl_buf out = { NULL, 0, 0 };
+    char request[512];
+    ssize_t got = 0;
+
+    // Give an HTTP client a moment to send its request, plain readers send nothing
+    if (poll(&pfd, 1, 100) > 0)
+        got = recv(fd, request, sizeof(request) - 1, 0);
+
+    stats_render_prometheus(&out);
+    if (got > 4 && strncmp(request, "GET ", 4) == 0) {
+        char header[160];
+        int len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %zu\r\n\r\n", out.len);
+        metrics_send(fd, header, len);
+    }
+    metrics_send(fd, out.data, out.len);
+    free(out.data);
+}
+
+static void *metrics_socket_loop(void *arg)
+{
+    while (!metrics_stopping) {
+        struct pollfd pfd = { metrics_fd, POLLIN, 0 };
+        int fd;
+
+        if (poll(&pfd, 1, 1000) <= 0)     // Wake up now and then to notice a stop
+            continue;
+        fd = accept(metrics_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        metrics_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void metrics_write_file(void)
+{
+    struct ctl_buf out = { NULL, 0, 0 };
+    char tmpname[PATH_MAX];
+    FILE *file;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", metrics_file_path);
+    file = fopen(tmpname, "w");
+    if (file == NULL) {
+        log_warn("metrics: cannot write %s: %s\n", tmpname, strerror(errno));
+        return;
+    }
+    stats_render_prometheus(&out);
+    if (out.len > 0)
+        fwrite(out.data, 1, out.len, file);
+    free(out.data);
+    if (fclose(file) != 0 || rename(tmpname, metrics_file_path) != 0)
+        log_warn("metrics: cannot update %s: %s\n", metrics_file_path, strerror(errno));
+}
+
+static void *metrics_file_loop(void *arg)
+{
+    int elapsed = metrics_interval;
+
+    while (!metrics_stopping) {
+        if (elapsed >= metrics_interval) {
+            metrics_write_file();
+            elapsed = 0;
+        }
+        sleep(1);
+        elapsed++;
+    }
+    return NULL;
+}
+
+static int metrics_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -errno;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);   // Left over by a previous run
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        int result = -errno;
+        close(fd);
+        return result;
+    }
+    return fd;
+}
+
+// Starts serving metrics. Either path may be NULL. Like the other threads
+// it has to be called after FUSE daemonizes.
+int metrics_start(const char *socket_path, const char *file_path, int interval)
+{
+    metrics_stopping = 0;
+    metrics_interval = interval > 0 ? interval : 15;
+
+    if (socket_path != NULL) {
+        metrics_fd = metrics_listen(socket_path);
+        if (metrics_fd < 0) {
+            log_err("metrics: cannot listen on %s: %s\n", socket_path, strerror(-metrics_fd));
+            return metrics_fd;
+        }
+        metrics_socket_path = socket_path;
+        if (pthread_create(&metrics_socket_thread, NULL, metrics_socket_loop, NULL) != 0) {
+            close(metrics_fd);
+            metrics_fd = -1;
+            metrics_socket_path = NULL;
+            return -EAGAIN;
+        }
+    }
+    if (file_path != NULL) {
+        metrics_file_path = file_path;
+        if (pthread_create(&metrics_file_thread, NULL, metrics_file_loop, NULL) != 0) {
+            metrics_file_path = NULL;
+            return -EAGAIN;
+        }
+    }
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    metrics_stopping = 1;
+    if (metrics_socket_path != NULL) {
+        pthread_join(metrics_socket_thread, NULL);
+        close(metrics_fd);
+        unlink(metrics_socket_path);
+        metrics_socket_path = NULL;
+    }
+    if (metrics_file_path != NULL) {
+        pthread_join(metrics_file_thread, NULL);
+        metrics_file_path = NULL;
+    }
+}
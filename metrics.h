@@ -0,0 +1,16 @@
+/*
+  Serves the Prometheus metrics of /.f4r/metrics outside the mount: on a
+  local Unix domain socket and/or as a node_exporter textfile.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+int metrics_start(const char *socket_path, const char *file_path, int interval);
+void metrics_stop(void);
+
+#endif
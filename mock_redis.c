@@ -0,0 +1,410 @@
+/*
+  In-process stand-in for redis-server, speaking enough of the redis
+  protocol (RESP) for the commands the KVS layer issues. Used by
+  f4r_kvsbench to measure the client side without a real server.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  One thread listens on an ephemeral loopback port and serves all clients
+  with poll(), parsing every complete command in what it read and sending
+  all replies with one write, so pipelined batches stay batched. Keys
+  live in a small open addressing table. Supported: PING, SELECT, SET,
+  GET, EXISTS, DEL, UNLINK, RENAME, STRLEN, SETRANGE, GETRANGE and KEYS
+  (any pattern matches everything).
+*/
+
+#define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "mock_redis.h"
+
+#define MOCK_KEYS       65536   // A power of 2
+#define MOCK_ARGS       8
+#define MOCK_BUFFER     (1 << 20)
+#define MOCK_CLIENTS    64
+
+struct mock_key {
+    char *name;         // NULL when free, "" when deleted
+    char *value;
+    size_t len, size;
+};
+
+struct mock_arg {
+    const char *data;
+    size_t len;
+};
+
+struct mock_out {
+    char *data;
+    size_t len, size;
+};
+
+__thread int mock_redis_thread;     // Set on the server thread
+
+static struct mock_key mockKeys[MOCK_KEYS];
+static pthread_t mockThread;
+static clockid_t mockClock;
+static int mockListener = -1;
+static volatile int mockStopping;
+static uint64_t mockCommands;
+
+static uint64_t mock_hash( const char *name, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while ( len-- > 0) {
+        hash ^= (unsigned char) *name++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Finds a key, or with 'create' the slot to create it in
+static struct mock_key *mock_find( const struct mock_arg *name, int create)
+{
+    unsigned slot = mock_hash( name->data, name->len) & (MOCK_KEYS - 1), probes;
+    struct mock_key *reuse = NULL;
+
+    for ( probes = 0; probes < MOCK_KEYS; probes++, slot = (slot + 1) & (MOCK_KEYS - 1)) {
+        struct mock_key *k = &mockKeys[slot];
+
+        if ( k->name == NULL)
+            break;
+        if ( k->name[0] == '\0') {
+            if ( reuse == NULL)
+                reuse = k;
+        } else if ( strlen( k->name) == name->len && memcmp( k->name, name->data, name->len) == 0)
+            return k;
+    }
+    if ( !create)
+        return NULL;
+    if ( reuse == NULL)
+        reuse = probes < MOCK_KEYS ? &mockKeys[slot] : NULL;
+    if ( reuse != NULL) {
+        free( reuse->name);
+        reuse->name = strndup( name->data, name->len);
+        reuse->len = 0;
+    }
+    return reuse;
+}
+
+static void mock_delete( struct mock_key *k)
+{
+    free( k->name);
+    free( k->value);
+    k->name = strdup( "");      // Keeps probe sequences going through it
+    k->value = NULL;
+    k->len = k->size = 0;
+}
+
+static void mock_resize( struct mock_key *k, size_t len)
+{
+    if ( len > k->size) {
+        k->size = len < 64 ? 64 : len * 2;
+        k->value = realloc( k->value, k->size);
+    }
+    if ( len > k->len)
+        memset( k->value + k->len, 0, len - k->len);
+    k->len = len;
+}
+
+static void mock_append( struct mock_out *out, const char *data, size_t len)
+{
+    if ( out->len + len > out->size) {
+        out->size = (out->len + len) * 2;
+        out->data = realloc( out->data, out->size);
+    }
+    memcpy( out->data + out->len, data, len);
+    out->len += len;
+}
+
+static void mock_printf( struct mock_out *out, const char *fmt, long long value)
+{
+    char line[64];
+
+    mock_append( out, line, snprintf( line, sizeof(line), fmt, value));
+}
+
+static void mock_bulk( struct mock_out *out, const char *data, size_t len)
+{
+    mock_printf( out, "$%lld\r\n", len);
+    mock_append( out, data, len);
+    mock_append( out, "\r\n", 2);
+}
+
+static int mock_is( const struct mock_arg *arg, const char *name)
+{
+    return arg->len == strlen( name) && strncasecmp( arg->data, name, arg->len) == 0;
+}
+
+static long long mock_number( const struct mock_arg *arg)
+{
+    char digits[32];
+    size_t len = arg->len < sizeof(digits) - 1 ? arg->len : sizeof(digits) - 1;
+
+    memcpy( digits, arg->data, len);
+    digits[len] = '\0';
+    return atoll( digits);
+}
+
+static void mock_execute( struct mock_arg *argv, int argc, struct mock_out *out)
+{
+    struct mock_key *k;
+    long long start, end;
+    int j, count;
+
+    mockCommands++;
+    if ( mock_is( &argv[0], "PING")) {
+        mock_append( out, "+PONG\r\n", 7);
+    } else if ( mock_is( &argv[0], "SELECT") && argc == 2) {
+        mock_append( out, "+OK\r\n", 5);
+    } else if ( mock_is( &argv[0], "SET") && argc == 3) {
+        if ( ( k = mock_find( &argv[1], 1)) == NULL) {
+            mock_append( out, "-ERR mock keyspace full\r\n", 25);
+            return;
+        }
+        k->len = 0;
+        mock_resize( k, argv[2].len);
+        memcpy( k->value, argv[2].data, argv[2].len);
+        mock_append( out, "+OK\r\n", 5);
+    } else if ( mock_is( &argv[0], "GET") && argc == 2) {
+        if ( ( k = mock_find( &argv[1], 0)) == NULL)
+            mock_append( out, "$-1\r\n", 5);
+        else
+            mock_bulk( out, k->value, k->len);
+    } else if ( ( mock_is( &argv[0], "EXISTS") || mock_is( &argv[0], "DEL") ||
+                  mock_is( &argv[0], "UNLINK")) && argc >= 2) {
+        for ( count = 0, j = 1; j < argc; j++)
+            if ( ( k = mock_find( &argv[j], 0)) != NULL) {
+                count++;
+                if ( !mock_is( &argv[0], "EXISTS"))
+                    mock_delete( k);
+            }
+        mock_printf( out, ":%lld\r\n", count);
+    } else if ( mock_is( &argv[0], "RENAME") && argc == 3) {
+        struct mock_key *to;
+
+        if ( ( k = mock_find( &argv[1], 0)) == NULL) {
+            mock_append( out, "-ERR no such key\r\n", 18);
+            return;
+        }
+        if ( ( to = mock_find( &argv[2], 1)) == NULL) {
+            mock_append( out, "-ERR mock keyspace full\r\n", 25);
+            return;
+        }
+        if ( to != k) {
+            free( to->value);
+            to->value = k->value;
+            to->len = k->len;
+            to->size = k->size;
+            k->value = NULL;
+            mock_delete( k);
+        }
+        mock_append( out, "+OK\r\n", 5);
+    } else if ( mock_is( &argv[0], "STRLEN") && argc == 2) {
+        k = mock_find( &argv[1], 0);
+        mock_printf( out, ":%lld\r\n", k != NULL ? (long long) k->len : 0);
+    } else if ( mock_is( &argv[0], "SETRANGE") && argc == 4) {
+        if ( ( k = mock_find( &argv[1], 1)) == NULL) {
+            mock_append( out, "-ERR mock keyspace full\r\n", 25);
+            return;
+        }
+        start = mock_number( &argv[2]);
+        if ( start + argv[3].len > k->len)
+            mock_resize( k, start + argv[3].len);
+        memcpy( k->value + start, argv[3].data, argv[3].len);
+        mock_printf( out, ":%lld\r\n", k->len);
+    } else if ( mock_is( &argv[0], "GETRANGE") && argc == 4) {
+        k = mock_find( &argv[1], 0);
+        start = mock_number( &argv[2]);
+        end = mock_number( &argv[3]);
+        if ( k == NULL || start >= (long long) k->len || start > end)
+            mock_append( out, "$0\r\n\r\n", 6);
+        else
+            mock_bulk( out, k->value + start,
+                       ( end >= (long long) k->len ? (long long) k->len - 1 : end) - start + 1);
+    } else if ( mock_is( &argv[0], "KEYS") && argc == 2) {
+        for ( count = 0, j = 0; j < MOCK_KEYS; j++)
+            count += mockKeys[j].name != NULL && mockKeys[j].name[0] != '\0';
+        mock_printf( out, "*%lld\r\n", count);
+        for ( j = 0; j < MOCK_KEYS; j++)
+            if ( mockKeys[j].name != NULL && mockKeys[j].name[0] != '\0')
+                mock_bulk( out, mockKeys[j].name, strlen( mockKeys[j].name));
+    } else
+        mock_append( out, "-ERR unknown command\r\n", 22);
+}
+
+// Parses one "*<argc>\r\n($<len>\r\n<data>\r\n)*" command. Returns the bytes
+// used, 0 if incomplete, or -1 on a protocol error.
+static long mock_parse( const char *buf, size_t len, struct mock_arg *argv, int *argc)
+{
+    const char *p = buf, *end = buf + len, *eol;
+    long n, size;
+    int j;
+
+    if ( len == 0)
+        return 0;
+    if ( *p != '*')
+        return -1;
+    if ( ( eol = memchr( p, '\r', end - p)) == NULL || eol + 1 >= end)
+        return 0;
+    n = atol( p + 1);
+    if ( n < 1 || n > MOCK_ARGS)
+        return -1;
+    p = eol + 2;
+    for ( j = 0; j < n; j++) {
+        if ( p >= end)
+            return 0;
+        if ( *p != '$')
+            return -1;
+        if ( ( eol = memchr( p, '\r', end - p)) == NULL || eol + 1 >= end)
+            return 0;
+        size = atol( p + 1);
+        p = eol + 2;
+        if ( p + size + 2 > end)
+            return 0;
+        argv[j].data = p;
+        argv[j].len = size;
+        p += size + 2;
+    }
+    *argc = n;
+    return p - buf;
+}
+
+struct mock_client {
+    int fd;
+    char *buf;
+    size_t have;
+};
+
+// Runs every complete command the client sent and replies to all of them
+// with one write. Returns -1 when the client has to be dropped.
+static int mock_serve( struct mock_client *c, struct mock_out *out)
+{
+    struct mock_arg argv[MOCK_ARGS];
+    ssize_t len = read( c->fd, c->buf + c->have, MOCK_BUFFER - c->have);
+    size_t done;
+    long used;
+    int argc;
+
+    if ( len < 0 && errno == EINTR)
+        return 0;
+    if ( len <= 0)
+        return -1;
+    c->have += len;
+    out->len = 0;
+    for ( done = 0; ( used = mock_parse( c->buf + done, c->have - done, argv, &argc)) > 0; done += used)
+        mock_execute( argv, argc, out);
+    if ( used < 0 || ( done == 0 && c->have == MOCK_BUFFER))
+        return -1;      // Garbage, or a command larger than the buffer
+    memmove( c->buf, c->buf + done, c->have - done);
+    c->have -= done;
+    for ( done = 0; done < out->len; done += len)
+        if ( ( len = write( c->fd, out->data + done, out->len - done)) <= 0)
+            return -1;
+    return 0;
+}
+
+static void *mock_thread( void *arg)
+{
+    struct pollfd fds[MOCK_CLIENTS + 1];
+    struct mock_client clients[MOCK_CLIENTS];
+    struct mock_out out = { NULL, 0, 0 };
+    int count = 0, j, one = 1;
+
+    mock_redis_thread = 1;
+    fds[0].fd = mockListener;
+    fds[0].events = POLLIN;
+    while ( !mockStopping) {
+        for ( j = 0; j < count; j++) {
+            fds[j + 1].fd = clients[j].fd;
+            fds[j + 1].events = POLLIN;
+        }
+        if ( poll( fds, count + 1, 100) <= 0)
+            continue;
+        for ( j = count - 1; j >= 0; j--)
+            if ( fds[j + 1].revents != 0 && mock_serve( &clients[j], &out) < 0) {
+                close( clients[j].fd);
+                free( clients[j].buf);
+                clients[j] = clients[--count];
+            }
+        if ( ( fds[0].revents & POLLIN) && count < MOCK_CLIENTS) {
+            int fd = accept( mockListener, NULL, NULL);
+
+            if ( fd >= 0) {
+                setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                clients[count].fd = fd;
+                clients[count].have = 0;
+                if ( ( clients[count].buf = malloc( MOCK_BUFFER)) == NULL)
+                    close( fd);
+                else
+                    count++;
+            }
+        }
+    }
+    for ( j = 0; j < count; j++) {
+        close( clients[j].fd);
+        free( clients[j].buf);
+    }
+    free( out.data);
+    return NULL;
+}
+
+// Starts the server. Returns the loopback port it listens on, or -errno.
+int mock_redis_start( void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    mockListener = socket( AF_INET, SOCK_STREAM, 0);
+    if ( mockListener < 0)
+        return -errno;
+    memset( &addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK);
+    if ( bind( mockListener, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+         listen( mockListener, 4) != 0 ||
+         getsockname( mockListener, (struct sockaddr *) &addr, &len) != 0)
+        return -errno;
+    if ( pthread_create( &mockThread, NULL, mock_thread, NULL) != 0 ||
+         pthread_getcpuclockid( mockThread, &mockClock) != 0)
+        return -EAGAIN;
+    return ntohs( addr.sin_port);
+}
+
+void mock_redis_stop( void)
+{
+    mockStopping = 1;
+    pthread_join( mockThread, NULL);
+    close( mockListener);
+}
+
+// CPU time used by the server thread, to take it out of the client's
+uint64_t mock_redis_cpu_ns( void)
+{
+    struct timespec ts;
+
+    clock_gettime( mockClock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t mock_redis_commands( void)
+{
+    return mockCommands;
+}
@@ -0,0 +1,23 @@
+/*
+  In-process stand-in for redis-server, speaking enough of the redis
+  protocol (RESP) for the commands the KVS layer issues. Used by
+  f4r_kvsbench to measure the client side without a real server.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _MOCK_REDIS_H_
+#define _MOCK_REDIS_H_
+
+#include <stdint.h>
+
+int mock_redis_start( void);
+void mock_redis_stop( void);
+uint64_t mock_redis_cpu_ns( void);
+uint64_t mock_redis_commands( void);
+
+extern __thread int mock_redis_thread;
+
+#endif
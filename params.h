@@ -26,6 +26,31 @@
 struct f4r_state {
     FILE *logfile;
     char *rootdir;
+    char *redis_host;       // -o redis_host=HOST, default 127.0.0.1
+    int redis_port;         // -o redis_port=PORT, default 6379
+    int redis_conns;        // -o redis_conns=N connections per database, keys are spread over them
+    char *redis_dbs;        // -o redis_dbs=LIST, mount these databases as directories
+    char *redis_sentinel;   // -o redis_sentinel=HOST:PORT[,...], find the master through these
+    char *redis_master;     // -o redis_master=NAME, the sentinels' name for it, default mymaster
+    unsigned redis_retry_ms;    // -o redis_retry_ms=N, how long requests wait for redis to return
+    int async_unlink;       // -o async_unlink, unlink() returns before redis deleted the key
+    int checksums;          // -o checksums, a CRC-32C per 4 KB block, verified on read
+    int loglevel;           // -o loglevel=N, see LOG_* in log.h
+    char *metrics_socket;   // -o metrics_socket=PATH, Prometheus metrics on a Unix socket
+    char *metrics_file;     // -o metrics_file=PATH, and/or in a textfile collector file
+    int metrics_interval;   // -o metrics_interval=SECONDS between textfile updates
+    unsigned slow_op_us;        // -o slow_op_us=N, log operations slower than this
+    unsigned slowlog_entries;   // -o slowlog_entries=N, how many of them to keep
+    char *trace_file;       // -o trace_file=PATH, workload trace, SIGUSR2 toggles recording
+    int trace;              // -o trace, start recording at mount
+    int cmdlog;             // -o cmdlog, log every redis command for the tests
+    char *fsync;            // -o fsync=none|wait:N[:ms]|waitaof:L:R[:ms], durability of fsync(),
+                            // each WAIT/WAITAOF holds up its connection for up to ms
+    unsigned fsync_window_us;   // -o fsync_window_us=N, wait for concurrent fsync() calls
+    char *wal;              // -o wal=PATH, acknowledge writes once in this local journal
+    unsigned wal_max_mb;        // -o wal_max_mb=N, writers wait beyond this much unapplied
+    int immutable;          // -o immutable, read-only and cached for the life of the mount
+    unsigned cache_mb;          // -o cache_mb=N, file contents the cache keeps
 };
 #define F4R_DATA ((struct f4r_state *) fuse_get_context()->private_data)
 
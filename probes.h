@@ -0,0 +1,40 @@
+/*
+  USDT static tracepoints, so bpftrace, perf or systemtap can attach to a
+  running fuse4redis without rebuilding it or turning on logging.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Probes are only compiled in when the systemtap-sdt headers are
+  installed (the Makefile defines HAVE_SYS_SDT_H). A probe that nobody
+  attached to is a single nop instruction. Probes of provider 'fuse4redis':
+
+    op__entry(op, path, size, offset)
+    op__return(op, path, result, latency_ns)
+    kvs__cmd__entry(cmd, bytes_out)
+    kvs__cmd__return(cmd, reply_type, latency_ns, bytes_in)
+
+  'op' and 'cmd' are names such as "read" or "GETRANGE". Every
+  kvs__cmd__entry has its kvs__cmd__return, with a reply_type of -1 if
+  redis could not be reached in time. That of an UNLINK queued by
+  '-o async_unlink' fires on the I/O thread once redis answered. For example:
+
+    bpftrace -e 'usdt:./fuse4redis:fuse4redis:op__return
+                 { @[str(arg0)] = hist(arg3 / 1000); }'
+*/
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define F4R_PROBE2(name, a1, a2)                 DTRACE_PROBE2(fuse4redis, name, a1, a2)
+#define F4R_PROBE4(name, a1, a2, a3, a4)         DTRACE_PROBE4(fuse4redis, name, a1, a2, a3, a4)
+#else
+#define F4R_PROBE2(name, a1, a2)                 do { } while (0)
+#define F4R_PROBE4(name, a1, a2, a3, a4)         do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Runs f4r_scale through bench.sh once per number of redis connections
+# and, when gnuplot is installed, plots ops/s and p99 latency against
+# client threads, one line per connection count, for every workload.
+#
+# usage: ./scale.sh [f4r_scale options]
+#
+# CONNS lists the connection counts (default "1 2 4 8"). RTT_US and the
+# other bench.sh variables apply.
+
+set -e
+
+CONNS=${CONNS:-1 2 4 8}
+OUT=scale-$(git rev-parse --short HEAD 2>/dev/null || echo unknown).csv
+
+rm -f "$OUT"
+for N in $CONNS; do
+    BENCH=f4r_scale FORMAT=csv TAG="conns$N" MOUNT_OPTS="-o redis_conns=$N" \
+        ./bench.sh "$@" >/dev/null
+    # bench.sh left f4r_scale-<commit>-conns<N>.csv, add a conns column
+    for F in f4r_scale-*-conns"$N".csv; do
+        HEADER=1
+        [ -s "$OUT" ] && HEADER=0
+        awk -v n="$N" -v header="$HEADER" \
+            'FNR == 1 { if (header) print $0 ",conns"; next } { print $0 "," n }' "$F" >>"$OUT"
+        rm -f "$F"
+    done
+done
+echo "results in $OUT" >&2
+
+command -v gnuplot >/dev/null || exit 0
+for W in $(cut -d, -f2 "$OUT" | sed 1d | sort -u); do
+    PLOT_OPS="" PLOT_P99=""
+    for N in $CONNS; do
+        DATA="< awk -F, '\$2 == \"$W\" && \$13 == $N' $OUT"
+        PLOT_OPS="$PLOT_OPS${PLOT_OPS:+, }\"$DATA\" using 3:7 with linespoints title \"$N conns\""
+        PLOT_P99="$PLOT_P99${PLOT_P99:+, }\"$DATA\" using 3:9 with linespoints title \"$N conns\""
+    done
+    gnuplot <<PLOT
+set terminal png size 1200,500
+set output "scale-$W.png"
+set multiplot layout 1,2 title "$W"
+set logscale x 2
+set xlabel "client threads"
+set ylabel "ops/s"
+plot $PLOT_OPS
+set ylabel "p99 latency (us)"
+plot $PLOT_P99
+unset multiplot
+PLOT
+    echo "plot in scale-$W.png" >&2
+done
@@ -0,0 +1,120 @@
+/*
+  Slow operation log: FUSE operations, or redis commands, slower than a
+  threshold are kept with their context in a bounded in-memory ring that
+  can be read as /.f4r/slowlog.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Only slow operations get here, so a plain mutex is good enough. When
+  the ring is full the oldest entry is overwritten.
+*/
+
+#include "params.h"
+
+#include <fuse.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ctl.h"
+#include "slowlog.h"
+
+#define SLOWLOG_PATH_MAX 256
+
+struct slowlog_entry {
+    struct timespec when;
+    int op;
+    char path[SLOWLOG_PATH_MAX];
+    size_t size;
+    off_t offset;
+    uid_t uid;
+    pid_t pid;
+    int result;
+    uint64_t nanos;
+    unsigned cmds;
+    struct {
+        int cmd;
+        uint64_t nanos;
+    } cmd[OPCTX_CMDS];
+};
+
+uint64_t slowlog_threshold = 0;     // Nanoseconds, 0 disables the log
+
+static struct slowlog_entry *slowlog_ring;
+static unsigned slowlog_size;
+static uint64_t slowlog_next;       // Total ever added, the ring index is derived
+static pthread_mutex_t slowlog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Always called from a FUSE thread, so the calling process is known
+void slowlog_add(const struct f4r_opctx *ctx, int result)
+{
+    struct fuse_context *fctx = fuse_get_context();
+    struct slowlog_entry *e;
+    unsigned j;
+
+    pthread_mutex_lock(&slowlog_lock);
+    e = &slowlog_ring[slowlog_next++ % slowlog_size];
+    clock_gettime(CLOCK_REALTIME, &e->when);
+    e->op = ctx->op;
+    strncpy(e->path, ctx->path != NULL ? ctx->path : "", SLOWLOG_PATH_MAX - 1);
+    e->path[SLOWLOG_PATH_MAX - 1] = '\0';
+    e->size = ctx->size;
+    e->offset = ctx->offset;
+    e->uid = fctx != NULL ? fctx->uid : 0;
+    e->pid = fctx != NULL ? fctx->pid : 0;
+    e->result = result;
+    e->nanos = ctx->nanos;
+    e->cmds = ctx->cmds;
+    for (j = 0; j < ctx->cmds && j < OPCTX_CMDS; j++) {
+        e->cmd[j].cmd = ctx->cmd[j].cmd;
+        e->cmd[j].nanos = ctx->cmd[j].nanos;
+    }
+    pthread_mutex_unlock(&slowlog_lock);
+}
+
+// Oldest entry first. Each entry is one line with the operation, followed
+// by one indented line per redis command it issued.
+static void slowlog_render(struct ctl_buf *out)
+{
+    uint64_t first, n;
+
+    ctl_printf(out, "# threshold_us=%llu entries=%u\n",
+               (unsigned long long) slowlog_threshold / 1000, slowlog_size);
+    pthread_mutex_lock(&slowlog_lock);
+    first = slowlog_next > slowlog_size ? slowlog_next - slowlog_size : 0;
+    for (n = first; n < slowlog_next; n++) {
+        struct slowlog_entry *e = &slowlog_ring[n % slowlog_size];
+        struct tm tm;
+        char stamp[32];
+        unsigned j;
+
+        localtime_r(&e->when.tv_sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        ctl_printf(out, "%s.%06ld %s path=%s offset=%lld size=%zu uid=%d pid=%d "
+                   "result=%d latency_us=%.1f redis_cmds=%u\n", stamp, e->when.tv_nsec / 1000,
+                   stats_op_names[e->op], e->path, (long long) e->offset, e->size,
+                   (int) e->uid, (int) e->pid, e->result, e->nanos / 1000.0, e->cmds);
+        for (j = 0; j < e->cmds && j < OPCTX_CMDS; j++)
+            ctl_printf(out, "    %s latency_us=%.1f\n", stats_cmd_names[e->cmd[j].cmd],
+                       e->cmd[j].nanos / 1000.0);
+        if (e->cmds > OPCTX_CMDS)
+            ctl_printf(out, "    ... %u more\n", e->cmds - OPCTX_CMDS);
+    }
+    pthread_mutex_unlock(&slowlog_lock);
+}
+
+// Enables the log. A threshold of 0 leaves it off.
+void slowlog_init(unsigned threshold_us, unsigned entries)
+{
+    if (threshold_us == 0)
+        return;
+    slowlog_size = entries > 0 ? entries : 128;
+    slowlog_ring = calloc(slowlog_size, sizeof(struct slowlog_entry));
+    if (slowlog_ring == NULL)
+        return;
+    slowlog_threshold = (uint64_t) threshold_us * 1000;
+    ctl_register("slowlog", slowlog_render);
+}
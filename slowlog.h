@@ -0,0 +1,31 @@
+/*
+  Slow operation log: FUSE operations, or redis commands, slower than a
+  threshold are kept with their context in a bounded in-memory ring that
+  can be read as /.f4r/slowlog.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _SLOWLOG_H_
+#define _SLOWLOG_H_
+
+#include <stdint.h>
+
+#include "stats.h"
+
+extern uint64_t slowlog_threshold;
+
+void slowlog_init(unsigned threshold_us, unsigned entries);
+void slowlog_add(const struct f4r_opctx *ctx, int result);
+
+// Called as every operation ends. Cheap unless something was slow.
+static inline void slowlog_check(const struct f4r_opctx *ctx, int result)
+{
+    if (slowlog_threshold > 0 &&
+        (ctx->nanos >= slowlog_threshold || ctx->slowest_cmd >= slowlog_threshold))
+        slowlog_add(ctx, result);
+}
+
+#endif
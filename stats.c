@@ -0,0 +1,638 @@
+/*
+  Per-operation statistics: latency of every FUSE callback and of every
+  redis command, exposed under the control directory.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Every thread records into its own set of histograms, so the hot path
+  takes no lock and shares no cache line. Readers of /.f4r/stats walk
+  the list of threads and merge. When a thread exits its numbers are
+  folded into 'stats_retired' so nothing is lost.
+*/
+
+#include "params.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctl.h"
+#include "kvs.h"
+#include "probes.h"
+#include "stats.h"
+
+// Round trip accounting of a FUSE operation
+struct stats_rtt {
+    uint64_t cmds;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t redis_ns;
+    uint64_t queue_ns;
+    uint64_t send_ns;
+    uint64_t wire_ns;
+    uint64_t wake_ns;
+};
+
+struct stats_thread {
+    struct stats_thread *next;
+    struct hist op[OP_COUNT];
+    uint64_t op_errors[OP_COUNT];
+    struct stats_rtt op_rtt[OP_COUNT];
+    struct hist cmd[CMD_COUNT];
+    uint64_t cmd_errors[CMD_COUNT];
+    uint64_t bytes_out;     // Of every command, issued by an operation or not,
+    uint64_t bytes_in;      // such as the journal's or queued UNLINKs
+};
+
+const char *stats_op_names[OP_COUNT] = {
+    "getattr", "readlink", "mknod", "mkdir", "unlink", "rmdir",
+    "symlink", "rename", "link", "chmod", "chown", "truncate",
+    "utime", "open", "read", "write", "statfs", "flush", "release",
+    "fsync", "setxattr", "getxattr", "listxattr", "removexattr",
+    "opendir", "readdir", "releasedir", "fsyncdir", "access",
+    "ftruncate", "fgetattr"
+};
+
+const char *stats_cmd_names[CMD_COUNT] = {
+    "SET", "EXISTS", "UNLINK", "RENAME", "STRLEN", "SETRANGE",
+    "GETRANGE", "KEYS", "WAIT", "WAITAOF", "MSET", "EVALSHA", "other"
+};
+
+static const char *stats_cache_names[CACHE_KINDS] = { "attr", "dir", "data" };
+
+__thread struct f4r_opctx *stats_curop;
+
+// Connection level counters, updated once per batch by the I/O thread
+static struct {
+    uint64_t batches;
+    uint64_t commands;
+    uint64_t reconnects;
+    uint64_t expired;       // Requests failed because redis stayed unreachable
+    uint64_t bad_checksums; // Blocks read that did not match their checksum
+    uint64_t cache_hits[CACHE_KINDS];
+    uint64_t cache_misses[CACHE_KINDS];
+    uint64_t syncs;         // fsync() calls that waited for durability
+    uint64_t barriers;      // WAIT or WAITAOF issued for them
+} stats_io;
+
+// Per connection, each updated by its own I/O thread
+static struct {
+    uint64_t busy_ns;       // Time spent talking to redis
+    uint64_t depth;         // Requests still queued after the last batch
+    uint64_t started;       // When the I/O thread started, for utilization
+} stats_conns[KVS_MAX_CONNS];
+static int stats_conn_count;    // I/O threads started
+
+static __thread struct stats_thread *stats_mine;
+static struct stats_thread *stats_threads;
+static struct stats_thread stats_retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static void stats_merge(struct stats_thread *dst, const struct stats_thread *src)
+{
+    int j;
+
+    for (j = 0; j < OP_COUNT; j++) {
+        hist_merge(&dst->op[j], &src->op[j]);
+        dst->op_errors[j] += __atomic_load_n(&src->op_errors[j], __ATOMIC_RELAXED);
+        dst->op_rtt[j].cmds += __atomic_load_n(&src->op_rtt[j].cmds, __ATOMIC_RELAXED);
+        dst->op_rtt[j].bytes_out += __atomic_load_n(&src->op_rtt[j].bytes_out, __ATOMIC_RELAXED);
+        dst->op_rtt[j].bytes_in += __atomic_load_n(&src->op_rtt[j].bytes_in, __ATOMIC_RELAXED);
+        dst->op_rtt[j].redis_ns += __atomic_load_n(&src->op_rtt[j].redis_ns, __ATOMIC_RELAXED);
+        dst->op_rtt[j].queue_ns += __atomic_load_n(&src->op_rtt[j].queue_ns, __ATOMIC_RELAXED);
+        dst->op_rtt[j].send_ns += __atomic_load_n(&src->op_rtt[j].send_ns, __ATOMIC_RELAXED);
+        dst->op_rtt[j].wire_ns += __atomic_load_n(&src->op_rtt[j].wire_ns, __ATOMIC_RELAXED);
+        dst->op_rtt[j].wake_ns += __atomic_load_n(&src->op_rtt[j].wake_ns, __ATOMIC_RELAXED);
+    }
+    for (j = 0; j < CMD_COUNT; j++) {
+        hist_merge(&dst->cmd[j], &src->cmd[j]);
+        dst->cmd_errors[j] += __atomic_load_n(&src->cmd_errors[j], __ATOMIC_RELAXED);
+    }
+    dst->bytes_out += __atomic_load_n(&src->bytes_out, __ATOMIC_RELAXED);
+    dst->bytes_in += __atomic_load_n(&src->bytes_in, __ATOMIC_RELAXED);
+}
+
+// Thread exit: keep its numbers and drop it from the list
+static void stats_thread_exit(void *arg)
+{
+    struct stats_thread *st = arg, **link;
+
+    pthread_mutex_lock(&stats_lock);
+    for (link = &stats_threads; *link != NULL; link = &(*link)->next)
+        if (*link == st) {
+            *link = st->next;
+            break;
+        }
+    stats_merge(&stats_retired, st);
+    pthread_mutex_unlock(&stats_lock);
+    free(st);
+}
+
+static void stats_make_key(void)
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+static struct stats_thread *stats_get(void)
+{
+    struct stats_thread *st = stats_mine;
+
+    if (st != NULL)
+        return st;
+    st = calloc(1, sizeof(struct stats_thread));
+    if (st == NULL)
+        return NULL;
+    pthread_once(&stats_key_once, stats_make_key);
+    pthread_setspecific(stats_key, st);
+
+    pthread_mutex_lock(&stats_lock);
+    st->next = stats_threads;
+    stats_threads = st;
+    pthread_mutex_unlock(&stats_lock);
+
+    stats_mine = st;
+    return st;
+}
+
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+void stats_op_enter(struct f4r_opctx *ctx, int op, const char *path, size_t size, off_t offset)
+{
+    ctx->op = op;
+    ctx->path = path;
+    ctx->path2 = NULL;
+    ctx->flags = 0;
+    ctx->size = size;
+    ctx->offset = offset;
+    ctx->cmds = 0;
+    ctx->bytes_out = 0;
+    ctx->bytes_in = 0;
+    ctx->redis_ns = 0;
+    ctx->queue_ns = 0;
+    ctx->send_ns = 0;
+    ctx->wire_ns = 0;
+    ctx->wake_ns = 0;
+    ctx->slowest_cmd = 0;
+    ctx->seq = 0;
+    ctx->start = hist_now();
+    stats_curop = ctx;
+    F4R_PROBE4(op__entry, stats_op_names[op], path, size, offset);
+}
+
+// Records the operation and passes its result through
+int stats_op_leave(struct f4r_opctx *ctx, int result)
+{
+    struct stats_thread *st = stats_get();
+    struct stats_rtt *rtt;
+    uint64_t nanos = hist_now() - ctx->start;
+
+    ctx->nanos = nanos;
+    stats_curop = NULL;
+    F4R_PROBE4(op__return, stats_op_names[ctx->op], ctx->path, result, nanos);
+    if (st == NULL)
+        return result;
+    hist_record(&st->op[ctx->op], nanos);
+    if (result < 0)
+        stats_add(&st->op_errors[ctx->op], 1);
+
+    rtt = &st->op_rtt[ctx->op];
+    stats_add(&rtt->cmds, ctx->cmds);
+    stats_add(&rtt->bytes_out, ctx->bytes_out);
+    stats_add(&rtt->bytes_in, ctx->bytes_in);
+    stats_add(&rtt->redis_ns, ctx->redis_ns);
+    stats_add(&rtt->queue_ns, ctx->queue_ns);
+    stats_add(&rtt->send_ns, ctx->send_ns);
+    stats_add(&rtt->wire_ns, ctx->wire_ns);
+    stats_add(&rtt->wake_ns, ctx->wake_ns);
+    return result;
+}
+
+// Maps a command format such as "GETRANGE %s %ld %ld" to its CMD_* id
+int stats_cmd_id(const char *format)
+{
+    size_t len = strcspn(format, " ");
+    int j;
+
+    for (j = 0; j < CMD_OTHER; j++)
+        if (strlen(stats_cmd_names[j]) == len && strncmp(format, stats_cmd_names[j], len) == 0)
+            return j;
+    return CMD_OTHER;
+}
+
+// Records a redis command and charges it to the FUSE operation that issued it
+void stats_cmd_record(int cmd, uint64_t nanos, int failed, size_t bytes_out, size_t bytes_in)
+{
+    struct stats_thread *st = stats_get();
+    struct f4r_opctx *op = stats_curop;
+
+    if (op != NULL) {
+        if (op->cmds < OPCTX_CMDS) {
+            op->cmd[op->cmds].cmd = cmd;
+            op->cmd[op->cmds].nanos = nanos;
+        }
+        if (nanos > op->slowest_cmd)
+            op->slowest_cmd = nanos;
+        op->cmds++;
+        op->bytes_out += bytes_out;
+        op->bytes_in += bytes_in;
+        op->redis_ns += nanos;
+    }
+    if (st == NULL)
+        return;
+    hist_record(&st->cmd[cmd], nanos);
+    stats_add(&st->bytes_out, bytes_out);
+    stats_add(&st->bytes_in, bytes_in);
+    if (failed)
+        stats_add(&st->cmd_errors[cmd], 1);
+}
+
+// Where the time of the command just recorded went: waiting for the I/O
+// thread of its connection, being batched and written, in the network and
+// redis until its reply was read, and waking the caller up
+void stats_cmd_stages(uint64_t queue_ns, uint64_t send_ns, uint64_t wire_ns, uint64_t wake_ns)
+{
+    struct f4r_opctx *op = stats_curop;
+
+    if (op == NULL)
+        return;
+    op->queue_ns += queue_ns;
+    op->send_ns += send_ns;
+    op->wire_ns += wire_ns;
+    op->wake_ns += wake_ns;
+}
+
+// The I/O thread of connection 'conn' starts
+void stats_io_start(int conn)
+{
+    int count = __atomic_load_n(&stats_conn_count, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&stats_conns[conn].started, hist_now(), __ATOMIC_RELAXED);
+    while (count < conn + 1 &&
+           !__atomic_compare_exchange_n(&stats_conn_count, &count, conn + 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void stats_io_batch(int conn, unsigned commands, long depth, uint64_t busy_ns)
+{
+    __atomic_fetch_add(&stats_io.batches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_io.commands, commands, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats_conns[conn].busy_ns, busy_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats_conns[conn].depth, depth > 0 ? depth : 0, __ATOMIC_RELAXED);
+}
+
+// An fsync() waited for a durability barrier, issued by itself if 'led'
+void stats_io_sync(int led)
+{
+    __atomic_fetch_add(&stats_io.syncs, 1, __ATOMIC_RELAXED);
+    if (led)
+        __atomic_fetch_add(&stats_io.barriers, 1, __ATOMIC_RELAXED);
+}
+
+void stats_io_reconnect(void)
+{
+    __atomic_fetch_add(&stats_io.reconnects, 1, __ATOMIC_RELAXED);
+}
+
+void stats_io_expired(void)
+{
+    __atomic_fetch_add(&stats_io.expired, 1, __ATOMIC_RELAXED);
+}
+
+void stats_checksum_error(void)
+{
+    __atomic_fetch_add(&stats_io.bad_checksums, 1, __ATOMIC_RELAXED);
+}
+
+// A lookup in the cache of an immutable mount
+void stats_cache(int kind, int hit)
+{
+    __atomic_fetch_add(hit ? &stats_io.cache_hits[kind] : &stats_io.cache_misses[kind], 1,
+                       __ATOMIC_RELAXED);
+}
+
+// Sums every live thread and the retired ones. Caller frees the result.
+static struct stats_thread *stats_snapshot(void)
+{
+    struct stats_thread *total = calloc(1, sizeof(struct stats_thread)), *st;
+
+    if (total == NULL)
+        return NULL;
+    pthread_mutex_lock(&stats_lock);
+    stats_merge(total, &stats_retired);
+    for (st = stats_threads; st != NULL; st = st->next)
+        stats_merge(total, st);
+    pthread_mutex_unlock(&stats_lock);
+    return total;
+}
+
+static double us(uint64_t nanos)
+{
+    return nanos / 1000.0;
+}
+
+static void stats_text_line(struct ctl_buf *out, const char *name, const struct hist *h,
+                            uint64_t errors)
+{
+    ctl_printf(out, "%-12s %10llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+               (unsigned long long) h->count, (unsigned long long) errors,
+               us(hist_mean(h)), us(hist_percentile(h, 50)), us(hist_percentile(h, 99)),
+               us(hist_percentile(h, 99.9)), us(h->max));
+}
+
+static void stats_render_text(struct ctl_buf *out)
+{
+    struct stats_thread *total = stats_snapshot();
+    int j;
+
+    if (total == NULL)
+        return;
+    ctl_printf(out, "%-12s %10s %8s %10s %10s %10s %10s %10s\n", "# fuse op",
+               "count", "errors", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (j = 0; j < OP_COUNT; j++)
+        stats_text_line(out, stats_op_names[j], &total->op[j], total->op_errors[j]);
+
+    ctl_printf(out, "\n%-12s %10s %8s %10s %10s %10s %10s %10s\n", "# redis cmd",
+               "count", "errors", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (j = 0; j < CMD_COUNT; j++)
+        stats_text_line(out, stats_cmd_names[j], &total->cmd[j], total->cmd_errors[j]);
+    free(total);
+}
+
+// Operations also carry their round trip accounting, redis commands do not
+static void stats_json_entry(struct ctl_buf *out, const char *name, const struct hist *h,
+                             uint64_t errors, const struct stats_rtt *rtt, int last)
+{
+    ctl_printf(out, "    \"%s\": {\"count\": %llu, \"errors\": %llu, \"mean_us\": %.1f, "
+               "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f",
+               name, (unsigned long long) h->count, (unsigned long long) errors,
+               us(hist_mean(h)), us(hist_percentile(h, 50)), us(hist_percentile(h, 99)),
+               us(hist_percentile(h, 99.9)), us(h->max));
+    if (rtt != NULL)
+        ctl_printf(out, ", \"redis_cmds\": %llu, \"bytes_out\": %llu, \"bytes_in\": %llu, "
+                   "\"redis_us\": %.1f, \"self_us\": %.1f, \"queue_us\": %.1f, "
+                   "\"send_us\": %.1f, \"wire_us\": %.1f, \"wake_us\": %.1f",
+                   (unsigned long long) rtt->cmds, (unsigned long long) rtt->bytes_out,
+                   (unsigned long long) rtt->bytes_in, us(rtt->redis_ns),
+                   us(h->sum > rtt->redis_ns ? h->sum - rtt->redis_ns : 0), us(rtt->queue_ns),
+                   us(rtt->send_ns), us(rtt->wire_ns), us(rtt->wake_ns));
+    ctl_printf(out, "}%s\n", last ? "" : ",");
+}
+
+static void stats_render_json(struct ctl_buf *out)
+{
+    struct stats_thread *total = stats_snapshot();
+    int j;
+
+    if (total == NULL)
+        return;
+    ctl_printf(out, "{\n  \"ops\": {\n");
+    for (j = 0; j < OP_COUNT; j++)
+        stats_json_entry(out, stats_op_names[j], &total->op[j], total->op_errors[j],
+                         &total->op_rtt[j], j == OP_COUNT - 1);
+    ctl_printf(out, "  },\n  \"redis\": {\n");
+    for (j = 0; j < CMD_COUNT; j++)
+        stats_json_entry(out, stats_cmd_names[j], &total->cmd[j], total->cmd_errors[j],
+                         NULL, j == CMD_COUNT - 1);
+    ctl_printf(out, "  }\n}\n");
+    free(total);
+}
+
+// How many redis round trips each FUSE operation costs, and how its time
+// splits between waiting for redis and fuse4redis itself. One line per
+// operation, whitespace separated, so scripts can diff it between runs.
+static void stats_render_roundtrips(struct ctl_buf *out)
+{
+    struct stats_thread *total = stats_snapshot();
+    int j;
+
+    if (total == NULL)
+        return;
+    ctl_printf(out, "%-12s %10s %10s %8s %12s %12s %12s %12s\n", "# fuse op", "count",
+               "redis_cmds", "per_op", "bytes_out", "bytes_in", "redis_us", "self_us");
+    for (j = 0; j < OP_COUNT; j++) {
+        struct hist *h = &total->op[j];
+        struct stats_rtt *rtt = &total->op_rtt[j];
+
+        ctl_printf(out, "%-12s %10llu %10llu %8.2f %12llu %12llu %12.1f %12.1f\n",
+                   stats_op_names[j], (unsigned long long) h->count,
+                   (unsigned long long) rtt->cmds,
+                   h->count > 0 ? (double) rtt->cmds / h->count : 0.0,
+                   (unsigned long long) rtt->bytes_out, (unsigned long long) rtt->bytes_in,
+                   us(rtt->redis_ns), us(h->sum > rtt->redis_ns ? h->sum - rtt->redis_ns : 0));
+    }
+    free(total);
+}
+
+// Where the time of each FUSE operation goes, mean microseconds per call:
+//   self   in fuse4redis itself, outside of redis commands
+//   queue  commands waiting for the I/O thread of their connection
+//   send   batching them with other commands and writing them out
+//   wire   network round trip and redis, until the reply is read
+//   wake   the I/O thread handing the reply back
+// Time in the kernel and libfuse, before the callback is entered and after
+// it returns, is not visible from here: the high-level libfuse API does not
+// pass the request on. It is what a client measures minus 'total'.
+static void stats_render_profile(struct ctl_buf *out)
+{
+    struct stats_thread *total = stats_snapshot();
+    int j;
+
+    if (total == NULL)
+        return;
+    ctl_printf(out, "%-12s %10s %10s %10s %10s %10s %10s %10s %10s\n", "# fuse op", "count",
+               "total_us", "p99_us", "self_us", "queue_us", "send_us", "wire_us", "wake_us");
+    for (j = 0; j < OP_COUNT; j++) {
+        struct hist *h = &total->op[j];
+        struct stats_rtt *rtt = &total->op_rtt[j];
+        double n = h->count;
+
+        if (h->count == 0)
+            continue;
+        ctl_printf(out, "%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                   stats_op_names[j], (unsigned long long) h->count, us(h->sum) / n,
+                   us(hist_percentile(h, 99)),
+                   us(h->sum > rtt->redis_ns ? h->sum - rtt->redis_ns : 0) / n,
+                   us(rtt->queue_ns) / n, us(rtt->send_ns) / n, us(rtt->wire_ns) / n,
+                   us(rtt->wake_ns) / n);
+    }
+    free(total);
+}
+
+// Latency buckets for Prometheus histograms, in seconds. Counts are taken
+// from the fine grained histogram buckets that end at or below each bound.
+static const double stats_prom_le[] = {
+    0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+    0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5
+};
+#define STATS_PROM_LE (sizeof(stats_prom_le) / sizeof(stats_prom_le[0]))
+
+static void stats_prom_histogram(struct ctl_buf *out, const char *metric, const char *label,
+                                 const char *value, const struct hist *h)
+{
+    uint64_t cumulative = 0;
+    unsigned j;
+    int b = 0;
+
+    for (j = 0; j < STATS_PROM_LE; j++) {
+        uint64_t bound = (uint64_t) (stats_prom_le[j] * 1e9);
+
+        for (; b < HIST_BUCKETS && hist_bucket_upper(b) <= bound; b++)
+            cumulative += h->bucket[b];
+        ctl_printf(out, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", metric, label, value,
+                   stats_prom_le[j], (unsigned long long) cumulative);
+    }
+    ctl_printf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", metric, label, value,
+               (unsigned long long) h->count);
+    ctl_printf(out, "%s_sum{%s=\"%s\"} %.9f\n", metric, label, value, h->sum / 1e9);
+    ctl_printf(out, "%s_count{%s=\"%s\"} %llu\n", metric, label, value,
+               (unsigned long long) h->count);
+}
+
+static void stats_prom_header(struct ctl_buf *out, const char *metric, const char *type,
+                              const char *help)
+{
+    ctl_printf(out, "# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+}
+
+// Prometheus text exposition format (version 0.0.4)
+void stats_render_prometheus(struct ctl_buf *out)
+{
+    struct stats_thread *total = stats_snapshot();
+    uint64_t started, now = hist_now();
+    int conns, j;
+
+    if (total == NULL)
+        return;
+
+    stats_prom_header(out, "fuse4redis_op_errors_total", "counter",
+                      "FUSE operations that returned an error.");
+    for (j = 0; j < OP_COUNT; j++)
+        ctl_printf(out, "fuse4redis_op_errors_total{op=\"%s\"} %llu\n", stats_op_names[j],
+                   (unsigned long long) total->op_errors[j]);
+
+    stats_prom_header(out, "fuse4redis_op_duration_seconds", "histogram",
+                      "Latency of FUSE operations. The count is the operation rate.");
+    for (j = 0; j < OP_COUNT; j++)
+        stats_prom_histogram(out, "fuse4redis_op_duration_seconds", "op", stats_op_names[j],
+                             &total->op[j]);
+
+    stats_prom_header(out, "fuse4redis_op_redis_commands_total", "counter",
+                      "Redis commands issued on behalf of FUSE operations.");
+    for (j = 0; j < OP_COUNT; j++)
+        ctl_printf(out, "fuse4redis_op_redis_commands_total{op=\"%s\"} %llu\n",
+                   stats_op_names[j], (unsigned long long) total->op_rtt[j].cmds);
+
+    stats_prom_header(out, "fuse4redis_op_stage_seconds_total", "counter",
+                      "Time of FUSE operations by where it went, as in .f4r/profile.");
+    for (j = 0; j < OP_COUNT; j++) {
+        const struct stats_rtt *rtt = &total->op_rtt[j];
+        uint64_t sum = total->op[j].sum;
+
+        ctl_printf(out, "fuse4redis_op_stage_seconds_total{op=\"%s\",stage=\"self\"} %.9f\n",
+                   stats_op_names[j], (sum > rtt->redis_ns ? sum - rtt->redis_ns : 0) / 1e9);
+        ctl_printf(out, "fuse4redis_op_stage_seconds_total{op=\"%s\",stage=\"queue\"} %.9f\n",
+                   stats_op_names[j], rtt->queue_ns / 1e9);
+        ctl_printf(out, "fuse4redis_op_stage_seconds_total{op=\"%s\",stage=\"send\"} %.9f\n",
+                   stats_op_names[j], rtt->send_ns / 1e9);
+        ctl_printf(out, "fuse4redis_op_stage_seconds_total{op=\"%s\",stage=\"wire\"} %.9f\n",
+                   stats_op_names[j], rtt->wire_ns / 1e9);
+        ctl_printf(out, "fuse4redis_op_stage_seconds_total{op=\"%s\",stage=\"wake\"} %.9f\n",
+                   stats_op_names[j], rtt->wake_ns / 1e9);
+    }
+
+    stats_prom_header(out, "fuse4redis_redis_command_errors_total", "counter",
+                      "Redis commands answered with an error.");
+    for (j = 0; j < CMD_COUNT; j++)
+        ctl_printf(out, "fuse4redis_redis_command_errors_total{cmd=\"%s\"} %llu\n",
+                   stats_cmd_names[j], (unsigned long long) total->cmd_errors[j]);
+
+    stats_prom_header(out, "fuse4redis_redis_command_duration_seconds", "histogram",
+                      "Latency of redis commands as seen by fuse4redis, queueing included.");
+    for (j = 0; j < CMD_COUNT; j++)
+        stats_prom_histogram(out, "fuse4redis_redis_command_duration_seconds", "cmd",
+                             stats_cmd_names[j], &total->cmd[j]);
+
+    stats_prom_header(out, "fuse4redis_redis_sent_bytes_total", "counter",
+                      "Bytes of redis protocol sent.");
+    ctl_printf(out, "fuse4redis_redis_sent_bytes_total %llu\n", (unsigned long long) total->bytes_out);
+    stats_prom_header(out, "fuse4redis_redis_received_bytes_total", "counter",
+                      "Bytes of redis protocol received.");
+    ctl_printf(out, "fuse4redis_redis_received_bytes_total %llu\n", (unsigned long long) total->bytes_in);
+
+    stats_prom_header(out, "fuse4redis_redis_reconnects_total", "counter",
+                      "Times the connection to redis was reestablished.");
+    ctl_printf(out, "fuse4redis_redis_reconnects_total %llu\n",
+               (unsigned long long) __atomic_load_n(&stats_io.reconnects, __ATOMIC_RELAXED));
+    stats_prom_header(out, "fuse4redis_redis_expired_total", "counter",
+                      "Requests failed after waiting too long for redis to come back.");
+    ctl_printf(out, "fuse4redis_redis_expired_total %llu\n",
+               (unsigned long long) __atomic_load_n(&stats_io.expired, __ATOMIC_RELAXED));
+    stats_prom_header(out, "fuse4redis_checksum_errors_total", "counter",
+                      "Blocks read from redis that did not match their checksum.");
+    ctl_printf(out, "fuse4redis_checksum_errors_total %llu\n",
+               (unsigned long long) __atomic_load_n(&stats_io.bad_checksums, __ATOMIC_RELAXED));
+    stats_prom_header(out, "fuse4redis_redis_batches_total", "counter",
+                      "Pipelined batches written to redis.");
+    ctl_printf(out, "fuse4redis_redis_batches_total %llu\n",
+               (unsigned long long) __atomic_load_n(&stats_io.batches, __ATOMIC_RELAXED));
+    stats_prom_header(out, "fuse4redis_redis_batched_commands_total", "counter",
+                      "Commands sent in those batches.");
+    ctl_printf(out, "fuse4redis_redis_batched_commands_total %llu\n",
+               (unsigned long long) __atomic_load_n(&stats_io.commands, __ATOMIC_RELAXED));
+    stats_prom_header(out, "fuse4redis_fsync_calls_total", "counter",
+                      "fsync() calls that waited for durability.");
+    ctl_printf(out, "fuse4redis_fsync_calls_total %llu\n",
+               (unsigned long long) __atomic_load_n(&stats_io.syncs, __ATOMIC_RELAXED));
+    stats_prom_header(out, "fuse4redis_fsync_barriers_total", "counter",
+                      "WAIT or WAITAOF issued for them, fewer when group commit pays off.");
+    ctl_printf(out, "fuse4redis_fsync_barriers_total %llu\n",
+               (unsigned long long) __atomic_load_n(&stats_io.barriers, __ATOMIC_RELAXED));
+    stats_prom_header(out, "fuse4redis_cache_hits_total", "counter",
+                      "Lookups the cache of an immutable mount answered.");
+    for (j = 0; j < CACHE_KINDS; j++)
+        ctl_printf(out, "fuse4redis_cache_hits_total{cache=\"%s\"} %llu\n", stats_cache_names[j],
+                   (unsigned long long) __atomic_load_n(&stats_io.cache_hits[j], __ATOMIC_RELAXED));
+    stats_prom_header(out, "fuse4redis_cache_misses_total", "counter",
+                      "Lookups that had to go to redis.");
+    for (j = 0; j < CACHE_KINDS; j++)
+        ctl_printf(out, "fuse4redis_cache_misses_total{cache=\"%s\"} %llu\n", stats_cache_names[j],
+                   (unsigned long long) __atomic_load_n(&stats_io.cache_misses[j], __ATOMIC_RELAXED));
+    // Each connection has its own I/O thread, its busy time is the connection's utilization
+    conns = __atomic_load_n(&stats_conn_count, __ATOMIC_RELAXED);
+    stats_prom_header(out, "fuse4redis_redis_inflight", "gauge",
+                      "Requests queued on a redis connection after its last batch.");
+    for (j = 0; j < conns; j++)
+        ctl_printf(out, "fuse4redis_redis_inflight{conn=\"%d\"} %llu\n", j,
+                   (unsigned long long) __atomic_load_n(&stats_conns[j].depth, __ATOMIC_RELAXED));
+    stats_prom_header(out, "fuse4redis_redis_busy_seconds_total", "counter",
+                      "Time a redis connection spent serving batches.");
+    for (j = 0; j < conns; j++)
+        ctl_printf(out, "fuse4redis_redis_busy_seconds_total{conn=\"%d\"} %.6f\n", j,
+                   __atomic_load_n(&stats_conns[j].busy_ns, __ATOMIC_RELAXED) / 1e9);
+    stats_prom_header(out, "fuse4redis_redis_utilization", "gauge",
+                      "Fraction of time a redis connection was busy since it started.");
+    for (j = 0; j < conns; j++) {
+        started = __atomic_load_n(&stats_conns[j].started, __ATOMIC_RELAXED);
+        ctl_printf(out, "fuse4redis_redis_utilization{conn=\"%d\"} %.4f\n", j,
+                   started > 0 && now > started ? (double) __atomic_load_n(&stats_conns[j].busy_ns,
+                   __ATOMIC_RELAXED) / (now - started) : 0.0);
+    }
+    free(total);
+}
+
+void stats_init(void)
+{
+    ctl_register("stats", stats_render_text);
+    ctl_register("stats.json", stats_render_json);
+    ctl_register("roundtrips", stats_render_roundtrips);
+    ctl_register("profile", stats_render_profile);
+    ctl_register("metrics", stats_render_prometheus);
+}
@@ -0,0 +1,94 @@
+/*
+  Per-operation statistics: latency of every FUSE callback and of every
+  redis command, exposed under the control directory.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hist.h"
+
+// One entry per FUSE callback in f4r_oper
+enum f4r_op {
+    OP_GETATTR, OP_READLINK, OP_MKNOD, OP_MKDIR, OP_UNLINK, OP_RMDIR,
+    OP_SYMLINK, OP_RENAME, OP_LINK, OP_CHMOD, OP_CHOWN, OP_TRUNCATE,
+    OP_UTIME, OP_OPEN, OP_READ, OP_WRITE, OP_STATFS, OP_FLUSH, OP_RELEASE,
+    OP_FSYNC, OP_SETXATTR, OP_GETXATTR, OP_LISTXATTR, OP_REMOVEXATTR,
+    OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_FSYNCDIR, OP_ACCESS,
+    OP_FTRUNCATE, OP_FGETATTR,
+    OP_COUNT
+};
+
+// Redis commands issued by the KVS layer. Anything else counts as CMD_OTHER.
+enum kvs_cmd {
+    CMD_SET, CMD_EXISTS, CMD_UNLINK, CMD_RENAME, CMD_STRLEN, CMD_SETRANGE,
+    CMD_GETRANGE, CMD_KEYS, CMD_WAIT, CMD_WAITAOF, CMD_MSET, CMD_EVALSHA, CMD_OTHER,
+    CMD_COUNT
+};
+
+// What the cache of an immutable mount keeps, see cache.c
+enum cache_kind {
+    CACHE_ATTR, CACHE_DIR, CACHE_DATA,
+    CACHE_KINDS
+};
+
+// Redis commands remembered per operation for the slow operation log
+#define OPCTX_CMDS 16
+
+// The FUSE operation a thread is currently serving. Lives on the stack of
+// the instrumented callback. Redis commands issued while it runs are
+// charged to it.
+struct f4r_opctx {
+    int op;
+    const char *path;
+    const char *path2;      // New path of a rename
+    int flags;              // Open flags of an open
+    size_t size;
+    off_t offset;
+    uint64_t start;
+    uint64_t nanos;         // Latency, set when the operation is left
+    unsigned cmds;          // Redis commands issued
+    uint64_t bytes_out;     // Bytes of redis protocol sent
+    uint64_t bytes_in;      // and received
+    uint64_t redis_ns;      // Wall time spent waiting for redis
+    uint64_t queue_ns;      // of which queued for a connection,
+    uint64_t send_ns;       // batched and written,
+    uint64_t wire_ns;       // in the network and redis,
+    uint64_t wake_ns;       // and waking up once the reply was in
+    uint64_t slowest_cmd;   // Latency of the slowest of them
+    unsigned long long seq; // Number in the command log, 0 until it logs a command
+    struct {
+        int cmd;
+        uint64_t nanos;
+    } cmd[OPCTX_CMDS];      // The first OPCTX_CMDS of them
+};
+
+extern const char *stats_op_names[OP_COUNT];
+extern const char *stats_cmd_names[CMD_COUNT];
+extern __thread struct f4r_opctx *stats_curop;
+
+void stats_init(void);
+void stats_op_enter(struct f4r_opctx *ctx, int op, const char *path, size_t size, off_t offset);
+int stats_op_leave(struct f4r_opctx *ctx, int result);
+int stats_cmd_id(const char *format);
+void stats_cmd_record(int cmd, uint64_t nanos, int failed, size_t bytes_out, size_t bytes_in);
+void stats_cmd_stages(uint64_t queue_ns, uint64_t send_ns, uint64_t wire_ns, uint64_t wake_ns);
+void stats_io_start(int conn);
+void stats_io_batch(int conn, unsigned commands, long depth, uint64_t busy_ns);
+void stats_io_sync(int led);
+void stats_io_reconnect(void);
+void stats_io_expired(void);
+void stats_checksum_error(void);
+void stats_cache(int kind, int hit);
+
+struct ctl_buf;
+void stats_render_prometheus(struct ctl_buf *out);
+
+#endif
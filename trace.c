@@ -0,0 +1,192 @@
+/*
+  Workload trace recorder: a compact binary record of every FUSE operation,
+  which f4r_replay can play back to reproduce a production access pattern.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Records are 48 bytes and collected in a buffer written out with one
+  write() when full, so the cost per operation is a short critical
+  section. '-o trace_file=PATH' prepares the file and '-o trace' starts
+  recording right away. Otherwise SIGUSR2 starts it, and stops it again.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctl.h"
+#include "log.h"
+#include "trace.h"
+
+#define TRACE_BUFFER 1024       // Records buffered before a write()
+#define TRACE_THREADS 65536     // Thread numbers a record can hold
+
+volatile int trace_wanted = 0;  // Set from the signal handler
+int trace_active = 0;           // Changed only under trace_lock
+
+static int trace_fd = -1;
+static uint64_t trace_start;
+static struct trace_record trace_buffer[TRACE_BUFFER];
+static unsigned trace_used;
+static uint64_t trace_threads[TRACE_THREADS / 64];    // Numbers in use
+static __thread int trace_thread_id = -1;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t trace_hash(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *path != '\0'; path++) {
+        hash ^= (unsigned char) *path;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Thread exit: its number goes to the next new thread. libfuse starts and
+// ends workers as the load changes, so the numbers stay as few as the
+// threads running at once, which is what f4r_replay starts.
+static void trace_thread_exit(void *arg)
+{
+    unsigned id = (uintptr_t) arg - 1;
+
+    pthread_mutex_lock(&trace_lock);
+    trace_threads[id / 64] &= ~(1ULL << (id % 64));
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Lowest free number, called with trace_lock held. Should all be taken,
+// the last one is shared.
+static int trace_thread_new(void)
+{
+    unsigned j, id = TRACE_THREADS - 1;
+
+    for (j = 0; j < TRACE_THREADS / 64; j++)
+        if (~trace_threads[j] != 0) {
+            id = j * 64 + __builtin_ctzll(~trace_threads[j]);
+            break;
+        }
+    trace_threads[id / 64] |= 1ULL << (id % 64);
+    pthread_setspecific(trace_key, (void *) (uintptr_t) (id + 1));
+    return id;
+}
+
+static void trace_flush(void)
+{
+    size_t len = trace_used * sizeof(struct trace_record);
+    const char *data = (const char *) trace_buffer;
+
+    while (len > 0) {
+        ssize_t written = write(trace_fd, data, len);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            log_err("trace: write failed, recording stopped: %s\n", strerror(errno));
+            trace_active = trace_wanted = 0;
+            break;
+        }
+        data += written;
+        len -= written;
+    }
+    trace_used = 0;
+}
+
+void trace_record_op(const struct f4r_opctx *ctx, int result)
+{
+    struct trace_record *r;
+
+    if (ctx->path != NULL && ctl_is_path(ctx->path))
+        return;     // Reading our own statistics is not part of the workload
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_active != trace_wanted) {     // Toggled by SIGUSR2
+        if (trace_active)
+            trace_flush();
+        trace_active = trace_wanted;
+        log_info("trace: recording %s\n", trace_active ? "started" : "stopped");
+    }
+    if (!trace_active) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    if (trace_thread_id < 0)
+        trace_thread_id = trace_thread_new();
+
+    r = &trace_buffer[trace_used++];
+    r->timestamp = ctx->start - trace_start;
+    r->path_hash = ctx->path != NULL ? trace_hash(ctx->path) : 0;
+    r->path2_hash = ctx->path2 != NULL ? trace_hash(ctx->path2) : 0;
+    r->offset = ctx->offset;
+    r->size = ctx->op == OP_OPEN ? (uint32_t) ctx->flags : (uint32_t) ctx->size;
+    r->latency_us = ctx->nanos / 1000 > UINT32_MAX ? UINT32_MAX : ctx->nanos / 1000;
+    r->result = result;
+    r->thread = trace_thread_id;
+    r->op = ctx->op;
+    r->reserved = 0;
+    if (trace_used == TRACE_BUFFER)
+        trace_flush();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_signal(int sig)
+{
+    trace_wanted = !trace_wanted;
+}
+
+// Opens (truncates) the trace file. Recording begins now if 'start' is set,
+// or when SIGUSR2 is received.
+int trace_init(const char *path, int start)
+{
+    struct trace_header header;
+    struct sigaction sa;
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0)
+        return -errno;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.start_sec = time(NULL);
+    header.record_size = sizeof(struct trace_record);
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -EIO;
+    }
+    trace_start = hist_now();
+    pthread_key_create(&trace_key, trace_thread_exit);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, NULL);
+
+    trace_wanted = start;
+    return 0;
+}
+
+void trace_stop(void)
+{
+    if (trace_fd < 0)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_active)
+        trace_flush();
+    trace_active = trace_wanted = 0;
+    close(trace_fd);
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,57 @@
+/*
+  Workload trace recorder: a compact binary record of every FUSE operation,
+  which f4r_replay can play back to reproduce a production access pattern.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#include "stats.h"
+
+#define TRACE_MAGIC "F4RTRC1"
+
+// The file starts with this header, followed by trace_record's in the
+// byte order of the machine that recorded them.
+struct trace_header {
+    char magic[8];              // TRACE_MAGIC
+    uint64_t start_sec;         // Wall clock time the trace started
+    uint32_t record_size;       // sizeof(struct trace_record)
+    uint32_t reserved;
+};
+
+struct trace_record {
+    uint64_t timestamp;         // Nanoseconds since the trace started
+    uint64_t path_hash;         // FNV-1a of the path. Paths are not recorded
+    uint64_t path2_hash;        // New path of a rename, 0 otherwise
+    int64_t offset;
+    uint32_t size;              // Bytes for read/write, open flags for open
+    uint32_t latency_us;
+    int32_t result;
+    uint16_t thread;            // Small number, reused once a thread exits
+    uint8_t op;                 // OP_* from stats.h
+    uint8_t reserved;
+};
+
+extern volatile int trace_wanted;
+extern int trace_active;
+
+int trace_init(const char *path, int start);
+void trace_stop(void);
+void trace_record_op(const struct f4r_opctx *ctx, int result);
+uint64_t trace_hash(const char *path);
+
+// Called as every operation ends. Recording can be toggled with SIGUSR2,
+// the first operation after the signal does the actual switch.
+static inline void trace_check(const struct f4r_opctx *ctx, int result)
+{
+    if (trace_active || trace_wanted)
+        trace_record_op(ctx, result);
+}
+
+#endif
@@ -0,0 +1,594 @@
+/*
+  Write-ahead journal: with '-o wal=PATH' writes are made durable in a
+  local file and acknowledged, and a background thread applies them to
+  redis in order. Reads and sizes see writes still in the journal.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The file starts with a header holding the checkpoint, the sequence
+  number up to which every record is known to be in redis. Records follow,
+  each with a CRC-32C of its header and data. A write appends a record and
+  fdatasync()s the file; writers arriving while one syncs are covered by
+  the next sync. Records also stay in memory, in order and indexed by key,
+  until the replay thread has applied them with SETRANGE. Once all are
+  applied the file is cut back to its header.
+
+  At mount, records past the checkpoint are loaded and replayed. A torn
+  record at the end, from a crash in the middle of an append, is dropped.
+  SETRANGE is idempotent, so replaying a record redis already has is
+  harmless, unless the key was since truncated, renamed or deleted. So
+  those operations call wal_barrier() first: it waits until the key's
+  records are applied and moves the checkpoint past them.
+
+  Writers wait when more than '-o wal_max_mb' (default 64) MB are not yet
+  in redis, so memory stays bounded when redis is slow.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "ctl.h"
+#include "kvs.h"
+#include "log.h"
+#include "wal.h"
+
+#define WAL_MAGIC       0x57523446  // "F4RW"
+#define WAL_KEY_MAX     1024
+#define WAL_BUCKETS     1024
+#define WAL_PIN_MAX     64          // Records a read overlays without allocating
+
+struct wal_file_header {
+    char magic[8];                  // "F4RWAL1"
+    uint64_t checkpoint;
+    uint32_t crc;                   // Of the fields above
+    uint32_t pad;
+};
+
+// On disk, followed by the key and the data
+struct wal_record_header {
+    uint32_t magic;
+    uint32_t crc;                   // Of everything after this field, data included
+    uint64_t seq;
+    uint64_t offset;
+    uint32_t len;
+    uint16_t keylen;
+    uint16_t pad;
+};
+
+struct wal_key;
+
+struct wal_record {
+    struct wal_record *next;        // In the order they are applied
+    struct wal_record *keynext;     // Next record of the same key
+    struct wal_key *key;
+    uint64_t seq;
+    off_t offset;
+    size_t len;
+    int refs;                       // The queue's, plus one per read using it
+    char data[];
+};
+
+// Records of a key not yet in redis, oldest first
+struct wal_key {
+    struct wal_key *next;           // In its hash bucket
+    struct wal_record *first, *last;
+    char name[];
+};
+
+int wal_enabled = 0;
+
+static int wal_fd = -1;
+static off_t wal_end;               // Where the next record goes
+static uint64_t wal_next_seq = 1;
+static uint64_t wal_written;        // Last record written to the file
+static uint64_t wal_synced;         // Last record made durable
+static uint64_t wal_applied;        // Last record in redis
+static uint64_t wal_checkpoint;     // As in the file header
+static size_t wal_pending;          // Bytes not yet in redis
+static size_t wal_max;
+static struct wal_record *wal_head, *wal_tail;
+static struct wal_key *wal_keys[WAL_BUCKETS];
+static int wal_stopping;
+static pthread_t wal_thread;
+static int wal_running;
+static uint64_t wal_stalls;         // Writers that waited for room
+
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_appended = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wal_progress = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t wal_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned wal_hash(const char *name)
+{
+    unsigned hash = 2166136261u;
+
+    for (; *name != '\0'; name++)
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    return hash % WAL_BUCKETS;
+}
+
+static struct wal_key *wal_find(const char *name)
+{
+    struct wal_key *k;
+
+    for (k = wal_keys[wal_hash(name)]; k != NULL; k = k->next)
+        if (strcmp(k->name, name) == 0)
+            return k;
+    return NULL;
+}
+
+static void wal_unref(struct wal_record *rec)
+{
+    if (__atomic_sub_fetch(&rec->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(rec);
+}
+
+// Finds the records of a key, adding an empty list if it has none. Called
+// with wal_lock held.
+static struct wal_key *wal_key_get(const char *name)
+{
+    struct wal_key *k = wal_find(name);
+
+    if (k == NULL) {
+        unsigned b = wal_hash(name);
+
+        if ((k = malloc(sizeof(struct wal_key) + strlen(name) + 1)) == NULL)
+            return NULL;
+        strcpy(k->name, name);
+        k->first = k->last = NULL;
+        k->next = wal_keys[b];
+        wal_keys[b] = k;
+    }
+    return k;
+}
+
+// Removes a key left without records. Called with wal_lock held.
+static void wal_key_put(struct wal_key *k)
+{
+    struct wal_key **link;
+
+    if (k->first != NULL)
+        return;
+    for (link = &wal_keys[wal_hash(k->name)]; *link != k; link = &(*link)->next)
+        ;
+    *link = k->next;
+    free(k);
+}
+
+// Queues a record in memory. Called with wal_lock held.
+static void wal_queue(struct wal_record *rec, struct wal_key *k)
+{
+    rec->key = k;
+    rec->next = rec->keynext = NULL;
+    rec->refs = 1;
+    if (k->last != NULL)
+        k->last->keynext = rec;
+    else
+        k->first = rec;
+    k->last = rec;
+    if (wal_tail != NULL)
+        wal_tail->next = rec;
+    else
+        wal_head = rec;
+    wal_tail = rec;
+    wal_pending += rec->len;
+}
+
+// Drops the oldest record once it is in redis. Called with wal_lock held.
+static void wal_dequeue(struct wal_record *rec)
+{
+    struct wal_key *k = rec->key;
+
+    wal_head = rec->next;
+    if (wal_head == NULL)
+        wal_tail = NULL;
+    k->first = rec->keynext;
+    wal_key_put(k);
+    wal_pending -= rec->len;
+    wal_applied = rec->seq;
+    wal_unref(rec);
+}
+
+static int wal_write_header(uint64_t checkpoint)
+{
+    struct wal_file_header h;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "F4RWAL1", 8);
+    h.checkpoint = checkpoint;
+    h.crc = crc32c(0, &h, offsetof(struct wal_file_header, crc));
+    if (pwrite(wal_fd, &h, sizeof(h), 0) != sizeof(h))
+        return -errno;
+    return 0;
+}
+
+// Makes every record written so far durable. Callers that find a sync in
+// progress wait for it, and often find their record covered by it.
+static int wal_make_durable(uint64_t seq)
+{
+    uint64_t target;
+    int result = 0;
+
+    pthread_mutex_lock(&wal_sync_lock);
+    if (__atomic_load_n(&wal_synced, __ATOMIC_ACQUIRE) < seq) {
+        pthread_mutex_lock(&wal_lock);
+        target = wal_written;
+        pthread_mutex_unlock(&wal_lock);
+        if (fdatasync(wal_fd) != 0)
+            result = -errno;
+        else
+            __atomic_store_n(&wal_synced, target, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&wal_sync_lock);
+    return result;
+}
+
+// Moves the checkpoint up to what redis has. Called with wal_lock held.
+static int wal_advance_checkpoint(void)
+{
+    int result;
+
+    if (wal_checkpoint >= wal_applied)
+        return 0;
+    if ((result = wal_write_header(wal_applied)) == 0 && fdatasync(wal_fd) != 0)
+        result = -errno;
+    if (result == 0)
+        wal_checkpoint = wal_applied;
+    return result;
+}
+
+int wal_write(const char *key, const char *buf, size_t size, off_t offset)
+{
+    struct wal_record_header h;
+    struct wal_record *rec;
+    struct wal_key *k;
+    size_t keylen = strlen(key);
+    char *record;
+    size_t total = sizeof(h) + keylen + size;
+    ssize_t done;
+    int result;
+
+    if (keylen > WAL_KEY_MAX)
+        return -ENAMETOOLONG;
+    if ((rec = malloc(sizeof(struct wal_record) + size)) == NULL)
+        return -ENOMEM;
+    if ((record = malloc(total)) == NULL) {
+        free(rec);
+        return -ENOMEM;
+    }
+    memcpy(rec->data, buf, size);
+    rec->offset = offset;
+    rec->len = size;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = WAL_MAGIC;
+    h.offset = offset;
+    h.len = size;
+    h.keylen = keylen;
+    memcpy(record + sizeof(h), key, keylen);
+    memcpy(record + sizeof(h) + keylen, buf, size);
+
+    pthread_mutex_lock(&wal_lock);
+    while (wal_pending > 0 && wal_pending + size > wal_max && !wal_stopping) {
+        wal_stalls++;
+        pthread_cond_wait(&wal_progress, &wal_lock);
+    }
+    // Whatever can fail comes before the append, so a failed write leaves
+    // nothing in the journal that a remount would replay
+    if ((k = wal_key_get(key)) == NULL) {
+        pthread_mutex_unlock(&wal_lock);
+        free(record);
+        free(rec);
+        return -ENOMEM;
+    }
+    rec->seq = h.seq = wal_next_seq++;
+    h.crc = crc32c(0, (char *) &h + offsetof(struct wal_record_header, seq),
+                   sizeof(h) - offsetof(struct wal_record_header, seq));
+    h.crc = crc32c(h.crc, record + sizeof(h), keylen + size);
+    memcpy(record, &h, sizeof(h));
+    done = pwrite(wal_fd, record, total, wal_end);
+    if (done != (ssize_t) total) {
+        result = done < 0 ? -errno : -ENOSPC;
+        wal_key_put(k);
+        pthread_mutex_unlock(&wal_lock);
+        log_err("wal_write: ERROR - cannot append to the journal: %s\n", strerror(-result));
+        free(record);
+        free(rec);
+        return result;
+    }
+    wal_end += total;
+    wal_written = rec->seq;
+    wal_queue(rec, k);
+    pthread_cond_signal(&wal_appended);
+    pthread_mutex_unlock(&wal_lock);
+    free(record);
+
+    result = wal_make_durable(h.seq);
+    return result < 0 ? result : (int) size;
+}
+
+// Reads from redis and lays the key's records still in the journal over
+// what redis returned, oldest first. The records are pinned first, so one
+// applied and dropped in the meantime is still seen.
+int wal_read(const char *key, char *buf, size_t size, off_t offset)
+{
+    struct wal_record *local[WAL_PIN_MAX], **pinned = local, *rec;
+    struct wal_key *k;
+    int count = 0, max = WAL_PIN_MAX, length, j;
+
+    pthread_mutex_lock(&wal_lock);
+    if ((k = wal_find(key)) != NULL)
+        for (rec = k->first; rec != NULL; rec = rec->keynext) {
+            if (rec->offset >= offset + (off_t) size || rec->offset + (off_t) rec->len <= offset)
+                continue;
+            if (count == max) {
+                struct wal_record **more = malloc(2 * max * sizeof(*more));
+
+                if (more == NULL)
+                    break;      // Unlikely, and redis will have them soon
+                memcpy(more, pinned, count * sizeof(*more));
+                if (pinned != local)
+                    free(pinned);
+                pinned = more;
+                max *= 2;
+            }
+            __atomic_add_fetch(&rec->refs, 1, __ATOMIC_RELAXED);
+            pinned[count++] = rec;
+        }
+    pthread_mutex_unlock(&wal_lock);
+
+    length = kvs_ReadPartialValue(key, buf, size, offset);
+    for (j = 0; j < count; j++) {
+        rec = pinned[j];
+        if (length >= 0) {
+            off_t from = rec->offset > offset ? rec->offset : offset;
+            off_t to = rec->offset + (off_t) rec->len < offset + (off_t) size ?
+                       rec->offset + (off_t) rec->len : offset + (off_t) size;
+
+            if (from - offset > length)     // Past the end of the value, a hole
+                memset(buf + length, 0, from - offset - length);
+            memcpy(buf + (from - offset), rec->data + (from - rec->offset), to - from);
+            if (to - offset > length)
+                length = to - offset;
+        }
+        wal_unref(rec);
+    }
+    if (pinned != local)
+        free(pinned);
+    return length;
+}
+
+// Size of a key once its records in the journal are applied
+size_t wal_length(const char *key, size_t length)
+{
+    struct wal_record *rec;
+    struct wal_key *k;
+
+    pthread_mutex_lock(&wal_lock);
+    if ((k = wal_find(key)) != NULL)
+        for (rec = k->first; rec != NULL; rec = rec->keynext)
+            if (rec->offset + rec->len > length)
+                length = rec->offset + rec->len;
+    pthread_mutex_unlock(&wal_lock);
+    return length;
+}
+
+// Before an operation that changes a key other than by writing to it: its
+// records must be in redis first, and must not be replayed after it.
+int wal_barrier(const char *key)
+{
+    struct wal_key *k;
+    uint64_t last;
+    int result;
+
+    pthread_mutex_lock(&wal_lock);
+    if ((k = wal_find(key)) != NULL) {
+        last = k->last->seq;
+        while (wal_applied < last && !wal_stopping)
+            pthread_cond_wait(&wal_progress, &wal_lock);
+        if (wal_applied < last) {
+            pthread_mutex_unlock(&wal_lock);
+            return -EIO;
+        }
+    }
+    result = wal_advance_checkpoint();
+    pthread_mutex_unlock(&wal_lock);
+    return result;
+}
+
+// fsync(): writes are durable once acknowledged, only a failed sync could
+// have left one behind
+int wal_sync(void)
+{
+    uint64_t written;
+
+    pthread_mutex_lock(&wal_lock);
+    written = wal_written;
+    pthread_mutex_unlock(&wal_lock);
+    return wal_make_durable(written);
+}
+
+// Applies the records to redis, oldest first. A failed record is retried,
+// since skipping it would reorder writes.
+static void *wal_replay(void *arg)
+{
+    struct wal_record *rec;
+    int result;
+
+    pthread_mutex_lock(&wal_lock);
+    for (;;) {
+        while (wal_head == NULL && !wal_stopping)
+            pthread_cond_wait(&wal_appended, &wal_lock);
+        if (wal_stopping)
+            break;
+        rec = wal_head;
+        pthread_mutex_unlock(&wal_lock);
+
+        result = kvs_WritePartialValue(rec->key->name, rec->data, rec->len, rec->offset);
+        if (result < 0) {
+            log_warn("wal_replay: cannot apply journal record %llu: %s, retrying\n",
+                     (unsigned long long) rec->seq, strerror(-result));
+            usleep(100000);
+            pthread_mutex_lock(&wal_lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&wal_lock);
+        wal_dequeue(rec);
+        if (wal_head == NULL && wal_advance_checkpoint() == 0 &&
+            ftruncate(wal_fd, sizeof(struct wal_file_header)) == 0)
+            wal_end = sizeof(struct wal_file_header);
+        pthread_cond_broadcast(&wal_progress);
+    }
+    pthread_mutex_unlock(&wal_lock);
+    return NULL;
+}
+
+// Reads the records a previous mount left. Returns the number queued.
+static long wal_recover(void)
+{
+    struct wal_record_header h;
+    char key[WAL_KEY_MAX + 1];
+    off_t pos = sizeof(struct wal_file_header);
+    long count = 0;
+
+    for (;;) {
+        struct wal_record *rec;
+        struct wal_key *k;
+        uint32_t crc;
+
+        if (pread(wal_fd, &h, sizeof(h), pos) != sizeof(h) || h.magic != WAL_MAGIC ||
+            h.keylen > WAL_KEY_MAX || h.keylen == 0)
+            break;
+        if ((rec = malloc(sizeof(struct wal_record) + h.len)) == NULL)
+            break;
+        if (pread(wal_fd, key, h.keylen, pos + sizeof(h)) != h.keylen ||
+            pread(wal_fd, rec->data, h.len, pos + sizeof(h) + h.keylen) != (ssize_t) h.len) {
+            free(rec);
+            break;
+        }
+        crc = crc32c(0, (char *) &h + offsetof(struct wal_record_header, seq),
+                     sizeof(h) - offsetof(struct wal_record_header, seq));
+        crc = crc32c(crc, key, h.keylen);
+        crc = crc32c(crc, rec->data, h.len);
+        if (crc != h.crc) {
+            free(rec);
+            break;
+        }
+        key[h.keylen] = '\0';
+        pos += sizeof(h) + h.keylen + h.len;
+        if (h.seq >= wal_next_seq)
+            wal_next_seq = h.seq + 1;
+        if (h.seq <= wal_checkpoint) {      // Already in redis
+            free(rec);
+            continue;
+        }
+        rec->seq = h.seq;
+        rec->offset = h.offset;
+        rec->len = h.len;
+        if ((k = wal_key_get(key)) == NULL) {
+            free(rec);
+            break;
+        }
+        wal_queue(rec, k);
+        count++;
+    }
+    // Anything after the last good record is a torn append
+    if (ftruncate(wal_fd, pos) != 0)
+        return -errno;
+    wal_end = pos;
+    wal_written = wal_synced = wal_next_seq - 1;
+    wal_applied = wal_checkpoint;
+    return count;
+}
+
+static void wal_render(struct ctl_buf *out)
+{
+    pthread_mutex_lock(&wal_lock);
+    ctl_printf(out, "pending_bytes %zu\nfile_bytes %lld\nnext_seq %llu\napplied_seq %llu\n"
+               "checkpoint_seq %llu\nstalls %llu\n", wal_pending, (long long) wal_end,
+               (unsigned long long) wal_next_seq, (unsigned long long) wal_applied,
+               (unsigned long long) wal_checkpoint, (unsigned long long) wal_stalls);
+    pthread_mutex_unlock(&wal_lock);
+}
+
+// Opens the journal, creating it if needed, and loads what a previous mount
+// did not apply. Runs before FUSE starts, the records are applied once
+// wal_start() is called.
+int wal_init(const char *path, unsigned max_mb)
+{
+    struct wal_file_header h;
+    ssize_t done;
+    long count;
+
+    if ((wal_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+        return -errno;
+    done = pread(wal_fd, &h, sizeof(h), 0);
+    if (done == 0) {
+        if (wal_write_header(0) != 0 || fdatasync(wal_fd) != 0)
+            goto fail;
+    } else if (done != sizeof(h) || memcmp(h.magic, "F4RWAL1", 8) != 0 ||
+               h.crc != crc32c(0, &h, offsetof(struct wal_file_header, crc))) {
+        errno = EINVAL;         // Not a journal, better not overwrite it
+        goto fail;
+    } else
+        wal_checkpoint = h.checkpoint;
+
+    wal_next_seq = wal_checkpoint + 1;
+    if ((count = wal_recover()) < 0) {
+        errno = -count;
+        goto fail;
+    }
+    if (count > 0)
+        log_info("wal_init: %ld journal records to apply\n", count);
+    wal_max = (size_t) (max_mb > 0 ? max_mb : 64) << 20;
+    wal_enabled = 1;
+    ctl_register("wal", wal_render);
+    return 0;
+
+fail:
+    close(wal_fd);
+    wal_fd = -1;
+    return -errno;
+}
+
+// Starts applying records. Must run after fuse_main() daemonizes.
+int wal_start(void)
+{
+    int result;
+
+    if (!wal_enabled)
+        return 0;
+    wal_stopping = 0;
+    if ((result = pthread_create(&wal_thread, NULL, wal_replay, NULL)) != 0)
+        return -result;
+    wal_running = 1;
+    return 0;
+}
+
+// Records not applied yet stay in the journal for the next mount
+void wal_stop(void)
+{
+    if (!wal_enabled)
+        return;
+    pthread_mutex_lock(&wal_lock);
+    wal_stopping = 1;
+    pthread_cond_broadcast(&wal_appended);
+    pthread_cond_broadcast(&wal_progress);
+    pthread_mutex_unlock(&wal_lock);
+    if (wal_running)
+        pthread_join(wal_thread, NULL);
+    wal_running = 0;
+    fdatasync(wal_fd);
+    close(wal_fd);
+    wal_fd = -1;
+}
@@ -0,0 +1,29 @@
+/*
+  Write-ahead journal: with '-o wal=PATH' writes are made durable in a
+  local file and acknowledged, and a background thread applies them to
+  redis in order. Reads and sizes see writes still in the journal.
+  Copyright (C) 2016 Roque Luis Scheer <roqscheer@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <sys/types.h>
+
+extern int wal_enabled;
+
+int wal_init(const char *path, unsigned max_mb);
+int wal_start(void);
+void wal_stop(void);
+
+// These return like their kvs_* counterparts
+int wal_write(const char *key, const char *buf, size_t size, off_t offset);
+int wal_read(const char *key, char *buf, size_t size, off_t offset);
+size_t wal_length(const char *key, size_t length);
+int wal_barrier(const char *key);
+int wal_sync(void);
+
+#endif